@@ -0,0 +1,2171 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "defrag.h"
+#include "shard.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define BENCH_FRAGMENT_BYTES 8
+#define BENCH_FRAGMENTS_PER_PACKET 8
+
+static FILE* report;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hardware cache-miss counter for this thread, or -1 where the kernel or the
+// machine (e.g. most VMs) exposes no PMU.
+static int cache_miss_counter_open(void) {
+#if defined(__linux__)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static long long cache_miss_counter_read(int fd) {
+    long long value = -1;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != (ssize_t)sizeof(value)) return -1;
+    return value;
+}
+
+static void shuffle(int* order, int count, unsigned int* seed) {
+    for (int i = count - 1; i > 0; i--) {
+        *seed = *seed * 1103515245u + 12345u;
+        int j = (int)((*seed >> 16) % (unsigned int)(i + 1));
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+static void bench_packet_table(void) {
+    static const int in_flight[] = { 128, 1024, 10000, 100000 };
+    const int packet_size = BENCH_FRAGMENT_BYTES * BENCH_FRAGMENTS_PER_PACKET;
+    char payload[BENCH_FRAGMENT_BYTES + 1];
+    memset(payload, 'x', BENCH_FRAGMENT_BYTES);
+    payload[BENCH_FRAGMENT_BYTES] = '\0';
+
+    fprintf(report, "\n--- packet table: fragment throughput vs in-flight packets ---\n");
+    fprintf(report, "%10s %14s %14s\n", "packets", "fragments", "frags/sec");
+
+    for (size_t n = 0; n < sizeof(in_flight) / sizeof(in_flight[0]); n++) {
+        int packets = in_flight[n];
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = packets;
+
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        for (int id = 0; id < packets; id++) {
+            system_register_packet(&system, id, packet_size);
+        }
+
+        // Fragments are interleaved across every packet so that all of them
+        // stay in flight until the final round completes them.
+        double start = now_seconds();
+        for (int frag = 0; frag < BENCH_FRAGMENTS_PER_PACKET; frag++) {
+            bool is_last = frag == BENCH_FRAGMENTS_PER_PACKET - 1;
+            for (int id = 0; id < packets; id++) {
+                system_add_fragment(&system, id, frag * BENCH_FRAGMENT_BYTES, payload, is_last);
+            }
+        }
+        double elapsed = now_seconds() - start;
+
+        long fragments = system.stats.total_fragments_processed;
+        fprintf(report, "%10d %14ld %14.0f\n", packets, fragments, fragments / elapsed);
+        system_cleanup(&system);
+    }
+}
+
+static void bench_reassembly_buffer(void) {
+    enum { PACKETS = 200, FRAG_SIZE = 512 };
+    const int packet_size = MAX_PACKET_SIZE_BYTES;
+    const int frag_count = (packet_size + FRAG_SIZE - 1) / FRAG_SIZE;
+    static const char* arrival_names[] = { "in-order", "reversed", "random" };
+    static const ReassemblyMode modes[] = { REASSEMBLY_MERGE, REASSEMBLY_BUFFER };
+    static const char* mode_names[] = { "merge", "buffer" };
+
+    int* order = (int*)malloc(frag_count * sizeof(int));
+    uint8_t* payload = (uint8_t*)malloc(packet_size);
+    if (order == NULL || payload == NULL) {
+        free(order);
+        free(payload);
+        return;
+    }
+    for (int i = 0; i < packet_size; i++) {
+        payload[i] = (uint8_t)(i * 7);
+    }
+
+    fprintf(report, "\n--- reassembly: merge-on-insert vs preallocated buffer (%d-byte packets, %d-byte fragments) ---\n",
+            packet_size, FRAG_SIZE);
+    fprintf(report, "%-10s %-8s %16s %12s\n", "arrival", "mode", "bytes/packet", "usec/packet");
+
+    for (int arrival = 0; arrival < 3; arrival++) {
+        for (int m = 0; m < 2; m++) {
+            SystemConfig config;
+            system_config_init(&config);
+            config.reassembly_mode = modes[m];
+
+            DefragmenterSystem system;
+            system_init_with_config(&system, &config);
+            unsigned int seed = 42;
+
+            double start = now_seconds();
+            for (int id = 0; id < PACKETS; id++) {
+                for (int i = 0; i < frag_count; i++) {
+                    order[i] = arrival == 1 ? frag_count - 1 - i : i;
+                }
+                if (arrival == 2) shuffle(order, frag_count, &seed);
+
+                system_register_packet(&system, id, packet_size);
+                for (int i = 0; i < frag_count; i++) {
+                    int offset = order[i] * FRAG_SIZE;
+                    int length = packet_size - offset < FRAG_SIZE ? packet_size - offset : FRAG_SIZE;
+                    system_add_fragment_ex(&system, id, offset, payload + offset, length,
+                                           order[i] == frag_count - 1 ? FRAGMENT_FLAG_LAST : 0);
+                }
+            }
+            double elapsed = now_seconds() - start;
+
+            fprintf(report, "%-10s %-8s %16ld %12.1f\n", arrival_names[arrival], mode_names[m],
+                    system.stats.total_bytes_copied / PACKETS, elapsed * 1e6 / PACKETS);
+            system_cleanup(&system);
+        }
+    }
+    free(order);
+    free(payload);
+}
+
+static bool same_coverage(PacketAssembler* a, PacketAssembler* b) {
+    if (a->fragment_count != b->fragment_count ||
+        a->total_received_bytes != b->total_received_bytes ||
+        a->last_fragment_seen != b->last_fragment_seen ||
+        assembler_is_complete(a) != assembler_is_complete(b)) {
+        return false;
+    }
+    FragmentNode* x = a->fragment_list_head;
+    if (b->coverage == COVERAGE_ARRAY) {
+        for (int i = 0; i < b->fragment_count; i++, x = x->next) {
+            if (x == NULL || x->offset != b->spans[i].offset || x->length != b->spans[i].length) return false;
+        }
+        return x == NULL;
+    }
+    FragmentNode* y = b->fragment_list_head;
+    while (x != NULL && y != NULL) {
+        if (x->offset != y->offset || x->length != y->length) return false;
+        x = x->next;
+        y = y->next;
+    }
+    return x == NULL && y == NULL;
+}
+
+// Once complete, every index must hand over the same packet.
+static bool same_assembled_data(PacketAssembler* list, PacketAssembler* other[2]) {
+    if (!assembler_is_complete(list)) return true;
+    char* x = assembler_get_assembled_data(list);
+    bool same = x != NULL;
+    for (int k = 0; k < 2; k++) {
+        char* y = assembler_get_assembled_data(other[k]);
+        same = same && y != NULL && memcmp(x, y, list->total_size_expected) == 0;
+        assembler_free_assembled_data(other[k], y);
+    }
+    assembler_free_assembled_data(list, x);
+    return same;
+}
+
+// Differential check: the tree and array indexes must return exactly what the
+// list does.
+static bool verify_coverage_index(void) {
+    enum { TRIALS = 2000, OPS = 300 };
+    static const CoverageIndex others[] = { COVERAGE_TREE, COVERAGE_ARRAY };
+    static const char* other_names[] = { "tree", "array" };
+    static char payload[256];
+    for (int i = 0; i < (int)sizeof(payload); i++) payload[i] = (char)('a' + i % 26);
+    unsigned int seed = 7;
+    long ops = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        for (int m = 0; m < 2; m++) {
+            SystemConfig list_config;
+            system_config_init(&list_config);
+            list_config.reassembly_mode = m == 0 ? REASSEMBLY_MERGE : REASSEMBLY_BUFFER;
+            list_config.bitmap_coverage = false;
+            SystemConfig other_config[2];
+            PacketAssembler* other[2];
+
+            seed = seed * 1103515245u + 12345u;
+            int size = 1 + (int)((seed >> 8) % 4096);
+            PacketAssembler* list = create_assembler_with_config(trial, size, &list_config, NULL);
+            for (int k = 0; k < 2; k++) {
+                other_config[k] = list_config;
+                other_config[k].coverage_index = others[k];
+                other[k] = create_assembler_with_config(trial, size, &other_config[k], NULL);
+            }
+            int last_offset = 0, last_length = 1;
+            bool ok = true;
+
+            for (int op = 0; op < OPS && ok && !assembler_is_complete(list); op++) {
+                seed = seed * 1103515245u + 12345u;
+                unsigned int r = seed >> 4;
+                int offset, length;
+                if (r % 10 == 0) {
+                    offset = last_offset;
+                    length = last_length;
+                } else {
+                    int granule = 1 + (int)(r / 10 % 64);
+                    offset = (int)((r >> 12) % (unsigned int)(size / granule + 2)) * granule - (r % 50 == 1);
+                    // Some fragments are empty and land on an interval's start.
+                    length = (r >> 24) % 16 == 0 ? 0 : granule;
+                }
+                bool is_last = (r >> 20) % 16 == 0;
+                last_offset = offset;
+                last_length = length;
+                const char* data = payload + (r >> 8) % 128;
+
+                int a = assembler_add_fragment(list, offset, data, length, is_last);
+                ops++;
+                for (int k = 0; k < 2 && ok; k++) {
+                    int b = assembler_add_fragment(other[k], offset, data, length, is_last);
+                    if (a != b || !same_coverage(list, other[k])) {
+                        fprintf(report, "coverage mismatch: trial %d op %d offset %d length %d (list %d, %s %d)\n",
+                                trial, op, offset, length, a, other_names[k], b);
+                        ok = false;
+                    }
+                }
+            }
+            if (ok && !same_assembled_data(list, other)) {
+                fprintf(report, "assembled data mismatch: trial %d\n", trial);
+                ok = false;
+            }
+            free_assembler(list);
+            free_assembler(other[0]);
+            free_assembler(other[1]);
+            if (!ok) return false;
+        }
+    }
+    fprintf(report, "tree and array indexes matched the list on %ld fragment inserts\n", ops);
+    return true;
+}
+
+// Every coverage_index value a config accepts must run in every mode, with
+// and without the bitmap. The 5-byte fragment is off the block grid, so
+// bitmap packets are demoted part-way through.
+static bool verify_coverage_configs(void) {
+    enum { PACKETS = 64, SIZE = 1000 };
+    static const CoverageIndex indexes[] = { COVERAGE_LIST, COVERAGE_TREE, COVERAGE_BITMAP, COVERAGE_ARRAY };
+    static const ReassemblyMode modes[] = { REASSEMBLY_MERGE, REASSEMBLY_BUFFER, REASSEMBLY_GATHER };
+    static const int offsets[] = { 0, 8, 13, 512 };
+    static const int lengths[] = { 8, 5, 499, SIZE - 512 };
+    static uint8_t payload[SIZE];
+    int configs = 0;
+
+    for (size_t ix = 0; ix < sizeof(indexes) / sizeof(indexes[0]); ix++) {
+        for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+            for (int bitmap = 0; bitmap < 2; bitmap++) {
+                SystemConfig config;
+                system_config_init(&config);
+                config.coverage_index = indexes[ix];
+                config.reassembly_mode = modes[m];
+                config.bitmap_coverage = bitmap;
+                DefragmenterSystem system;
+                system_init_with_config(&system, &config);
+                for (int id = 0; id < PACKETS; id++) {
+                    system_register_packet(&system, id, SIZE);
+                    for (int f = 0; f < 4; f++) {
+                        // Odd packets arrive back to front.
+                        int k = id % 2 ? 3 - f : f;
+                        system_add_fragment_ex(&system, id, offsets[k], payload + offsets[k], lengths[k],
+                                               k == 3 ? FRAGMENT_FLAG_LAST : 0);
+                    }
+                }
+                long completed = system.stats.packets_completed;
+                system_cleanup(&system);
+                if (completed != PACKETS) {
+                    fprintf(report, "FAIL: coverage_index %d, mode %d, bitmap %d completed %ld of %d packets\n",
+                            (int)indexes[ix], (int)modes[m], bitmap, completed, PACKETS);
+                    return false;
+                }
+                configs++;
+            }
+        }
+    }
+    fprintf(report, "all %d coverage_index, mode and bitmap configurations completed their packets\n", configs);
+    return true;
+}
+
+static bool bench_coverage_index(void) {
+    enum { PACKETS = 20, FRAG_SIZE = 8 };
+    const int frag_count = MAX_PACKET_SIZE_BYTES / FRAG_SIZE;
+    const int packet_size = frag_count * FRAG_SIZE;
+    static const char* arrival_names[] = { "random", "strided" };
+    static const CoverageIndex indexes[] = { COVERAGE_LIST, COVERAGE_TREE };
+    static const char* index_names[] = { "list", "tree" };
+    static char payload[FRAG_SIZE];
+    memset(payload, 'y', sizeof(payload));
+
+    fprintf(report, "\n--- coverage index: sorted list vs treap (%d x %d-byte fragments) ---\n", frag_count, FRAG_SIZE);
+    if (!verify_coverage_index() || !verify_coverage_configs()) return false;
+
+    int* order = (int*)malloc(frag_count * sizeof(int));
+    if (order == NULL) return false;
+    fprintf(report, "%-10s %-6s %14s\n", "arrival", "index", "ns/fragment");
+
+    for (int arrival = 0; arrival < 2; arrival++) {
+        for (int ix = 0; ix < 2; ix++) {
+            SystemConfig config;
+            system_config_init(&config);
+            config.reassembly_mode = REASSEMBLY_BUFFER;
+            config.coverage_index = indexes[ix];
+            config.bitmap_coverage = false;
+            unsigned int seed = 99;
+
+            double elapsed = 0;
+            for (int p = 0; p < PACKETS; p++) {
+                for (int i = 0; i < frag_count; i++) {
+                    // Strided arrival sends every even fragment first, leaving
+                    // frag_count / 2 separate intervals for the odd ones to fill.
+                    order[i] = arrival == 1 ? (i < (frag_count + 1) / 2 ? i * 2 : (i - (frag_count + 1) / 2) * 2 + 1) : i;
+                }
+                if (arrival == 0) shuffle(order, frag_count, &seed);
+
+                PacketAssembler* assembler = create_assembler_with_config(p, packet_size, &config, NULL);
+                double start = now_seconds();
+                for (int i = 0; i < frag_count; i++) {
+                    assembler_add_fragment(assembler, order[i] * FRAG_SIZE, payload, FRAG_SIZE,
+                                           order[i] == frag_count - 1);
+                }
+                elapsed += now_seconds() - start;
+                free_assembler(assembler);
+            }
+            fprintf(report, "%-10s %-6s %14.1f\n", arrival_names[arrival], index_names[ix],
+                    elapsed * 1e9 / ((double)PACKETS * frag_count));
+        }
+    }
+    free(order);
+    return true;
+}
+
+// Differential check: the bitmap must make the same decisions as the list,
+// including after a misaligned fragment demotes it.
+static bool verify_bitmap_coverage(void) {
+    enum { TRIALS = 3000, OPS = 300 };
+    static char payload[512];
+    for (int i = 0; i < (int)sizeof(payload); i++) payload[i] = (char)(i * 13);
+    unsigned int seed = 11;
+    long ops = 0;
+    int demoted = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        SystemConfig list_config;
+        system_config_init(&list_config);
+        list_config.reassembly_mode = REASSEMBLY_BUFFER;
+        list_config.bitmap_coverage = false;
+        SystemConfig bitmap_config = list_config;
+        bitmap_config.bitmap_coverage = true;
+
+        seed = seed * 1103515245u + 12345u;
+        int size = trial % 3 == 0 ? PACKET_SIZE_UNKNOWN : 1 + (int)((seed >> 8) % 4096);
+        PacketAssembler* list = create_assembler_with_config(trial, size, &list_config, NULL);
+        PacketAssembler* bitmap = create_assembler_with_config(trial, size, &bitmap_config, NULL);
+        int last_offset = 0, last_length = 8;
+        int limit = size != PACKET_SIZE_UNKNOWN ? size : 4096;
+
+        for (int op = 0; op < OPS && !assembler_is_complete(list); op++) {
+            seed = seed * 1103515245u + 12345u;
+            unsigned int r = seed >> 4;
+            int offset, length;
+            if (r % 10 == 0) {
+                offset = last_offset;
+                length = last_length;
+            } else {
+                int granule = 8 * (1 + (int)(r / 10 % 16));
+                offset = (int)((r >> 12) % (unsigned int)(limit / granule + 2)) * granule;
+                length = granule;
+                if (offset < limit && offset + length > limit && r % 3 == 0) length = limit - offset;
+                if (r % 400 == 1) offset += 3;
+            }
+            bool is_last = (r >> 20) % 16 == 0 || offset + length == limit;
+            last_offset = offset;
+            last_length = length;
+
+            int a = assembler_add_fragment(list, offset, payload, length, is_last);
+            int b = assembler_add_fragment(bitmap, offset, payload, length, is_last);
+            ops++;
+            bool same = a == b &&
+                        list->fragment_count == bitmap->fragment_count &&
+                        list->total_received_bytes == bitmap->total_received_bytes &&
+                        list->total_size_expected == bitmap->total_size_expected &&
+                        assembler_is_complete(list) == assembler_is_complete(bitmap);
+            if (same && bitmap->coverage != COVERAGE_BITMAP) same = same_coverage(list, bitmap);
+            if (same && assembler_is_complete(list)) {
+                same = memcmp(list->buffer, bitmap->buffer, list->total_size_expected) == 0;
+            }
+            if (!same) {
+                fprintf(report, "bitmap mismatch: trial %d op %d offset %d length %d (list %d, bitmap %d)\n",
+                        trial, op, offset, length, a, b);
+                free_assembler(list);
+                free_assembler(bitmap);
+                return false;
+            }
+        }
+        demoted += bitmap->coverage != COVERAGE_BITMAP;
+        free_assembler(list);
+        free_assembler(bitmap);
+    }
+    fprintf(report, "bitmap matched the list on %ld fragment inserts (%d of %d packets demoted)\n", ops, demoted, TRIALS);
+    return true;
+}
+
+static bool bench_bitmap_coverage(void) {
+    enum { MIN_PACKETS = 16, MAX_PACKETS = 512 };
+    static const int fragment_sizes[] = { 8, 64, 1480 };
+    static const char* index_names[] = { "list", "tree", "bitmap" };
+    const int packet_size = MAX_PACKET_SIZE_BYTES / 8 * 8;
+    static char payload[MAX_PACKET_SIZE_BYTES];
+    memset(payload, 'b', sizeof(payload));
+
+    fprintf(report, "\n--- coverage bitmap: 8-byte block bitmap vs list and treap (%d-byte packets, random arrival) ---\n",
+            packet_size);
+    if (!verify_bitmap_coverage()) return false;
+
+    int* order = (int*)malloc((packet_size / 8) * sizeof(int));
+    if (order == NULL) return false;
+    fprintf(report, "%-10s %-8s %14s\n", "fragment", "index", "ns/fragment");
+
+    for (size_t f = 0; f < sizeof(fragment_sizes) / sizeof(fragment_sizes[0]); f++) {
+        int frag_size = fragment_sizes[f];
+        int frag_count = (packet_size + frag_size - 1) / frag_size;
+        // Fewer packets for small fragments, where the list walk dominates.
+        int packets = MIN_PACKETS * frag_size / 8 < MAX_PACKETS ? MIN_PACKETS * frag_size / 8 : MAX_PACKETS;
+        for (int ix = 0; ix < 3; ix++) {
+            SystemConfig config;
+            system_config_init(&config);
+            config.reassembly_mode = REASSEMBLY_BUFFER;
+            config.coverage_index = ix == 1 ? COVERAGE_TREE : COVERAGE_LIST;
+            config.bitmap_coverage = ix == 2;
+            unsigned int seed = 99;
+
+            double elapsed = 0;
+            for (int p = 0; p < packets; p++) {
+                for (int i = 0; i < frag_count; i++) order[i] = i;
+                shuffle(order, frag_count, &seed);
+
+                PacketAssembler* assembler = create_assembler_with_config(p, packet_size, &config, NULL);
+                double start = now_seconds();
+                for (int i = 0; i < frag_count; i++) {
+                    int offset = order[i] * frag_size;
+                    int length = packet_size - offset < frag_size ? packet_size - offset : frag_size;
+                    assembler_add_fragment(assembler, offset, payload + offset, length, order[i] == frag_count - 1);
+                }
+                elapsed += now_seconds() - start;
+                free_assembler(assembler);
+            }
+            fprintf(report, "%-10d %-8s %14.1f\n", frag_size, index_names[ix],
+                    elapsed * 1e9 / ((double)packets * frag_count));
+        }
+    }
+    free(order);
+    return true;
+}
+
+typedef struct {
+    int offset;
+    int length;
+    bool last;
+    char fill;
+} OverlapStep;
+
+typedef struct {
+    const char* name;
+    int size;
+    int steps;
+    OverlapStep step[4];
+    // Expected packet per policy (reject, first, last, BSD, Linux); NULL
+    // means the packet must not complete.
+    const char* expected[5];
+} OverlapPattern;
+
+static const OverlapPattern overlap_corpus[] = {
+    { "exact retransmit", 24, 3, { { 0, 8, false, 'A' }, { 0, 8, false, 'B' }, { 8, 16, true, 'C' } },
+      { "AAAAAAAACCCCCCCCCCCCCCCC", "AAAAAAAACCCCCCCCCCCCCCCC", "BBBBBBBBCCCCCCCCCCCCCCCC",
+        "AAAAAAAACCCCCCCCCCCCCCCC", "BBBBBBBBCCCCCCCCCCCCCCCC" } },
+    { "starts before held", 24, 3, { { 8, 8, false, 'A' }, { 0, 16, false, 'B' }, { 16, 8, true, 'C' } },
+      { NULL, "BBBBBBBBAAAAAAAACCCCCCCC", "BBBBBBBBBBBBBBBBCCCCCCCC",
+        "BBBBBBBBBBBBBBBBCCCCCCCC", "BBBBBBBBBBBBBBBBCCCCCCCC" } },
+    { "starts inside held", 24, 2, { { 0, 16, false, 'A' }, { 8, 16, true, 'B' } },
+      { NULL, "AAAAAAAAAAAAAAAABBBBBBBB", "AAAAAAAABBBBBBBBBBBBBBBB",
+        "AAAAAAAAAAAAAAAABBBBBBBB", "AAAAAAAAAAAAAAAABBBBBBBB" } },
+    { "spans two intervals", 24, 3, { { 0, 8, false, 'A' }, { 16, 8, true, 'C' }, { 0, 24, false, 'B' } },
+      { NULL, "AAAAAAAABBBBBBBBCCCCCCCC", "BBBBBBBBBBBBBBBBBBBBBBBB",
+        "AAAAAAAABBBBBBBBBBBBBBBB", "BBBBBBBBBBBBBBBBBBBBBBBB" } },
+    { "covers held tail", 24, 2, { { 8, 16, true, 'A' }, { 0, 16, false, 'B' } },
+      { NULL, "BBBBBBBBAAAAAAAAAAAAAAAA", "BBBBBBBBBBBBBBBBAAAAAAAA",
+        "BBBBBBBBBBBBBBBBAAAAAAAA", "BBBBBBBBBBBBBBBBAAAAAAAA" } },
+    { "contained", 32, 3, { { 0, 24, false, 'A' }, { 8, 8, false, 'B' }, { 24, 8, true, 'C' } },
+      { "AAAAAAAAAAAAAAAAAAAAAAAACCCCCCCC", "AAAAAAAAAAAAAAAAAAAAAAAACCCCCCCC", "AAAAAAAABBBBBBBBAAAAAAAACCCCCCCC",
+        "AAAAAAAAAAAAAAAAAAAAAAAACCCCCCCC", "AAAAAAAAAAAAAAAAAAAAAAAACCCCCCCC" } },
+    { "unaligned trim", 20, 3, { { 0, 10, false, 'A' }, { 5, 10, false, 'B' }, { 15, 5, true, 'C' } },
+      { NULL, "AAAAAAAAAABBBBBCCCCC", "AAAAABBBBBBBBBBCCCCC", "AAAAAAAAAABBBBBCCCCC", "AAAAAAAAAABBBBBCCCCC" } },
+};
+
+static const OverlapPolicy overlap_policies[] = { OVERLAP_REJECT, OVERLAP_FIRST, OVERLAP_LAST, OVERLAP_BSD, OVERLAP_LINUX };
+static const char* overlap_policy_names[] = { "reject", "first", "last", "bsd", "linux" };
+
+static void overlap_config(SystemConfig* config, int policy, int index) {
+    system_config_init(config);
+    config->reassembly_mode = REASSEMBLY_BUFFER;
+    config->overlap_policy = overlap_policies[policy];
+    config->coverage_index = index == 1 ? COVERAGE_TREE : index == 3 ? COVERAGE_ARRAY : COVERAGE_LIST;
+    config->bitmap_coverage = index == 2;
+}
+
+static bool verify_overlap_corpus(void) {
+    static const char* index_names[] = { "list", "tree", "bitmap", "array" };
+    char data[64];
+    int checked = 0;
+
+    for (size_t p = 0; p < sizeof(overlap_corpus) / sizeof(overlap_corpus[0]); p++) {
+        const OverlapPattern* pattern = &overlap_corpus[p];
+        for (int policy = 0; policy < 5; policy++) {
+            for (int index = 0; index < 4; index++) {
+                SystemConfig config;
+                overlap_config(&config, policy, index);
+                PacketAssembler* assembler = create_assembler_with_config((int)p, pattern->size, &config, NULL);
+                for (int i = 0; i < pattern->steps; i++) {
+                    const OverlapStep* step = &pattern->step[i];
+                    memset(data, step->fill, step->length);
+                    assembler_add_fragment(assembler, step->offset, data, step->length, step->last);
+                }
+
+                const char* expected = pattern->expected[policy];
+                char* packet = assembler_get_assembled_data(assembler);
+                bool ok = expected == NULL ? packet == NULL
+                                           : packet != NULL && memcmp(packet, expected, pattern->size) == 0;
+                if (packet != NULL) assembler_free_assembled_data(assembler, packet);
+                free_assembler(assembler);
+                if (!ok) {
+                    fprintf(report, "overlap corpus mismatch: '%s' under %s with %s\n",
+                            pattern->name, overlap_policy_names[policy], index_names[index]);
+                    return false;
+                }
+                checked++;
+            }
+        }
+    }
+    fprintf(report, "overlap corpus: %d pattern/policy/index cases matched\n", checked);
+    return true;
+}
+
+// Byte-level reference for the overlap policies: held intervals are the runs
+// of held bytes, and each run wins or loses as a whole.
+static int reference_overlap(char* bytes, bool* held, int offset, const char* data, int length, OverlapPolicy policy) {
+    int fresh = 0;
+    int run_start = -1;
+    for (int i = offset; i < offset + length; i++) {
+        if (!held[i]) {
+            run_start = -1;
+            bytes[i] = data[i - offset];
+            fresh++;
+            continue;
+        }
+        if (run_start < 0) {
+            run_start = i;
+            while (run_start > 0 && held[run_start - 1]) run_start--;
+        }
+        bool new_wins = policy == OVERLAP_LAST ||
+                        (policy == OVERLAP_BSD && run_start > offset) ||
+                        (policy == OVERLAP_LINUX && run_start >= offset);
+        if (new_wins) bytes[i] = data[i - offset];
+    }
+    for (int i = offset; i < offset + length; i++) held[i] = true;
+    return fresh;
+}
+
+static bool verify_overlap_reference(void) {
+    enum { TRIALS = 1500, OPS = 60, MAX_SIZE = 512 };
+    static char payload[MAX_SIZE];
+    static char bytes[MAX_SIZE];
+    static bool held[MAX_SIZE];
+    unsigned int seed = 5;
+    long ops = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        int policy = 1 + trial % 4;
+        int index = trial / 4 % 4;
+        seed = seed * 1103515245u + 12345u;
+        int size = 8 + (int)((seed >> 8) % (MAX_SIZE - 8));
+        bool aligned = trial % 2 == 0;
+
+        SystemConfig config;
+        overlap_config(&config, policy, index);
+        PacketAssembler* assembler = create_assembler_with_config(trial, size, &config, NULL);
+        memset(held, 0, sizeof(held));
+        int received = 0;
+
+        for (int op = 0; op < OPS && !assembler_is_complete(assembler); op++) {
+            seed = seed * 1103515245u + 12345u;
+            unsigned int r = seed >> 4;
+            int offset = (int)(r % (unsigned int)size);
+            int length = 1 + (int)((r >> 10) % 96);
+            if (aligned) {
+                offset &= ~7;
+                length = (length + 7) & ~7;
+            }
+            if (offset + length > size) length = size - offset;
+            bool is_last = offset + length == size;
+            for (int i = 0; i < length; i++) payload[i] = (char)('a' + (op + i) % 26);
+
+            int result = assembler_add_fragment(assembler, offset, payload, length, is_last);
+            int fresh = reference_overlap(bytes, held, offset, payload, length, overlap_policies[policy]);
+            received += fresh;
+            ops++;
+            int expected = fresh > 0 ? FRAGMENT_ADDED : FRAGMENT_DUPLICATE;
+            if (result != expected || assembler->total_received_bytes != received) {
+                fprintf(report, "overlap reference mismatch: trial %d op %d (%s) offset %d length %d\n",
+                        trial, op, overlap_policy_names[policy], offset, length);
+                free_assembler(assembler);
+                return false;
+            }
+        }
+
+        bool ok = true;
+        if (assembler_is_complete(assembler)) {
+            char* packet = assembler_get_assembled_data(assembler);
+            ok = memcmp(packet, bytes, size) == 0;
+            assembler_free_assembled_data(assembler, packet);
+        }
+        free_assembler(assembler);
+        if (!ok) {
+            fprintf(report, "overlap reference mismatch: trial %d (%s) assembled bytes differ\n",
+                    trial, overlap_policy_names[policy]);
+            return false;
+        }
+    }
+    fprintf(report, "overlap policies matched the byte-level reference on %ld fragments\n", ops);
+    return true;
+}
+
+static bool bench_overlap(void) {
+    enum { PACKETS = 2000, FRAG_SIZE = 1480, PACKET_SIZE = 8 * FRAG_SIZE };
+    static char payload[PACKET_SIZE];
+    memset(payload, 'o', sizeof(payload));
+
+    fprintf(report, "\n--- overlap policies: corpus, reference check and retransmission throughput ---\n");
+    if (!verify_overlap_corpus() || !verify_overlap_reference()) return false;
+
+    // Every packet is sent twice with the retransmission shifted by half a
+    // fragment, so most of the second copy partially overlaps the first.
+    fprintf(report, "%-8s %12s %14s %16s %14s\n", "policy", "completed", "bytes trimmed", "bytes overwritten", "ns/fragment");
+    for (int policy = 0; policy < 5; policy++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = PACKETS;
+        config.overlap_policy = overlap_policies[policy];
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+
+        long fragments = 0;
+        double start = now_seconds();
+        for (int id = 0; id < PACKETS; id++) {
+            system_register_packet(&system, id, PACKET_SIZE);
+            for (int copy = 0; copy < 2; copy++) {
+                int shift = copy == 0 ? 0 : FRAG_SIZE / 2 / 8 * 8;
+                for (int offset = shift; offset < PACKET_SIZE; offset += FRAG_SIZE) {
+                    int length = PACKET_SIZE - offset < FRAG_SIZE ? PACKET_SIZE - offset : FRAG_SIZE;
+                    // The first copy loses its final fragment.
+                    if (copy == 0 && offset + length == PACKET_SIZE) continue;
+                    system_add_fragment_ex(&system, id, offset, (const uint8_t*)payload + offset, length,
+                                           offset + length == PACKET_SIZE ? FRAGMENT_FLAG_LAST : 0);
+                    fragments++;
+                }
+            }
+        }
+        double elapsed = now_seconds() - start;
+        system_cleanup(&system);
+
+        fprintf(report, "%-8s %12ld %14ld %16ld %14.1f\n", overlap_policy_names[policy], system.stats.packets_completed,
+                system.stats.total_bytes_trimmed, system.stats.total_bytes_overwritten, elapsed * 1e9 / fragments);
+    }
+    return true;
+}
+
+// A flood of large packets that never complete competes with a steady
+// stream of small packets that do. Without a budget the flood's buffers pile
+// up; with one, the policy decides which partial packets give way.
+static bool bench_budget(void) {
+    enum { ROUNDS = 20000, FLOOD_SIZE = 32768, FLOOD_FRAGMENT = 1480, SMALL_SIZE = 2960 };
+    static const char* policy_names[] = { "none", "oldest", "largest", "least" };
+    static const EvictionPolicy policies[] = { EVICT_OLDEST, EVICT_OLDEST, EVICT_LARGEST, EVICT_LEAST_COMPLETE };
+    static char payload[FLOOD_SIZE];
+    memset(payload, 'f', sizeof(payload));
+    bool ok = true;
+
+    fprintf(report, "\n--- byte budget: small packets completing under a flood of %d-byte partial packets ---\n", FLOOD_SIZE);
+    fprintf(report, "%-8s %10s %12s %10s %16s %12s\n", "policy", "budget", "completed", "evicted", "peak buffered", "ns/fragment");
+
+    for (int p = 0; p < 4; p++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = ROUNDS * 2;
+        config.byte_budget = p == 0 ? 0 : 4L * 1024 * 1024;
+        config.eviction_policy = policies[p];
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        unsigned int seed = 3;
+
+        long fragments = 0;
+        long peak = 0;
+        double start = now_seconds();
+        for (int round = 0; round < ROUNDS; round++) {
+            // Flood packet: a random prefix of fragments and never the last one.
+            int flood_id = round * 2;
+            system_register_packet(&system, flood_id, FLOOD_SIZE);
+            seed = seed * 1103515245u + 12345u;
+            int sent = 1 + (int)((seed >> 16) % (FLOOD_SIZE / FLOOD_FRAGMENT));
+            for (int f = 0; f < sent; f++) {
+                system_add_fragment_ex(&system, flood_id, f * FLOOD_FRAGMENT, (const uint8_t*)payload, FLOOD_FRAGMENT, 0);
+                fragments++;
+            }
+
+            // Small packet: both halves arrive a few rounds apart.
+            int small_id = round * 2 + 1;
+            system_register_packet(&system, small_id, SMALL_SIZE);
+            system_add_fragment_ex(&system, small_id, 0, (const uint8_t*)payload, SMALL_SIZE / 2, 0);
+            if (round >= 4) {
+                system_add_fragment_ex(&system, small_id - 8, SMALL_SIZE / 2, (const uint8_t*)payload,
+                                       SMALL_SIZE / 2, FRAGMENT_FLAG_LAST);
+                fragments++;
+            }
+            fragments++;
+            if (system.stats.current_buffered_bytes > peak) peak = system.stats.current_buffered_bytes;
+        }
+        double elapsed = now_seconds() - start;
+
+        // With no completion handler every finished packet is released at
+        // once, so the pools hold exactly what the live packets buffer.
+        if (system.stats.current_buffered_bytes != system.pools.payload_bytes_in_use) {
+            fprintf(report, "budget accounting mismatch: %ld buffered, %ld in the pools\n",
+                    system.stats.current_buffered_bytes, system.pools.payload_bytes_in_use);
+            ok = false;
+        }
+        fprintf(report, "%-8s %10ld %12ld %10ld %16ld %12.1f\n", policy_names[p], config.byte_budget,
+                system.stats.packets_completed, system.stats.total_packets_evicted, peak, elapsed * 1e9 / fragments);
+        system_cleanup(&system);
+    }
+    return ok;
+}
+
+// Checks that a stream arrives in order, byte for byte, and ends once.
+typedef struct {
+    DefragmenterSystem* system;
+    const char* source;
+    long next_offset;
+    int ends;
+    bool in_order;
+    long fragments_seen;
+    long first_byte_fragment;
+} StreamCheck;
+
+static void stream_check_deliver(void* user, int packet_id, int stream_offset, const char* data, int length, bool end_of_stream) {
+    StreamCheck* check = (StreamCheck*)user;
+    (void)packet_id;
+    if (stream_offset != check->next_offset || memcmp(data, check->source + stream_offset, length) != 0) {
+        check->in_order = false;
+    }
+    if (check->first_byte_fragment < 0 && length > 0) check->first_byte_fragment = check->fragments_seen;
+    check->next_offset = stream_offset + length;
+    check->ends += end_of_stream;
+}
+
+static void stream_check_complete(void* user, int packet_id, char* data, int length) {
+    StreamCheck* check = (StreamCheck*)user;
+    (void)packet_id;
+    if (check->first_byte_fragment < 0) check->first_byte_fragment = check->fragments_seen;
+    system_release_packet_data(check->system, data, length);
+}
+
+// Sends `bytes` of `source` as segments shuffled within blocks of `block`
+// segments, resending every 50th segment of the previous block as well.
+static long stream_send(DefragmenterSystem* system, int id, const char* source, int bytes, int segment, int block,
+                        unsigned int* seed, StreamCheck* check, long* peak) {
+    int segments = (bytes + segment - 1) / segment;
+    int order[64];
+    long fragments = 0;
+    for (int base = 0; base < segments; base += block) {
+        int n = segments - base < block ? segments - base : block;
+        for (int i = 0; i < n; i++) order[i] = base + i;
+        shuffle(order, n, seed);
+        for (int i = 0; i <= n; i++) {
+            int s = i < n ? order[i] : base - block + (int)(*seed % (unsigned int)block);
+            if (i == n && (base == 0 || (base / block) % 50 != 0)) break;
+            int offset = s * segment;
+            int length = bytes - offset < segment ? bytes - offset : segment;
+            check->fragments_seen++;
+            system_add_fragment_ex(system, id, offset, (const uint8_t*)source + offset, length,
+                                   s == segments - 1 ? FRAGMENT_FLAG_LAST : 0);
+            fragments++;
+            if (system->stats.current_buffered_bytes > *peak) *peak = system->stats.current_buffered_bytes;
+        }
+    }
+    return fragments;
+}
+
+// A stream whose retransmissions are cut at other boundaries than the
+// original segments: each block of segments is shuffled, and a resend that
+// straddles held and missing bytes arrives midway. The held bytes must win
+// and the gaps must still be filled, under every coverage index.
+static bool verify_stream_resegmented(const char* source) {
+    enum { BYTES = 1 << 20, BLOCK = 8, MAX_SEGMENTS = BYTES / 200 + 1 };
+    static const CoverageIndex indexes[] = { COVERAGE_LIST, COVERAGE_TREE, COVERAGE_ARRAY };
+    static int starts[MAX_SEGMENTS + 1];
+    unsigned int seed = 29;
+    int segments = 0;
+    for (int offset = 0; offset < BYTES; segments++) {
+        starts[segments] = offset;
+        seed = seed * 1103515245u + 12345u;
+        offset += 200 + (int)((seed >> 8) % 1800);
+        if (offset > BYTES) offset = BYTES;
+    }
+    starts[segments] = BYTES;
+
+    for (size_t ix = 0; ix < sizeof(indexes) / sizeof(indexes[0]); ix++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.streaming = true;
+        config.coverage_index = indexes[ix];
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        StreamCheck check = { &system, source, 0, 0, true, 0, -1 };
+        system_set_stream_handler(&system, stream_check_deliver, &check);
+        system_register_stream(&system, 1);
+
+        int order[BLOCK];
+        for (int base = 0; base < segments; base += BLOCK) {
+            int n = segments - base < BLOCK ? segments - base : BLOCK;
+            for (int i = 0; i < n; i++) order[i] = base + i;
+            shuffle(order, n, &seed);
+            for (int i = 0; i < n; i++) {
+                if (i == n / 2) {
+                    // The resend starts and ends inside segments of this block.
+                    int first = starts[base], span = starts[base + n] - first;
+                    int from = first + (int)(seed % (unsigned int)span) / 2;
+                    int to = from + span / 2;
+                    system_add_fragment_ex(&system, 1, from, (const uint8_t*)source + from, to - from, 0);
+                }
+                int seg = order[i];
+                int offset = starts[seg];
+                system_add_fragment_ex(&system, 1, offset, (const uint8_t*)source + offset, starts[seg + 1] - offset,
+                                       seg == segments - 1 ? FRAGMENT_FLAG_LAST : 0);
+            }
+        }
+        bool ok = check.in_order && check.ends == 1 && check.next_offset == BYTES && system.stats.packets_completed == 1;
+        if (!ok) {
+            fprintf(report, "resegmented stream (index %d): %ld of %d bytes delivered in order, %d ends\n",
+                    (int)indexes[ix], check.next_offset, BYTES, check.ends);
+        }
+        system_cleanup(&system);
+        if (!ok) return false;
+    }
+    fprintf(report, "resegmented resends filled every gap under the list, tree and array indexes\n");
+    return true;
+}
+
+// Streaming mode against whole-packet delivery: how soon the first byte
+// leaves the engine and how much is held meanwhile, then a stream far longer
+// than any packet pushed through a fixed receive window.
+static bool bench_stream(void) {
+    enum { PACKET_BYTES = 64000, PACKETS = 2000, SEGMENT = 1460, BLOCK = 8, STREAM_BYTES = 64 << 20 };
+    char* source = (char*)malloc(STREAM_BYTES);
+    if (source == NULL) return false;
+    for (int i = 0; i < STREAM_BYTES; i++) source[i] = (char)(i * 31 + (i >> 11));
+    bool ok = true;
+
+    fprintf(report, "\n--- streaming: %d-byte packets as %d-byte segments reordered within %d ---\n", PACKET_BYTES, SEGMENT, BLOCK);
+    fprintf(report, "%-8s %18s %16s %12s\n", "mode", "frags to 1st byte", "peak buffered", "ns/fragment");
+    for (int streaming = 0; streaming < 2; streaming++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.streaming = streaming;
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        StreamCheck check;
+        system_set_stream_handler(&system, stream_check_deliver, &check);
+        system_set_completion_handler(&system, stream_check_complete, &check);
+        unsigned int seed = 17;
+
+        long first_byte = 0, peak = 0, fragments = 0;
+        double start = now_seconds();
+        for (int p = 0; p < PACKETS; p++) {
+            check = (StreamCheck){ &system, source, 0, 0, true, 0, -1 };
+            system_register_packet(&system, p, PACKET_BYTES);
+            fragments += stream_send(&system, p, source, PACKET_BYTES, SEGMENT, BLOCK, &seed, &check, &peak);
+            first_byte += check.first_byte_fragment;
+            if (streaming && (!check.in_order || check.ends != 1 || check.next_offset != PACKET_BYTES)) ok = false;
+        }
+        double elapsed = now_seconds() - start;
+        if (system.stats.packets_completed != PACKETS) ok = false;
+        fprintf(report, "%-8s %18.1f %16ld %12.1f\n", streaming ? "stream" : "packet", (double)first_byte / PACKETS,
+                peak, elapsed * 1e9 / fragments);
+        system_cleanup(&system);
+    }
+
+    SystemConfig config;
+    system_config_init(&config);
+    config.streaming = true;
+    DefragmenterSystem system;
+    system_init_with_config(&system, &config);
+    StreamCheck check = { &system, source, 0, 0, true, 0, -1 };
+    system_set_stream_handler(&system, stream_check_deliver, &check);
+    system_register_stream(&system, 1);
+    unsigned int seed = 23;
+    long peak = 0;
+    double start = now_seconds();
+    stream_send(&system, 1, source, STREAM_BYTES, SEGMENT, BLOCK * 4, &seed, &check, &peak);
+    double elapsed = now_seconds() - start;
+    if (!check.in_order || check.ends != 1 || check.next_offset != STREAM_BYTES ||
+        system.stats.packets_completed != 1 || system.stats.current_buffered_bytes != 0) {
+        fprintf(report, "stream delivery mismatch: %ld of %d bytes in order, %d ends\n",
+                check.next_offset, STREAM_BYTES, check.ends);
+        ok = false;
+    }
+    fprintf(report, "%d MB stream, %d-byte window: %.0f MB/s, peak buffered %ld bytes, %ld bytes trimmed from resends\n",
+            STREAM_BYTES >> 20, config.stream_window, (STREAM_BYTES >> 20) / elapsed, peak,
+            system.stats.total_bytes_trimmed);
+    system_cleanup(&system);
+    if (!verify_stream_resegmented(source)) ok = false;
+    free(source);
+    return ok;
+}
+
+// Packet state lookups on a working set far larger than the caches: the list
+// index chases node pointers, the array index keeps its intervals inline in
+// the packet node.
+static void bench_layout(void) {
+    enum { PACKETS = 200000, FRAGS = 8, FRAG_SIZE = 64 };
+    static const ReassemblyMode modes[] = { REASSEMBLY_MERGE, REASSEMBLY_BUFFER };
+    static const char* mode_names[] = { "merge", "buffer" };
+    static const CoverageIndex indexes[] = { COVERAGE_LIST, COVERAGE_ARRAY };
+    static const char* index_names[] = { "list", "array" };
+    static const uint8_t payload[FRAG_SIZE];
+
+    int* order = (int*)malloc(PACKETS * FRAGS * sizeof(int));
+    if (order == NULL) return;
+
+    int counter = cache_miss_counter_open();
+    fprintf(report, "\n--- layout: %d packets x %d shuffled fragments in flight, sizeof(PacketNode) = %zu ---\n",
+            PACKETS, FRAGS, sizeof(PacketNode));
+    fprintf(report, "%-8s %-6s %12s %14s %14s\n", "mode", "index", "ns/fragment", "misses/frag", "allocs/frag");
+
+    for (int m = 0; m < 2; m++) {
+        for (int ix = 0; ix < 2; ix++) {
+            SystemConfig config;
+            system_config_init(&config);
+            config.max_packets = PACKETS;
+            config.reassembly_mode = modes[m];
+            config.coverage_index = indexes[ix];
+            config.bitmap_coverage = false;
+            DefragmenterSystem system;
+            system_init_with_config(&system, &config);
+            unsigned int seed = 21;
+
+            for (int i = 0; i < PACKETS; i++) system_register_packet(&system, i, FRAGS * FRAG_SIZE);
+            for (int i = 0; i < PACKETS * FRAGS; i++) order[i] = i;
+            shuffle(order, PACKETS * FRAGS, &seed);
+            long allocs_before = system.pools.heap_allocations;
+
+            long long misses_before = cache_miss_counter_read(counter);
+            double start = now_seconds();
+            for (int i = 0; i < PACKETS * FRAGS; i++) {
+                int frag = order[i] % FRAGS;
+                system_add_fragment_ex(&system, order[i] / FRAGS, frag * FRAG_SIZE, payload, FRAG_SIZE,
+                                       frag == FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0);
+            }
+            double elapsed = now_seconds() - start;
+            long long misses_after = cache_miss_counter_read(counter);
+
+            char misses[32] = "n/a";
+            if (misses_before >= 0 && misses_after >= 0) {
+                snprintf(misses, sizeof(misses), "%.2f", (double)(misses_after - misses_before) / (PACKETS * FRAGS));
+            }
+            fprintf(report, "%-8s %-6s %12.1f %14s %14.4f\n", mode_names[m], index_names[ix],
+                    elapsed * 1e9 / (PACKETS * FRAGS), misses,
+                    (double)(system.pools.heap_allocations - allocs_before) / (PACKETS * FRAGS));
+            system_cleanup(&system);
+        }
+    }
+    if (counter >= 0) close(counter);
+    free(order);
+}
+
+// Cost of the latency histograms on a shuffled workload, and a check that
+// the merged sharded snapshot agrees with the engine's own counters.
+static bool bench_metrics(void) {
+    enum { PACKETS = 100000, FRAGS = 8, FRAG_SIZE = 64, SHARDS = 4 };
+    static const uint8_t payload[FRAG_SIZE];
+    bool ok = true;
+
+    int* order = (int*)malloc(PACKETS * FRAGS * sizeof(int));
+    MetricsSnapshot* snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+    if (order == NULL || snapshot == NULL) {
+        free(order);
+        free(snapshot);
+        return false;
+    }
+
+    fprintf(report, "\n--- metrics: %d packets x %d shuffled fragments over %d shards ---\n", PACKETS, FRAGS, SHARDS);
+    fprintf(report, "%-8s %12s %14s %14s\n", "timing", "ns/fragment", "p50 insert ns", "p99 insert ns");
+
+    for (int timing = 0; timing < 2; timing++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = PACKETS;
+        config.metrics_timing = timing;
+        ShardedDefragmenter engine;
+        if (sharded_init(&engine, SHARDS, &config) != 0) {
+            fprintf(report, "FAIL: could not start %d shards\n", SHARDS);
+            ok = false;
+            break;
+        }
+
+        unsigned int seed = 11;
+        for (int i = 0; i < PACKETS; i++) sharded_register_packet(&engine, i, FRAGS * FRAG_SIZE);
+        for (int i = 0; i < PACKETS * FRAGS; i++) order[i] = i;
+        shuffle(order, PACKETS * FRAGS, &seed);
+
+        double start = now_seconds();
+        for (int i = 0; i < PACKETS * FRAGS; i++) {
+            int frag = order[i] % FRAGS;
+            sharded_add_fragment_ex(&engine, order[i] / FRAGS, frag * FRAG_SIZE, payload, FRAG_SIZE,
+                                    frag == FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0);
+        }
+        double elapsed = now_seconds() - start;
+
+        SystemStats stats;
+        sharded_get_stats(&engine, &stats);
+        sharded_metrics_snapshot(&engine, snapshot);
+        const SystemMetrics* m = &snapshot->metrics;
+        if (snapshot->systems != SHARDS ||
+            snapshot->stats.total_fragments_processed != stats.total_fragments_processed ||
+            (long)m->fragments_per_packet.count != stats.packets_completed ||
+            (long)m->merges_per_insert.count != stats.total_fragments_added ||
+            (long)m->fragments_per_packet.sum != stats.total_fragments_processed ||
+            m->insert_latency_ns.count != (timing ? (uint64_t)stats.total_fragments_processed : 0)) {
+            fprintf(report, "metrics snapshot disagrees with the engine counters\n");
+            ok = false;
+        }
+        fprintf(report, "%-8s %12.1f %14llu %14llu\n", timing ? "on" : "off", elapsed * 1e9 / (PACKETS * FRAGS),
+                (unsigned long long)histogram_quantile(&m->insert_latency_ns, 0.50),
+                (unsigned long long)histogram_quantile(&m->insert_latency_ns, 0.99));
+        sharded_cleanup(&engine);
+    }
+
+    metrics_write_json(snapshot, report);
+    free(snapshot);
+    free(order);
+    return ok;
+}
+
+static void bench_pool_churn(void) {
+    enum { ROUNDS = 200, WINDOW = 1000, FRAGS = 8, FRAG_SIZE = 128 };
+    static const ReassemblyMode modes[] = { REASSEMBLY_MERGE, REASSEMBLY_BUFFER };
+    static const char* mode_names[] = { "merge", "buffer" };
+    char payload[FRAG_SIZE + 1];
+    memset(payload, 'p', FRAG_SIZE);
+    payload[FRAG_SIZE] = '\0';
+
+    int* order = (int*)malloc(WINDOW * FRAGS * sizeof(int));
+    if (order == NULL) return;
+
+    fprintf(report, "\n--- allocator churn: %d rounds of %d packets x %d fragments ---\n", ROUNDS, WINDOW, FRAGS);
+    fprintf(report, "%-8s %-6s %12s %12s %10s %10s %12s\n",
+            "mode", "pools", "allocs/frag", "ns/fragment", "hw frags", "hw pkts", "hw payload");
+
+    for (int m = 0; m < 2; m++) {
+        for (int pooled = 0; pooled < 2; pooled++) {
+            SystemConfig config;
+            system_config_init(&config);
+            config.max_packets = WINDOW;
+            config.reassembly_mode = modes[m];
+            config.use_pools = pooled;
+
+            DefragmenterSystem system;
+            system_init_with_config(&system, &config);
+            unsigned int seed = 5;
+            int next_id = 0;
+
+            double start = now_seconds();
+            for (int round = 0; round < ROUNDS; round++) {
+                int base = next_id;
+                for (int i = 0; i < WINDOW; i++) {
+                    system_register_packet(&system, next_id++, FRAGS * FRAG_SIZE);
+                }
+                for (int i = 0; i < WINDOW * FRAGS; i++) order[i] = i;
+                shuffle(order, WINDOW * FRAGS, &seed);
+                for (int i = 0; i < WINDOW * FRAGS; i++) {
+                    int frag = order[i] % FRAGS;
+                    system_add_fragment(&system, base + order[i] / FRAGS, frag * FRAG_SIZE, payload, frag == FRAGS - 1);
+                }
+            }
+            double elapsed = now_seconds() - start;
+
+            long fragments = system.stats.total_fragments_processed;
+            fprintf(report, "%-8s %-6s %12.4f %12.1f %10ld %10ld %12ld\n", mode_names[m], pooled ? "on" : "off",
+                    (double)system.pools.heap_allocations / fragments, elapsed * 1e9 / fragments,
+                    system.pools.objects[POOL_FRAGMENT].high_water,
+                    system.pools.objects[POOL_PACKET].high_water,
+                    system.pools.payload_bytes_high_water);
+            system_cleanup(&system);
+        }
+    }
+    free(order);
+}
+
+static void bench_batch_ingest(void) {
+    enum { ROUNDS = 20, WINDOW = 10000, FRAGS = 8, FRAG_SIZE = 64 };
+    static const int batch_sizes[] = { 0, 1, 16, 64, 256 };
+    static uint8_t payload[FRAG_SIZE];
+    memset(payload, 'b', sizeof(payload));
+
+    const int total = WINDOW * FRAGS;
+    FragmentDescriptor* fragments = (FragmentDescriptor*)malloc(total * sizeof(FragmentDescriptor));
+    int* order = (int*)malloc(total * sizeof(int));
+    int* results = (int*)malloc(total * sizeof(int));
+    int* completed = (int*)malloc(total * sizeof(int));
+    if (fragments == NULL || order == NULL || results == NULL || completed == NULL) {
+        free(fragments);
+        free(order);
+        free(results);
+        free(completed);
+        return;
+    }
+
+    fprintf(report, "\n--- batched ingestion: %d in-flight packets x %d fragments, random arrival ---\n", WINDOW, FRAGS);
+    fprintf(report, "%-12s %14s %12s\n", "batch", "frags/sec", "completed");
+
+    for (size_t b = 0; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]); b++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = WINDOW;
+        config.reassembly_mode = REASSEMBLY_BUFFER;
+
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        unsigned int seed = 11;
+        int next_id = 0;
+        double elapsed = 0;
+
+        for (int round = 0; round < ROUNDS; round++) {
+            int base = next_id;
+            for (int i = 0; i < WINDOW; i++) {
+                system_register_packet(&system, next_id++, FRAGS * FRAG_SIZE);
+            }
+            for (int i = 0; i < total; i++) order[i] = i;
+            shuffle(order, total, &seed);
+            for (int i = 0; i < total; i++) {
+                int frag = order[i] % FRAGS;
+                fragments[i].packet_id = base + order[i] / FRAGS;
+                fragments[i].offset = frag * FRAG_SIZE;
+                fragments[i].data = payload;
+                fragments[i].length = FRAG_SIZE;
+                fragments[i].flags = frag == FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0;
+                fragments[i].flow = NULL;
+            }
+
+            double start = now_seconds();
+            if (batch_sizes[b] == 0) {
+                for (int i = 0; i < total; i++) {
+                    system_add_fragment_ex(&system, fragments[i].packet_id, fragments[i].offset,
+                                           fragments[i].data, fragments[i].length, fragments[i].flags);
+                }
+            } else {
+                for (int i = 0; i < total; i += batch_sizes[b]) {
+                    int n = total - i < batch_sizes[b] ? total - i : batch_sizes[b];
+                    system_add_fragments_batch(&system, fragments + i, n, results + i, completed);
+                }
+            }
+            elapsed += now_seconds() - start;
+        }
+
+        char label[16];
+        if (batch_sizes[b] == 0) snprintf(label, sizeof(label), "unbatched");
+        else snprintf(label, sizeof(label), "%d", batch_sizes[b]);
+        fprintf(report, "%-12s %14.0f %12ld\n", label,
+                system.stats.total_fragments_processed / elapsed, system.stats.packets_completed);
+        system_cleanup(&system);
+    }
+    free(fragments);
+    free(order);
+    free(results);
+    free(completed);
+}
+
+// Flow k sends pattern (k + fragment) & 255 in each fragment, so bytes
+// spliced in from another flow that reuses its IP ID show up on completion.
+#define FLOW_FRAGS 4
+#define FLOW_FRAG_SIZE 64
+
+static uint8_t flow_patterns[256][FLOW_FRAG_SIZE];
+
+typedef struct {
+    DefragmenterSystem* system;
+    long completed;
+    long corrupt;
+} FlowCheck;
+
+static void flow_check_packet(FlowCheck* check, int k, const char* data, int length) {
+    bool intact = length == FLOW_FRAGS * FLOW_FRAG_SIZE;
+    for (int f = 0; intact && f < FLOW_FRAGS; f++) {
+        intact = memcmp(data + f * FLOW_FRAG_SIZE, flow_patterns[(k + f) & 255], FLOW_FRAG_SIZE) == 0;
+    }
+    check->completed++;
+    if (!intact) check->corrupt++;
+}
+
+static void flow_check_complete(void* user, const FlowKey* flow, char* data, int length) {
+    FlowCheck* check = (FlowCheck*)user;
+    flow_check_packet(check, (int)(flow->source & 0xffffff), data, length);
+    system_release_packet_data(check->system, data, length);
+}
+
+static void flow_check_complete_id(void* user, int packet_id, char* data, int length) {
+    FlowCheck* check = (FlowCheck*)user;
+    flow_check_packet(check, packet_id, data, length);
+    system_release_packet_data(check->system, data, length);
+}
+
+static void flow_check_complete_sharded(void* user, DefragmenterSystem* system, const FlowKey* flow, char* data, int length) {
+    FlowCheck* check = (FlowCheck*)user;
+    flow_check_packet(check, (int)(flow->source & 0xffffff), data, length);
+    system_release_packet_data(system, data, length);
+}
+
+static void flow_count_complete(void* user, int packet_id, char* data, int length) {
+    (void)packet_id;
+    FlowCheck* check = (FlowCheck*)user;
+    check->completed++;
+    system_release_packet_data(check->system, data, length);
+}
+
+// Millions of flows drawn from only 256 IP IDs. Keyed by ID alone, the
+// flows in flight splice into each other; keyed by flow, every one of them
+// must complete intact, and plain unique IDs show what the keying costs.
+static bool bench_flows(void) {
+    enum { WINDOW = 65536, ROUNDS = 32, BATCH = 64, SHARDS = 4, MODES = 6 };
+    static const char* mode_names[] = { "plain id", "plain id, reused", "flow key", "flow key, batch",
+                                        "flow key, sharded", "sharded batch" };
+    const int total = WINDOW * FLOW_FRAGS;
+    for (int p = 0; p < 256; p++) {
+        for (int j = 0; j < FLOW_FRAG_SIZE; j++) flow_patterns[p][j] = (uint8_t)(p * 31 + j);
+    }
+
+    FlowKey* keys = (FlowKey*)malloc(WINDOW * sizeof(FlowKey));
+    FragmentDescriptor* fragments = (FragmentDescriptor*)malloc(total * sizeof(FragmentDescriptor));
+    int* order = (int*)malloc(total * sizeof(int));
+    if (keys == NULL || fragments == NULL || order == NULL) {
+        free(keys);
+        free(fragments);
+        free(order);
+        return false;
+    }
+
+    fprintf(report, "\n--- flow keying: %d flows over 256 IP IDs, %d in flight, random arrival ---\n",
+            WINDOW * ROUNDS, WINDOW);
+    fprintf(report, "%-18s %14s %12s %10s\n", "key", "frags/sec", "completed", "corrupt");
+
+    bool ok = true;
+    for (int mode = 0; mode < MODES; mode++) {
+        bool sharded = mode >= 4;
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = WINDOW;
+        config.auto_register = true;
+        config.reassembly_mode = REASSEMBLY_BUFFER;
+        config.coverage_index = COVERAGE_ARRAY;
+
+        DefragmenterSystem system;
+        ShardedDefragmenter engine;
+        system_init_with_config(&system, &config);
+        if (sharded && sharded_init(&engine, SHARDS, &config) != 0) {
+            fprintf(report, "FAIL: could not start %d shards\n", SHARDS);
+            system_cleanup(&system);
+            ok = false;
+            break;
+        }
+        FlowCheck check = { &system, 0, 0 };
+        if (sharded) sharded_set_flow_completion_handler(&engine, flow_check_complete_sharded, &check);
+        else if (mode == 0) system_set_completion_handler(&system, flow_check_complete_id, &check);
+        else if (mode == 1) system_set_completion_handler(&system, flow_count_complete, &check);
+        else system_set_flow_completion_handler(&system, flow_check_complete, &check);
+
+        unsigned int seed = 29;
+        double elapsed = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            int base = round * WINDOW;
+            for (int i = 0; i < WINDOW; i++) {
+                flow_key_init(&keys[i], 0x0a000000u | (uint32_t)(base + i), 0xc0a80001u, 17, (uint32_t)rand_r(&seed) & 0xff);
+            }
+            for (int i = 0; i < total; i++) order[i] = i;
+            shuffle(order, total, &seed);
+            for (int i = 0; i < total; i++) {
+                int flow = order[i] / FLOW_FRAGS;
+                int frag = order[i] % FLOW_FRAGS;
+                fragments[i].packet_id = mode == 0 ? base + flow : (int)keys[flow].id;
+                fragments[i].offset = frag * FLOW_FRAG_SIZE;
+                fragments[i].data = flow_patterns[(base + flow + frag) & 255];
+                fragments[i].length = FLOW_FRAG_SIZE;
+                fragments[i].flags = frag == FLOW_FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0;
+                fragments[i].flow = mode >= 2 ? &keys[flow] : NULL;
+            }
+
+            double start = now_seconds();
+            if (mode == 2) {
+                for (int i = 0; i < total; i++) {
+                    system_add_flow_fragment(&system, fragments[i].flow, fragments[i].offset,
+                                             fragments[i].data, fragments[i].length, fragments[i].flags);
+                }
+            } else if (mode == 3) {
+                for (int i = 0; i < total; i += BATCH) {
+                    system_add_fragments_batch(&system, fragments + i, BATCH, NULL, NULL);
+                }
+            } else if (mode == 4) {
+                for (int i = 0; i < total; i++) {
+                    sharded_add_flow_fragment(&engine, fragments[i].flow, fragments[i].offset,
+                                              fragments[i].data, fragments[i].length, fragments[i].flags);
+                }
+            } else if (mode == 5) {
+                for (int i = 0; i < total; i += SHARD_BATCH_WINDOW) {
+                    sharded_add_fragments_batch(&engine, fragments + i, SHARD_BATCH_WINDOW, NULL, NULL);
+                }
+            } else {
+                for (int i = 0; i < total; i++) {
+                    system_add_fragment_ex(&system, fragments[i].packet_id, fragments[i].offset,
+                                           fragments[i].data, fragments[i].length, fragments[i].flags);
+                }
+            }
+            elapsed += now_seconds() - start;
+        }
+
+        SystemStats stats = system.stats;
+        if (sharded) sharded_get_stats(&engine, &stats);
+        if (mode == 1) {
+            fprintf(report, "%-18s %14.0f %12ld %10s\n", mode_names[mode],
+                    stats.total_fragments_processed / elapsed, check.completed, "-");
+        } else {
+            fprintf(report, "%-18s %14.0f %12ld %10ld\n", mode_names[mode],
+                    stats.total_fragments_processed / elapsed, check.completed, check.corrupt);
+            if (check.completed != (long)WINDOW * ROUNDS || check.corrupt != 0) {
+                fprintf(report, "FAIL: %s completed %ld of %d flows, %ld corrupt\n",
+                        mode_names[mode], check.completed, WINDOW * ROUNDS, check.corrupt);
+                ok = false;
+            }
+        }
+        if (sharded) sharded_cleanup(&engine);
+        system_cleanup(&system);
+    }
+
+    free(keys);
+    free(fragments);
+    free(order);
+    return ok;
+}
+
+// Marks the bytes an assembler holds, whether its intervals are merged or
+// not, so merge-on-insert and gather coverage can be compared.
+static void mark_held(const PacketAssembler* assembler, unsigned char* held, int limit) {
+    memset(held, 0, (size_t)limit);
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        for (int i = 0; i < assembler->fragment_count; i++) {
+            memset(held + assembler->spans[i].offset, 1, (size_t)assembler->spans[i].length);
+        }
+        return;
+    }
+    for (const FragmentNode* node = assembler->fragment_list_head; node != NULL; node = node->next) {
+        memset(held + node->offset, 1, (size_t)node->length);
+    }
+}
+
+// Differential check: gather mode, under every index, must hold the same
+// bytes as merge-on-insert and complete at the same moment with the same
+// data, whether the size is registered or fixed by the last fragment. Most
+// fragments are pieces of one partition of the packet, so trials complete;
+// the rest are repeats and strays that overlap or fall out of bounds. Only a
+// fragment clear of every held byte must get the same result from both: an
+// overlapping one is refused by both, but merge-on-insert sees the merged
+// interval where gather mode still sees the original fragment, so one may
+// call it a duplicate and the other an overlap.
+static bool verify_gather(void) {
+    enum { TRIALS = 2000, OPS = 1000, MAX_PARTS = OPS, LIMIT = 1024 + 16 + 96 };
+    static const CoverageIndex indexes[] = { COVERAGE_LIST, COVERAGE_TREE, COVERAGE_ARRAY };
+    static char payload[256];
+    static struct iovec parts[MAX_PARTS];
+    static unsigned char held[LIMIT], merge_held[LIMIT], gather_held[LIMIT];
+    for (int i = 0; i < (int)sizeof(payload); i++) payload[i] = (char)(i * 11);
+    unsigned int seed = 13;
+    long ops = 0;
+    int completed = 0;
+
+    for (int trial = 0; trial < TRIALS; trial++) {
+        for (int ix = 0; ix < 3; ix++) {
+            SystemConfig merge_config, gather_config;
+            system_config_init(&merge_config);
+            gather_config = merge_config;
+            gather_config.reassembly_mode = REASSEMBLY_GATHER;
+            gather_config.coverage_index = indexes[ix];
+
+            seed = seed * 1103515245u + 12345u;
+            int size = 1 + (int)((seed >> 10) % 1024);
+            int granule = 8 + (int)((seed >> 4) % 57);
+            int pieces = (size + granule - 1) / granule;
+            bool known = (seed >> 22) % 4 != 0;
+            PacketAssembler* merge = create_assembler_with_config(trial, known ? size : PACKET_SIZE_UNKNOWN, &merge_config, NULL);
+            PacketAssembler* gather = create_assembler_with_config(trial, known ? size : PACKET_SIZE_UNKNOWN, &gather_config, NULL);
+            bool ok = true;
+            memset(held, 0, sizeof(held));
+
+            for (int op = 0; op < OPS && ok && !assembler_is_complete(merge); op++) {
+                seed = seed * 1103515245u + 12345u;
+                unsigned int r = seed >> 4;
+                int piece = (int)((r >> 8) % (unsigned int)pieces);
+                int offset = piece * granule;
+                int length = size - offset < granule ? size - offset : granule;
+                bool is_last = piece == pieces - 1;
+                if (r % 10 == 0) {
+                    offset = (int)((r >> 8) % (unsigned int)(size + 16)) - (r % 20 == 10);
+                    length = 1 + (int)((r >> 20) % 96);
+                    is_last = (r >> 16) % 8 == 0;
+                }
+                const char* data = payload + (r >> 12) % 128;
+                bool overlaps = false;
+                for (int i = offset < 0 ? 0 : offset; i < offset + length && i < LIMIT; i++) overlaps = overlaps || held[i];
+
+                int a = assembler_add_fragment(merge, offset, data, length, is_last);
+                int b = assembler_add_fragment(gather, offset, data, length, is_last);
+                ops++;
+                if (a == FRAGMENT_ADDED) memset(held + offset, 1, (size_t)length);
+                if ((overlaps ? a == FRAGMENT_ADDED || b == FRAGMENT_ADDED : a != b) ||
+                    assembler_is_complete(merge) != assembler_is_complete(gather) ||
+                    merge->total_received_bytes != gather->total_received_bytes) {
+                    fprintf(report, "gather mismatch: trial %d op %d offset %d length %d (merge %d, gather %d, holes %d)\n",
+                            trial, op, offset, length, a, b, gather->holes);
+                    ok = false;
+                }
+            }
+
+            mark_held(merge, merge_held, LIMIT);
+            mark_held(gather, gather_held, LIMIT);
+            if (ok && (memcmp(held, merge_held, LIMIT) != 0 || memcmp(held, gather_held, LIMIT) != 0)) {
+                fprintf(report, "gather coverage mismatch: trial %d\n", trial);
+                ok = false;
+            }
+            if (ok && assembler_is_complete(merge)) {
+                int length = merge->total_size_expected;
+                int count = assembler_gather(gather, parts, MAX_PARTS);
+                char* x = assembler_get_assembled_data(merge);
+                char* y = assembler_get_assembled_data(gather);
+                int pos = 0;
+                for (int k = 0; ok && k < count; k++) {
+                    ok = pos + (int)parts[k].iov_len <= length && memcmp(x + pos, parts[k].iov_base, parts[k].iov_len) == 0;
+                    pos += (int)parts[k].iov_len;
+                }
+                if (count != gather->fragment_count || pos != length || y == NULL || memcmp(x, y, length) != 0) ok = false;
+                if (!ok) fprintf(report, "gather data mismatch: trial %d (%d parts)\n", trial, count);
+                assembler_free_assembled_data(merge, x);
+                assembler_free_assembled_data(gather, y);
+                completed++;
+            }
+            free_assembler(merge);
+            free_assembler(gather);
+            if (!ok) return false;
+        }
+    }
+    fprintf(report, "gather mode matched merge-on-insert coverage on %ld fragment inserts (%d of %d packets completed)\n",
+            ops, completed, TRIALS * 3);
+    return true;
+}
+
+typedef struct {
+    DefragmenterSystem* system;
+    long completed;
+    long bytes;
+} GatherCount;
+
+static void gather_count_complete(void* user, int packet_id, char* data, int length) {
+    (void)packet_id;
+    GatherCount* count = (GatherCount*)user;
+    count->completed++;
+    count->bytes += length;
+    system_release_packet_data(count->system, data, length);
+}
+
+static void gather_count_parts(void* user, const FlowKey* flow, const struct iovec* parts, int part_count, int length) {
+    (void)flow;
+    GatherCount* count = (GatherCount*)user;
+    long held = 0;
+    for (int i = 0; i < part_count; i++) held += (long)parts[i].iov_len;
+    count->completed++;
+    count->bytes += held == length ? length : 0;
+}
+
+// Total work per packet: merge-on-insert copies runs together on every
+// insert, the buffer copies each byte once up front, and gather mode copies
+// each byte once on arrival and then either once more into a whole packet
+// or not at all when the consumer takes the pieces.
+static bool bench_gather(void) {
+    enum { PACKETS = 2000 };
+    static const int frag_sizes[] = { 1480, 256 };
+    static const char* arrival_names[] = { "in-order", "reversed", "random" };
+    static const char* mode_names[] = { "merge", "buffer", "gather", "gather-iov" };
+    const int packet_size = MAX_PACKET_SIZE_BYTES;
+
+    fprintf(report, "\n--- gather: merge-on-insert vs hole counting (%d-byte packets) ---\n", packet_size);
+    if (!verify_gather()) return false;
+
+    int* order = (int*)malloc((packet_size / frag_sizes[1] + 1) * sizeof(int));
+    uint8_t* payload = (uint8_t*)malloc(packet_size);
+    if (order == NULL || payload == NULL) {
+        free(order);
+        free(payload);
+        return false;
+    }
+    for (int i = 0; i < packet_size; i++) payload[i] = (uint8_t)(i * 7);
+    fprintf(report, "%-6s %-10s %-11s %14s %12s\n", "frag", "arrival", "mode", "bytes/packet", "usec/packet");
+
+    bool ok = true;
+    for (int f = 0; f < 2; f++) {
+        int frag_size = frag_sizes[f];
+        int frag_count = (packet_size + frag_size - 1) / frag_size;
+        for (int arrival = 0; arrival < 3; arrival++) {
+            for (int m = 0; m < 4; m++) {
+                SystemConfig config;
+                system_config_init(&config);
+                config.reassembly_mode = m == 0 ? REASSEMBLY_MERGE : m == 1 ? REASSEMBLY_BUFFER : REASSEMBLY_GATHER;
+                config.coverage_index = COVERAGE_ARRAY;
+                DefragmenterSystem system;
+                system_init_with_config(&system, &config);
+                GatherCount count = { &system, 0, 0 };
+                if (m == 3) system_set_gather_handler(&system, gather_count_parts, &count);
+                else system_set_completion_handler(&system, gather_count_complete, &count);
+                unsigned int seed = 42;
+
+                double elapsed = 0;
+                for (int id = 0; id < PACKETS; id++) {
+                    for (int i = 0; i < frag_count; i++) order[i] = arrival == 1 ? frag_count - 1 - i : i;
+                    if (arrival == 2) shuffle(order, frag_count, &seed);
+
+                    double start = now_seconds();
+                    system_register_packet(&system, id, packet_size);
+                    for (int i = 0; i < frag_count; i++) {
+                        int offset = order[i] * frag_size;
+                        int length = packet_size - offset < frag_size ? packet_size - offset : frag_size;
+                        system_add_fragment_ex(&system, id, offset, payload + offset, length,
+                                               order[i] == frag_count - 1 ? FRAGMENT_FLAG_LAST : 0);
+                    }
+                    elapsed += now_seconds() - start;
+                }
+
+                fprintf(report, "%-6d %-10s %-11s %14ld %12.1f\n", frag_size, arrival_names[arrival], mode_names[m],
+                        system.stats.total_bytes_copied / PACKETS, elapsed * 1e6 / PACKETS);
+                if (count.completed != PACKETS || count.bytes != (long)PACKETS * packet_size) {
+                    fprintf(report, "FAIL: %s completed %ld of %d packets\n", mode_names[m], count.completed, PACKETS);
+                    ok = false;
+                }
+                system_cleanup(&system);
+            }
+        }
+    }
+    free(order);
+    free(payload);
+    return ok;
+}
+
+static void bench_prune(void) {
+    static const int in_flight[] = { 1000, 10000, 100000 };
+
+    fprintf(report, "\n--- timeout pruning: cost of a pass with nothing expiring ---\n");
+    fprintf(report, "%10s %14s\n", "packets", "ns/pass");
+
+    for (size_t n = 0; n < sizeof(in_flight) / sizeof(in_flight[0]); n++) {
+        enum { PASSES = 100000 };
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = in_flight[n];
+
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        for (int id = 0; id < in_flight[n]; id++) {
+            system_register_packet(&system, id, 64);
+        }
+
+        double start = now_seconds();
+        for (int pass = 0; pass < PASSES; pass++) {
+            system_prune_timeouts(&system);
+        }
+        double elapsed = now_seconds() - start;
+
+        fprintf(report, "%10d %14.1f\n", in_flight[n], elapsed * 1e9 / PASSES);
+        system_cleanup(&system);
+    }
+}
+
+// Per-fragment cost of each clock source, then a replay on an external clock:
+// run twice with the same timestamps, it must expire exactly the packets that
+// lost a fragment, and the same ones both times.
+static bool bench_clock(void) {
+    enum { PACKETS = 200000, FRAGS = 8, FRAG_SIZE = 64, LOSS_EVERY = 10, PRUNE_EVERY = 1024 };
+    static const ClockSource sources[] = { CLOCK_SOURCE_MONOTONIC, CLOCK_SOURCE_COARSE, CLOCK_SOURCE_EXTERNAL };
+    static const char* source_names[] = { "monotonic", "coarse", "external" };
+    static const uint8_t payload[FRAG_SIZE];
+    const uint64_t step_ns = 1000;
+
+    fprintf(report, "\n--- engine clock: %d packets x %d fragments, pruned every %d fragments ---\n",
+            PACKETS, FRAGS, PRUNE_EVERY);
+    fprintf(report, "%-10s %12s %10s %10s\n", "clock", "ns/fragment", "completed", "timed out");
+
+    bool ok = true;
+    long external_timeouts[2] = { -1, -1 };
+    for (int run = 0; run < 4; run++) {
+        int c = run < 3 ? run : 2;
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = PACKETS;
+        config.auto_register = true;
+        config.clock_source = sources[c];
+        // Many times the span of one packet, far less than the whole run. The
+        // wall clocks get more slack: a coarse reading can be a whole prune
+        // interval old, and that interval is slow under sanitizers.
+        config.packet_timeout_seconds = c == 2 ? 64 * FRAGS * step_ns / 1e9 : 0.05;
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+
+        long fragments = 0;
+        double start = now_seconds();
+        for (int id = 0; id < PACKETS; id++) {
+            for (int frag = 0; frag < FRAGS; frag++) {
+                if (id % LOSS_EVERY == 0 && frag == 1) continue;
+                if (c == 2) system_clock_set(&system, (uint64_t)fragments * step_ns);
+                system_add_fragment_ex(&system, id, frag * FRAG_SIZE, payload, FRAG_SIZE,
+                                       frag == FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0);
+                if (++fragments % PRUNE_EVERY == 0) system_prune_timeouts(&system);
+            }
+        }
+        double elapsed = now_seconds() - start;
+        if (c == 2) {
+            system_clock_set(&system, (uint64_t)fragments * step_ns + system.timeout_ns + 1);
+            system_prune_timeouts(&system);
+            external_timeouts[run - 2] = system.stats.total_packets_timed_out;
+        }
+
+        fprintf(report, "%-10s %12.1f %10ld %10ld\n", source_names[c], elapsed * 1e9 / fragments,
+                system.stats.packets_completed, system.stats.total_packets_timed_out);
+        if (system.stats.packets_completed != PACKETS - PACKETS / LOSS_EVERY) {
+            fprintf(report, "FAIL: %s clock completed %ld packets\n", source_names[c], system.stats.packets_completed);
+            ok = false;
+        }
+        system_cleanup(&system);
+    }
+    if (external_timeouts[0] != PACKETS / LOSS_EVERY || external_timeouts[1] != external_timeouts[0]) {
+        fprintf(report, "FAIL: external clock timed out %ld then %ld packets, expected %d\n",
+                external_timeouts[0], external_timeouts[1], PACKETS / LOSS_EVERY);
+        ok = false;
+    }
+    return ok;
+}
+
+typedef struct {
+    DefragmenterSystem* system;
+    long completed;
+    bool intact;
+} SnapshotCheck;
+
+static char snapshot_byte(int id, int offset) {
+    return (char)(id * 7 + offset * 13 + (offset >> 8));
+}
+
+static void snapshot_check_complete(void* user, int packet_id, char* data, int length) {
+    SnapshotCheck* check = (SnapshotCheck*)user;
+    for (int i = 0; i < length; i++) {
+        if (data[i] != snapshot_byte(packet_id, i)) check->intact = false;
+    }
+    check->completed++;
+    system_release_packet_data(check->system, data, length);
+}
+
+// Saves 100k packets that each hold half their fragments, restores them into
+// a fresh system, then sends the other half and checks every packet's bytes.
+static bool bench_snapshot(void) {
+    enum { PACKETS = 100000, FRAGS = 8, FRAG_BYTES = 128 };
+    static const char* path = "/tmp/defrag_bench.snap";
+    static const ReassemblyMode modes[] = { REASSEMBLY_MERGE, REASSEMBLY_BUFFER };
+    char payload[FRAGS * FRAG_BYTES];
+    bool ok = true;
+
+    fprintf(report, "\n--- snapshot: %d in-flight packets, %d of %d fragments held ---\n", PACKETS, FRAGS / 2, FRAGS);
+    fprintf(report, "%-8s %14s %12s %14s %14s\n", "mode", "snapshot ms", "file MB", "restore ms", "ns/packet");
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = PACKETS;
+        config.reassembly_mode = modes[m];
+
+        DefragmenterSystem original;
+        system_init_with_config(&original, &config);
+        for (int id = 0; id < PACKETS; id++) {
+            for (int i = 0; i < FRAGS * FRAG_BYTES; i++) payload[i] = snapshot_byte(id, i);
+            system_register_packet(&original, id, FRAGS * FRAG_BYTES);
+            for (int f = 0; f < FRAGS; f += 2) {
+                system_add_fragment_ex(&original, id, f * FRAG_BYTES, (const uint8_t*)payload + f * FRAG_BYTES,
+                                       FRAG_BYTES, 0);
+            }
+        }
+
+        double start = now_seconds();
+        if (system_snapshot(&original, path) != 0) ok = false;
+        double saved = now_seconds() - start;
+
+        DefragmenterSystem restored;
+        system_init_with_config(&restored, &config);
+        start = now_seconds();
+        if (system_restore(&restored, path) != 0) ok = false;
+        double loaded = now_seconds() - start;
+
+        FILE* file = fopen(path, "rb");
+        long file_bytes = 0;
+        if (file != NULL) {
+            fseek(file, 0, SEEK_END);
+            file_bytes = ftell(file);
+            fclose(file);
+        }
+        fprintf(report, "%-8s %14.1f %12.1f %14.1f %14.1f\n", modes[m] == REASSEMBLY_MERGE ? "merge" : "buffer",
+                saved * 1e3, file_bytes / 1048576.0, loaded * 1e3, loaded * 1e9 / PACKETS);
+
+        if (restored.current_packet_count != PACKETS ||
+            restored.current_fragment_count != original.current_fragment_count ||
+            restored.stats.current_buffered_bytes != original.stats.current_buffered_bytes ||
+            restored.stats.total_fragments_processed != original.stats.total_fragments_processed) {
+            fprintf(report, "restored state differs: %d packets, %d fragments, %ld bytes buffered\n",
+                    restored.current_packet_count, restored.current_fragment_count,
+                    restored.stats.current_buffered_bytes);
+            ok = false;
+        }
+
+        SnapshotCheck check = { &restored, 0, true };
+        system_set_completion_handler(&restored, snapshot_check_complete, &check);
+        for (int id = 0; id < PACKETS; id++) {
+            for (int i = 0; i < FRAGS * FRAG_BYTES; i++) payload[i] = snapshot_byte(id, i);
+            for (int f = 1; f < FRAGS; f += 2) {
+                system_add_fragment_ex(&restored, id, f * FRAG_BYTES, (const uint8_t*)payload + f * FRAG_BYTES,
+                                       FRAG_BYTES, f == FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0);
+            }
+        }
+        if (check.completed != PACKETS || !check.intact || restored.current_packet_count != 0) {
+            fprintf(report, "restored packets did not complete: %ld of %d, data %s\n",
+                    check.completed, PACKETS, check.intact ? "intact" : "corrupt");
+            ok = false;
+        }
+        system_cleanup(&restored);
+        system_cleanup(&original);
+    }
+
+    // A flipped byte in the payload, the saved stats or the packet count must
+    // fail the checksum and leave the system empty.
+    static const long damage_at[] = { -100, (long)offsetof(SnapshotHeader, stats) + 3,
+                                      (long)offsetof(SnapshotHeader, packet_count) };
+    static const char* damage_names[] = { "payload", "stats", "packet count" };
+    for (int d = 0; d < 3; d++) {
+        FILE* file = fopen(path, "r+b");
+        if (file == NULL) break;
+        int whence = damage_at[d] < 0 ? SEEK_END : SEEK_SET;
+        fseek(file, damage_at[d], whence);
+        int c = fgetc(file);
+        fseek(file, damage_at[d], whence);
+        fputc(c ^ 0x20, file);
+        fclose(file);
+
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = PACKETS;
+        config.reassembly_mode = REASSEMBLY_BUFFER;
+        DefragmenterSystem damaged;
+        system_init_with_config(&damaged, &config);
+        if (system_restore(&damaged, path) == 0 || damaged.current_packet_count != 0) {
+            fprintf(report, "snapshot with a damaged %s was accepted\n", damage_names[d]);
+            ok = false;
+        }
+        system_cleanup(&damaged);
+
+        file = fopen(path, "r+b");
+        if (file == NULL) break;
+        fseek(file, damage_at[d], whence);
+        fputc(c, file);
+        fclose(file);
+    }
+    unlink(path);
+    return ok;
+}
+
+// RFC 1071, one big-endian word at a time.
+static uint16_t reference_checksum(const unsigned char* p, size_t length) {
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) sum += (uint64_t)(p[i] << 8 | p[i + 1]);
+    if (i < length) sum += (uint64_t)p[i] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static bool verify_checksum_kernels(void) {
+    enum { MAX_LENGTH = 600 };
+    unsigned char source[MAX_LENGTH + 64], copy[MAX_LENGTH + 64];
+    unsigned int seed = 91;
+    for (size_t i = 0; i < sizeof(source); i++) source[i] = (unsigned char)rand_r(&seed);
+    // All-ones bytes push every lane to its largest value.
+    memset(source + 300, 0xff, 200);
+
+    for (int k = 0; k < CHECKSUM_KERNEL_COUNT; k++) {
+        if (!checksum_select_kernel((ChecksumKernel)k)) continue;
+        for (int length = 0; length <= MAX_LENGTH; length++) {
+            int align = length % 17;
+            uint16_t expected = reference_checksum(source + align, length);
+            memset(copy, 0, sizeof(copy));
+            uint16_t copied = checksum_network_order(checksum_copy(copy + (length % 5), source + align, length), 0);
+            uint16_t summed = checksum_network_order(checksum_add(source + align, length), 0);
+            if (copied != expected || summed != expected || memcmp(copy + length % 5, source + align, length) != 0) {
+                fprintf(report, "%s kernel disagrees at length %d: %04x / %04x, expected %04x\n",
+                        checksum_kernel_name((ChecksumKernel)k), length, copied, summed, expected);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+typedef struct {
+    DefragmenterSystem* system;
+    long completed;
+} ChecksumCheck;
+
+static void checksum_check_complete(void* user, int packet_id, char* data, int length) {
+    ChecksumCheck* check = (ChecksumCheck*)user;
+    (void)packet_id;
+    if (reference_checksum((const unsigned char*)data, length) == 0xffff) check->completed++;
+    system_release_packet_data(check->system, data, length);
+}
+
+// Packets carry a valid checksum in their first two bytes and arrive as
+// shuffled fragments cut at odd offsets. Under the `last` policy a corrupt
+// copy of each packet's middle arrives first and is overwritten later, which
+// exercises the subtraction of replaced bytes. Every tenth packet has a
+// flipped bit and must fail.
+static bool verify_checksum_reassembly(void) {
+    enum { PACKETS = 400, MAX_SIZE = 3000, PIECES = 6 };
+    static const struct { ReassemblyMode mode; CoverageIndex index; OverlapPolicy policy; } setups[] = {
+        { REASSEMBLY_MERGE, COVERAGE_LIST, OVERLAP_REJECT },
+        { REASSEMBLY_MERGE, COVERAGE_ARRAY, OVERLAP_REJECT },
+        { REASSEMBLY_BUFFER, COVERAGE_TREE, OVERLAP_REJECT },
+        { REASSEMBLY_BUFFER, COVERAGE_LIST, OVERLAP_LAST },
+    };
+    unsigned char packet[MAX_SIZE], noise[MAX_SIZE];
+    unsigned int seed = 5;
+    for (size_t setup = 0; setup < sizeof(setups) / sizeof(setups[0]); setup++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.reassembly_mode = setups[setup].mode;
+        config.coverage_index = setups[setup].index;
+        config.overlap_policy = setups[setup].policy;
+        config.verify_checksum = true;
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        ChecksumCheck check = { &system, 0 };
+        system_set_completion_handler(&system, checksum_check_complete, &check);
+
+        for (int p = 0; p < PACKETS; p++) {
+            int size = 16 + rand_r(&seed) % (MAX_SIZE - 16);
+            for (int i = 0; i < size; i++) packet[i] = (unsigned char)rand_r(&seed);
+            packet[0] = packet[1] = 0;
+            uint16_t sum = (uint16_t)~reference_checksum(packet, size);
+            packet[0] = (unsigned char)(sum >> 8);
+            packet[1] = (unsigned char)sum;
+            bool corrupt = p % 10 == 9;
+            if (corrupt) packet[rand_r(&seed) % size] ^= 0x10;
+
+            int cuts[PIECES + 1] = { 0 };
+            for (int c = 1; c < PIECES; c++) cuts[c] = 1 + rand_r(&seed) % (size - 1);
+            cuts[PIECES] = size;
+            for (int c = 1; c < PIECES; c++) {
+                for (int d = c + 1; d < PIECES; d++) {
+                    if (cuts[d] < cuts[c]) { int t = cuts[c]; cuts[c] = cuts[d]; cuts[d] = t; }
+                }
+            }
+            int order[PIECES];
+            for (int c = 0; c < PIECES; c++) order[c] = c;
+            shuffle(order, PIECES, &seed);
+
+            system_register_packet(&system, p, size);
+            if (setups[setup].policy == OVERLAP_LAST) {
+                // The noise starts past byte 0, so holding back the first
+                // piece keeps the packet open until every piece has landed.
+                for (int c = 0; c < PIECES - 1; c++) {
+                    if (order[c] == 0) { order[c] = order[PIECES - 1]; order[PIECES - 1] = 0; }
+                }
+                for (int i = 0; i < size; i++) noise[i] = (unsigned char)rand_r(&seed);
+                system_add_fragment_ex(&system, p, size / 3, noise + size / 3, size / 3, 0);
+            }
+            for (int c = 0; c < PIECES; c++) {
+                int from = cuts[order[c]], to = cuts[order[c] + 1];
+                if (to > from) {
+                    system_add_fragment_ex(&system, p, from, packet + from, to - from, to == size ? FRAGMENT_FLAG_LAST : 0);
+                }
+            }
+        }
+        long expected_failures = PACKETS / 10;
+        if (check.completed != PACKETS - expected_failures || system.stats.total_checksum_failures != expected_failures ||
+            system.current_packet_count != 0) {
+            fprintf(report, "checksum setup %zu: %ld verified, %ld failures, %d left\n", setup, check.completed,
+                    system.stats.total_checksum_failures, system.current_packet_count);
+            system_cleanup(&system);
+            return false;
+        }
+        system_cleanup(&system);
+    }
+    return true;
+}
+
+static bool bench_checksum(void) {
+    static const size_t sizes[] = { 1500, 9000, 65535, 64 << 20 };
+    ChecksumKernel active = checksum_active_kernel();
+    bool ok = verify_checksum_kernels();
+    checksum_select_kernel(active);
+    ok = ok && verify_checksum_reassembly();
+    fprintf(report, "\n--- checksum: fused copy+sum against copy then sum (GB/s), active kernel %s ---\n",
+            checksum_kernel_name(checksum_active_kernel()));
+    fprintf(report, "%-8s %10s %10s %14s %12s\n", "kernel", "bytes", "memcpy", "copy then sum", "fused");
+
+    char* source = (char*)malloc(sizes[3]);
+    char* target = (char*)malloc(sizes[3]);
+    if (source == NULL || target == NULL) {
+        free(source);
+        free(target);
+        return false;
+    }
+    for (size_t i = 0; i < sizes[3]; i++) source[i] = (char)(i * 7 + (i >> 9));
+    volatile uint64_t sink = 0;
+
+    for (int k = 0; k < CHECKSUM_KERNEL_COUNT; k++) {
+        if (!checksum_select_kernel((ChecksumKernel)k)) continue;
+        for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+            size_t bytes = sizes[n];
+            long rounds = (long)((1L << 31) / bytes);
+            double best[3] = { 1e9, 1e9, 1e9 };
+            for (int trial = 0; trial < 3; trial++) {
+                double start = now_seconds();
+                for (long r = 0; r < rounds; r++) {
+                    memcpy(target, source, bytes);
+                    sink += (unsigned char)target[r % bytes];
+                }
+                double t = now_seconds() - start;
+                if (t < best[0]) best[0] = t;
+
+                start = now_seconds();
+                for (long r = 0; r < rounds; r++) {
+                    memcpy(target, source, bytes);
+                    sink += checksum_add(target, bytes);
+                }
+                t = now_seconds() - start;
+                if (t < best[1]) best[1] = t;
+
+                start = now_seconds();
+                for (long r = 0; r < rounds; r++) sink += checksum_copy(target, source, bytes);
+                t = now_seconds() - start;
+                if (t < best[2]) best[2] = t;
+            }
+            double total = (double)bytes * rounds / 1e9;
+            fprintf(report, "%-8s %10zu %10.1f %14.1f %12.1f\n", checksum_kernel_name((ChecksumKernel)k), bytes,
+                    total / best[0], total / best[1], total / best[2]);
+        }
+    }
+    checksum_select_kernel(active);
+    free(source);
+    free(target);
+
+    // What verifying costs the engine end to end.
+    enum { PACKETS = 200000, SIZE = 1400, FRAG = 200 };
+    static char payload[SIZE];
+    fprintf(report, "%-10s %14s\n", "verify", "ns/fragment");
+    for (int verify = 0; verify < 2; verify++) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.verify_checksum = verify;
+        config.reassembly_mode = REASSEMBLY_BUFFER;
+        DefragmenterSystem system;
+        system_init_with_config(&system, &config);
+        double start = now_seconds();
+        for (int p = 0; p < PACKETS; p++) {
+            system_register_packet(&system, p, SIZE);
+            for (int f = SIZE / FRAG - 1; f >= 0; f--) {
+                system_add_fragment_ex(&system, p, f * FRAG, (const uint8_t*)payload + f * FRAG, FRAG,
+                                       f == SIZE / FRAG - 1 ? FRAGMENT_FLAG_LAST : 0);
+            }
+        }
+        double elapsed = now_seconds() - start;
+        fprintf(report, "%-10s %14.1f\n", verify ? "on" : "off", elapsed * 1e9 / (PACKETS * (SIZE / FRAG)));
+        system_cleanup(&system);
+    }
+    (void)sink;
+    return ok;
+}
+
+typedef struct {
+    ShardedDefragmenter* engine;
+    int first_id;
+    int packets;
+    uint64_t* latencies;
+} ShardWorker;
+
+enum { SHARD_FRAGS = 8, SHARD_FRAG_SIZE = 64, SHARD_WINDOW = 64 };
+
+static void* shard_worker_run(void* arg) {
+    ShardWorker* worker = (ShardWorker*)arg;
+    static const uint8_t payload[SHARD_FRAG_SIZE];
+    long sample = 0;
+
+    for (int base = 0; base < worker->packets; base += SHARD_WINDOW) {
+        int n = worker->packets - base < SHARD_WINDOW ? worker->packets - base : SHARD_WINDOW;
+        for (int i = 0; i < n; i++) {
+            sharded_register_packet(worker->engine, worker->first_id + base + i, SHARD_FRAGS * SHARD_FRAG_SIZE);
+        }
+        // Fragments of a window of packets are interleaved, last fragment first.
+        for (int frag = SHARD_FRAGS - 1; frag >= 0; frag--) {
+            for (int i = 0; i < n; i++) {
+                uint64_t start = defrag_monotonic_ns();
+                sharded_add_fragment_ex(worker->engine, worker->first_id + base + i, frag * SHARD_FRAG_SIZE,
+                                        payload, SHARD_FRAG_SIZE, frag == SHARD_FRAGS - 1 ? FRAGMENT_FLAG_LAST : 0);
+                worker->latencies[sample++] = defrag_monotonic_ns() - start;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Releases through the shard's own system: the shard lock is already held.
+static void shard_release_completed(void* user, DefragmenterSystem* system, int packet_id, char* data, int length) {
+    (void)user;
+    (void)packet_id;
+    system_release_packet_data(system, data, length);
+}
+
+static bool bench_sharded(void) {
+    enum { TOTAL_PACKETS = 200000, SHARDS = 16, MAX_THREADS = 16 };
+    static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+    const long total_fragments = (long)TOTAL_PACKETS * SHARD_FRAGS;
+
+    uint64_t* latencies = (uint64_t*)malloc(total_fragments * sizeof(uint64_t));
+    if (latencies == NULL) return false;
+
+    fprintf(report, "\n--- sharded engine: %d shards, %d packets x %d fragments, %ld online CPUs ---\n",
+            SHARDS, TOTAL_PACKETS, SHARD_FRAGS, sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(report, "%8s %14s %14s %12s\n", "threads", "frags/sec", "p99 insert ns", "completed");
+
+    bool ok = true;
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        int threads = thread_counts[t];
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = TOTAL_PACKETS;
+        config.reassembly_mode = REASSEMBLY_BUFFER;
+
+        ShardedDefragmenter engine;
+        if (sharded_init(&engine, SHARDS, &config) != 0) {
+            fprintf(report, "FAIL: could not start %d shards\n", SHARDS);
+            ok = false;
+            break;
+        }
+        sharded_set_completion_handler(&engine, shard_release_completed, NULL);
+
+        pthread_t handles[MAX_THREADS];
+        ShardWorker workers[MAX_THREADS];
+        int per_thread = TOTAL_PACKETS / threads;
+        for (int i = 0; i < threads; i++) {
+            workers[i].engine = &engine;
+            workers[i].first_id = i * per_thread;
+            workers[i].packets = per_thread;
+            workers[i].latencies = latencies + (long)i * per_thread * SHARD_FRAGS;
+        }
+
+        double start = now_seconds();
+        for (int i = 0; i < threads; i++) {
+            pthread_create(&handles[i], NULL, shard_worker_run, &workers[i]);
+        }
+        for (int i = 0; i < threads; i++) {
+            pthread_join(handles[i], NULL);
+        }
+        double elapsed = now_seconds() - start;
+
+        long samples = (long)per_thread * threads * SHARD_FRAGS;
+        qsort(latencies, samples, sizeof(uint64_t), compare_u64);
+        SystemStats stats;
+        sharded_get_stats(&engine, &stats);
+        fprintf(report, "%8d %14.0f %14llu %12ld\n", threads, stats.total_fragments_processed / elapsed,
+                (unsigned long long)latencies[samples * 99 / 100], stats.packets_completed);
+        long held = 0;
+        for (int i = 0; i < engine.shard_count; i++) held += engine.shards[i].system.pools.payload_bytes_in_use;
+        if (stats.packets_completed != samples / SHARD_FRAGS || held != 0) {
+            fprintf(report, "FAIL: %ld packets completed, %ld payload bytes still held\n", stats.packets_completed, held);
+            ok = false;
+        }
+        sharded_cleanup(&engine);
+    }
+    free(latencies);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    report = stdout;
+
+    const char* which = argc > 1 ? argv[1] : "all";
+    bool all = strcmp(which, "all") == 0;
+
+    bool ok = true;
+    if (all || strcmp(which, "table") == 0) bench_packet_table();
+    if (all || strcmp(which, "buffer") == 0) bench_reassembly_buffer();
+    if (all || strcmp(which, "churn") == 0) bench_pool_churn();
+    if (all || strcmp(which, "batch") == 0) bench_batch_ingest();
+    if (all || strcmp(which, "prune") == 0) bench_prune();
+    if (all || strcmp(which, "shard") == 0) ok = bench_sharded() && ok;
+    if (all || strcmp(which, "layout") == 0) bench_layout();
+    if (all || strcmp(which, "coverage") == 0) ok = bench_coverage_index() && ok;
+    if (all || strcmp(which, "bitmap") == 0) ok = bench_bitmap_coverage() && ok;
+    if (all || strcmp(which, "overlap") == 0) ok = bench_overlap() && ok;
+    if (all || strcmp(which, "budget") == 0) ok = bench_budget() && ok;
+    if (all || strcmp(which, "metrics") == 0) ok = bench_metrics() && ok;
+    if (all || strcmp(which, "stream") == 0) ok = bench_stream() && ok;
+    if (all || strcmp(which, "snapshot") == 0) ok = bench_snapshot() && ok;
+    if (all || strcmp(which, "checksum") == 0) ok = bench_checksum() && ok;
+    if (all || strcmp(which, "flow") == 0) ok = bench_flows() && ok;
+    if (all || strcmp(which, "gather") == 0) ok = bench_gather() && ok;
+    if (all || strcmp(which, "clock") == 0) ok = bench_clock() && ok;
+
+    fflush(report);
+    return ok ? 0 : 1;
+}
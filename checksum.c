@@ -0,0 +1,215 @@
+#include <string.h>
+#include "checksum.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86 1
+#include <immintrin.h>
+#endif
+
+typedef uint64_t (*ChecksumCopyFn)(void* to, const void* from, size_t length);
+typedef uint64_t (*ChecksumAddFn)(const void* data, size_t length);
+
+// The odd trailing byte is the low half of a little-endian word.
+static uint64_t checksum_tail(const unsigned char* p, size_t length) {
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) sum += (uint64_t)p[i] | (uint64_t)p[i + 1] << 8;
+    if (i < length) sum += p[i];
+    return sum;
+}
+
+// Words are read as little-endian whatever the host order, to match
+// checksum_tail and the vector kernels.
+static uint64_t checksum_load_le64(const unsigned char* p) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t word;
+    memcpy(&word, p, 8);
+    return word;
+#else
+    uint64_t word = 0;
+    for (int k = 7; k >= 0; k--) word = word << 8 | p[k];
+    return word;
+#endif
+}
+
+// Adding both 32-bit halves of each word into 64 bits cannot overflow for
+// any length a fragment can have.
+static uint64_t checksum_copy_scalar(void* to, const void* from, size_t length) {
+    const unsigned char* src = (const unsigned char*)from;
+    unsigned char* dst = (unsigned char*)to;
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word = checksum_load_le64(src + i);
+        memcpy(dst + i, src + i, 8);
+        sum += (word & 0xffffffffu) + (word >> 32);
+    }
+    memcpy(dst + i, src + i, length - i);
+    return sum + checksum_tail(src + i, length - i);
+}
+
+static uint64_t checksum_add_scalar(const void* data, size_t length) {
+    const unsigned char* src = (const unsigned char*)data;
+    uint64_t sum = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word = checksum_load_le64(src + i);
+        sum += (word & 0xffffffffu) + (word >> 32);
+    }
+    return sum + checksum_tail(src + i, length - i);
+}
+
+#if CHECKSUM_X86
+// Each vector is split into the low and high 16-bit word of every 32-bit
+// lane, and both go into 32-bit accumulators. Those are widened into the
+// 64-bit sum every CHECKSUM_BLOCK_VECTORS vectors, before they can overflow.
+#define CHECKSUM_BLOCK_VECTORS 32768
+
+__attribute__((target("sse2")))
+static uint64_t checksum_sse2(void* to, const void* from, size_t length, bool copy) {
+    const unsigned char* src = (const unsigned char*)from;
+    unsigned char* dst = (unsigned char*)to;
+    const __m128i low_words = _mm_set1_epi32(0xffff);
+    uint64_t sum = 0;
+    size_t i = 0;
+    while (i + 16 <= length) {
+        __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+        size_t block_end = length - i > (size_t)CHECKSUM_BLOCK_VECTORS * 16 ? i + (size_t)CHECKSUM_BLOCK_VECTORS * 16 : length;
+        for (; i + 16 <= block_end; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+            if (copy) _mm_storeu_si128((__m128i*)(dst + i), v);
+            low = _mm_add_epi32(low, _mm_and_si128(v, low_words));
+            high = _mm_add_epi32(high, _mm_srli_epi32(v, 16));
+        }
+        uint32_t lanes[8];
+        _mm_storeu_si128((__m128i*)lanes, low);
+        _mm_storeu_si128((__m128i*)(lanes + 4), high);
+        for (int k = 0; k < 8; k++) sum += lanes[k];
+    }
+    if (copy) memcpy(dst + i, src + i, length - i);
+    return sum + checksum_tail(src + i, length - i);
+}
+
+__attribute__((target("sse2")))
+static uint64_t checksum_copy_sse2(void* to, const void* from, size_t length) {
+    return checksum_sse2(to, from, length, true);
+}
+
+__attribute__((target("sse2")))
+static uint64_t checksum_add_sse2(const void* data, size_t length) {
+    return checksum_sse2(NULL, data, length, false);
+}
+
+__attribute__((target("avx2")))
+static uint64_t checksum_avx2(void* to, const void* from, size_t length, bool copy) {
+    const unsigned char* src = (const unsigned char*)from;
+    unsigned char* dst = (unsigned char*)to;
+    const __m256i low_words = _mm256_set1_epi32(0xffff);
+    uint64_t sum = 0;
+    size_t i = 0;
+    while (i + 32 <= length) {
+        __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+        size_t block_end = length - i > (size_t)CHECKSUM_BLOCK_VECTORS * 32 ? i + (size_t)CHECKSUM_BLOCK_VECTORS * 32 : length;
+        for (; i + 32 <= block_end; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)(src + i));
+            if (copy) _mm256_storeu_si256((__m256i*)(dst + i), v);
+            low = _mm256_add_epi32(low, _mm256_and_si256(v, low_words));
+            high = _mm256_add_epi32(high, _mm256_srli_epi32(v, 16));
+        }
+        uint32_t lanes[16];
+        _mm256_storeu_si256((__m256i*)lanes, low);
+        _mm256_storeu_si256((__m256i*)(lanes + 8), high);
+        for (int k = 0; k < 16; k++) sum += lanes[k];
+    }
+    if (copy) memcpy(dst + i, src + i, length - i);
+    return sum + checksum_tail(src + i, length - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t checksum_copy_avx2(void* to, const void* from, size_t length) {
+    return checksum_avx2(to, from, length, true);
+}
+
+__attribute__((target("avx2")))
+static uint64_t checksum_add_avx2(const void* data, size_t length) {
+    return checksum_avx2(NULL, data, length, false);
+}
+#endif
+
+static const struct {
+    const char* name;
+    ChecksumCopyFn copy;
+    ChecksumAddFn add;
+} kernels[CHECKSUM_KERNEL_COUNT] = {
+    { "scalar", checksum_copy_scalar, checksum_add_scalar },
+#if CHECKSUM_X86
+    { "sse2", checksum_copy_sse2, checksum_add_sse2 },
+    { "avx2", checksum_copy_avx2, checksum_add_avx2 },
+#else
+    { "sse2", NULL, NULL },
+    { "avx2", NULL, NULL },
+#endif
+};
+
+// -1 until the first call picks the widest kernel the CPU runs. Picking is
+// idempotent, so a race between threads only repeats it.
+static int active_kernel = -1;
+
+bool checksum_kernel_supported(ChecksumKernel kernel) {
+    switch (kernel) {
+        case CHECKSUM_KERNEL_SCALAR:
+            return true;
+#if CHECKSUM_X86
+        case CHECKSUM_KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CHECKSUM_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+bool checksum_select_kernel(ChecksumKernel kernel) {
+    if (kernel < 0 || kernel >= CHECKSUM_KERNEL_COUNT || !checksum_kernel_supported(kernel)) return false;
+    active_kernel = kernel;
+    return true;
+}
+
+ChecksumKernel checksum_active_kernel(void) {
+    if (active_kernel < 0) {
+        int best = CHECKSUM_KERNEL_SCALAR;
+        for (int k = CHECKSUM_KERNEL_SCALAR; k < CHECKSUM_KERNEL_COUNT; k++) {
+            if (checksum_kernel_supported((ChecksumKernel)k)) best = k;
+        }
+        active_kernel = best;
+    }
+    return (ChecksumKernel)active_kernel;
+}
+
+const char* checksum_kernel_name(ChecksumKernel kernel) {
+    return kernel >= 0 && kernel < CHECKSUM_KERNEL_COUNT ? kernels[kernel].name : "unknown";
+}
+
+uint64_t checksum_copy(void* to, const void* from, size_t length) {
+    return kernels[checksum_active_kernel()].copy(to, from, length);
+}
+
+uint64_t checksum_add(const void* data, size_t length) {
+    return kernels[checksum_active_kernel()].add(data, length);
+}
+
+uint16_t checksum_fold(uint64_t sum) {
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+// The kernels read little-endian words, so for data starting at an even
+// packet offset the folded sum is byte-swapped from the network-order sum
+// and is swapped back. At an odd offset every word straddles a network
+// word boundary, so the two swaps cancel and the sum is already right.
+uint16_t checksum_network_order(uint64_t sum, int packet_offset) {
+    uint16_t folded = checksum_fold(sum);
+    if (packet_offset & 1) return folded;
+    return (uint16_t)(folded << 8 | folded >> 8);
+}
@@ -0,0 +1,31 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Kernels return a 64-bit sum of the data as little-endian 16-bit words. It
+// is congruent to the Internet checksum sum modulo 0xffff, so checksum_fold
+// turns it into the 16-bit ones'-complement sum, which is byte-order
+// independent apart from a final swap (RFC 1071).
+typedef enum {
+    CHECKSUM_KERNEL_SCALAR,
+    CHECKSUM_KERNEL_SSE2,
+    CHECKSUM_KERNEL_AVX2,
+    CHECKSUM_KERNEL_COUNT
+} ChecksumKernel;
+
+
+uint64_t checksum_copy(void* to, const void* from, size_t length);
+uint64_t checksum_add(const void* data, size_t length);
+uint16_t checksum_fold(uint64_t sum);
+uint16_t checksum_network_order(uint64_t sum, int packet_offset);
+
+bool checksum_kernel_supported(ChecksumKernel kernel);
+bool checksum_select_kernel(ChecksumKernel kernel);
+ChecksumKernel checksum_active_kernel(void);
+const char* checksum_kernel_name(ChecksumKernel kernel);
+
+#endif
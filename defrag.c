@@ -1,97 +1,1007 @@
+#define _POSIX_C_SOURCE 200809L
 #include "defrag.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__)
+#define DEFRAG_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define DEFRAG_PREFETCH(addr) ((void)(addr))
+#endif
+
+// Assemblers created without pools use the heap directly.
+static void* defrag_alloc(MemoryPools* pools, PoolKind kind, size_t size) {
+    return pools != NULL ? pools_alloc(pools, kind) : malloc(size);
+}
+
+static void defrag_free(MemoryPools* pools, PoolKind kind, void* object) {
+    if (pools != NULL) pools_free(pools, kind, object);
+    else free(object);
+}
+
+void defrag_log(const DefragLogger* logger, const char* format, ...) {
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    logger->handler(logger->user, message);
+}
+
+uint64_t defrag_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int assembler_reserve_bitmap(PacketAssembler* assembler, int size) {
+    int blocks = (size + COVERAGE_BLOCK_BYTES - 1) / COVERAGE_BLOCK_BYTES;
+    int words = (blocks + 63) / 64;
+    if (words <= assembler->bitmap_words) return 0;
+
+    int old_bytes = assembler->bitmap_words * (int)sizeof(uint64_t);
+    int new_bytes = words * (int)sizeof(uint64_t);
+    char* bitmap = assembler->coverage_bitmap == NULL
+        ? pools_alloc_payload(assembler->pools, new_bytes)
+        : pools_resize_payload(assembler->pools, (char*)assembler->coverage_bitmap, old_bytes, new_bytes);
+    if (bitmap == NULL) return -1;
+    memset(bitmap + old_bytes, 0, new_bytes - old_bytes);
+    assembler->coverage_bitmap = (uint64_t*)bitmap;
+    assembler->bitmap_words = words;
+    return 0;
+}
 
 PacketAssembler* create_assembler(int packet_id, int total_size) {
-    PacketAssembler* assembler = (PacketAssembler*)malloc(sizeof(PacketAssembler));
-    if (assembler == NULL) return NULL;
+    SystemConfig config;
+    system_config_init(&config);
+    return create_assembler_with_config(packet_id, total_size, &config, NULL);
+}
+
+// Sets up an assembler in place. Systems keep the assembler inside the
+// packet node; create_assembler_with_config gives it its own allocation.
+static int assembler_init(PacketAssembler* assembler, int packet_id, int total_size, const SystemConfig* config,
+                          MemoryPools* pools, uint64_t now) {
+    assembler->pools = pools;
+    assembler->logger = NULL;
+    // Resolving overlaps rewrites bytes in place, which needs the buffer.
+    // Streams hand each merged run over as it is, so they always merge; bytes
+    // they already hold win, and only the gaps of an overlapping fragment
+    // are kept.
+    ReassemblyMode mode = config->overlap_policy != OVERLAP_REJECT ? REASSEMBLY_BUFFER : config->reassembly_mode;
+    OverlapPolicy overlap_policy = config->overlap_policy;
+    if (config->streaming) {
+        mode = REASSEMBLY_MERGE;
+        overlap_policy = OVERLAP_REJECT;
+    }
+
+    assembler->buffer = NULL;
+    assembler->buffer_size = 0;
+    if (mode == REASSEMBLY_BUFFER && total_size != PACKET_SIZE_UNKNOWN) {
+        assembler->buffer = pools_alloc_payload(pools, total_size);
+        if (assembler->buffer == NULL) return -1;
+        assembler->buffer_size = total_size;
+    }
 
     assembler->packet_id = packet_id;
     assembler->total_size_expected = total_size;
     assembler->total_received_bytes = 0;
+    assembler->highest_byte_seen = 0;
     assembler->fragment_count = 0;
     assembler->last_fragment_seen = false;
+    // COVERAGE_BITMAP is only entered through bitmap_coverage below. As a
+    // configured index it means the list, so a demoted packet never falls
+    // back to a bitmap it has just freed.
+    CoverageIndex index = config->coverage_index == COVERAGE_BITMAP ? COVERAGE_LIST : config->coverage_index;
+    assembler->mode = mode;
+    assembler->coverage = index;
+    assembler->overlap_policy = overlap_policy;
     assembler->fragment_list_head = NULL;
-    assembler->last_seen_timestamp = time(NULL);
-    
-    return assembler;
-}
+    assembler->spans = assembler->inline_spans;
+    assembler->span_capacity = ASSEMBLER_INLINE_SPANS;
+    assembler->holes = 1;
+    assembler->streaming = config->streaming;
+    assembler->delivered_offset = 0;
+    assembler->stream_window = config->stream_window;
+    assembler->coverage_root = NULL;
+    assembler->coverage_seed = 2463534242u ^ (unsigned int)packet_id;
+    assembler->bytes_copied = 0;
+    assembler->bytes_trimmed = 0;
+    assembler->bytes_overwritten = 0;
+    assembler->checksum = config->verify_checksum;
+    assembler->checksum_sum = 0;
+    assembler->checksum_seed = 0;
+    assembler->last_seen_timestamp = now;
 
-void free_assembler(PacketAssembler* assembler) {
-    if (assembler == NULL) 
-        return;
+    // Buffer-mode packets start on the block bitmap. The first fragment that
+    // does not fit the block grid demotes them to the configured index.
+    assembler->coverage_bitmap = NULL;
+    assembler->bitmap_words = 0;
+    assembler->fallback_coverage = index;
+    if (mode == REASSEMBLY_BUFFER && config->bitmap_coverage) {
+        // A packet of unknown size grows its bitmap along with its buffer.
+        if (total_size != PACKET_SIZE_UNKNOWN && assembler_reserve_bitmap(assembler, total_size) != 0) {
+            pools_free_payload(pools, assembler->buffer, assembler->buffer_size);
+            return -1;
+        }
+        assembler->coverage = COVERAGE_BITMAP;
+    }
+    return 0;
+}
 
+static void assembler_release(PacketAssembler* assembler) {
     FragmentNode* curr = assembler->fragment_list_head;
     while (curr != NULL) {
         FragmentNode* to_free = curr;
         curr = curr->next;
-        free(to_free->data); 
-        free(to_free);
+        pools_free_payload(assembler->pools, to_free->data, to_free->length); 
+        defrag_free(assembler->pools, POOL_FRAGMENT, to_free);
     }
-    
+
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        for (int i = 0; i < assembler->fragment_count; i++) {
+            pools_free_payload(assembler->pools, assembler->spans[i].data, assembler->spans[i].length);
+        }
+    }
+    if (assembler->spans != assembler->inline_spans) {
+        pools_free_payload(assembler->pools, (char*)assembler->spans, assembler->span_capacity * (int)sizeof(FragmentSpan));
+    }
+    pools_free_payload(assembler->pools, (char*)assembler->coverage_bitmap, assembler->bitmap_words * (int)sizeof(uint64_t));
+    pools_free_payload(assembler->pools, assembler->buffer, assembler->buffer_size);
+}
+
+PacketAssembler* create_assembler_with_config(int packet_id, int total_size, const SystemConfig* config, MemoryPools* pools) {
+    PacketAssembler* assembler = (PacketAssembler*)malloc(sizeof(PacketAssembler));
+    if (assembler == NULL) return NULL;
+    if (assembler_init(assembler, packet_id, total_size, config, pools, defrag_monotonic_ns()) != 0) {
+        free(assembler);
+        return NULL;
+    }
+    return assembler;
+}
+
+void free_assembler(PacketAssembler* assembler) {
+    if (assembler == NULL) 
+        return;
+
+    assembler_release(assembler);
     free(assembler);
 }
 
+// Treap over the coverage intervals, keyed on offset. Intervals never overlap,
+// so the predecessor of an offset is enough to find its list neighbours.
+static void coverage_split(FragmentNode* root, int offset, FragmentNode** left, FragmentNode** right) {
+    if (root == NULL) {
+        *left = NULL;
+        *right = NULL;
+    } else if (root->offset < offset) {
+        coverage_split(root->right, offset, &root->right, right);
+        *left = root;
+    } else {
+        coverage_split(root->left, offset, left, &root->left);
+        *right = root;
+    }
+}
+
+static FragmentNode* coverage_join(FragmentNode* left, FragmentNode* right) {
+    if (left == NULL) return right;
+    if (right == NULL) return left;
+    if (left->priority > right->priority) {
+        left->right = coverage_join(left->right, right);
+        return left;
+    }
+    right->left = coverage_join(left, right->left);
+    return right;
+}
+
+static FragmentNode* coverage_find_prev(FragmentNode* root, int offset) {
+    FragmentNode* best = NULL;
+    while (root != NULL) {
+        if (root->offset < offset) {
+            best = root;
+            root = root->right;
+        } else {
+            root = root->left;
+        }
+    }
+    return best;
+}
+
+static void coverage_insert(PacketAssembler* assembler, FragmentNode* node) {
+    unsigned int x = assembler->coverage_seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    assembler->coverage_seed = x;
+
+    node->priority = x;
+    node->left = NULL;
+    node->right = NULL;
+
+    FragmentNode* left;
+    FragmentNode* right;
+    coverage_split(assembler->coverage_root, node->offset, &left, &right);
+    assembler->coverage_root = coverage_join(coverage_join(left, node), right);
+}
+
+// Removes exactly `node`. An empty fragment shares its offset with the
+// interval it is about to absorb, so erasing by key could take both.
+static FragmentNode* coverage_erase_node(FragmentNode* root, const FragmentNode* node) {
+    if (root == NULL) return NULL;
+    if (root == node) return coverage_join(root->left, root->right);
+    if (node->offset <= root->offset) root->left = coverage_erase_node(root->left, node);
+    if (node->offset >= root->offset) root->right = coverage_erase_node(root->right, node);
+    return root;
+}
+
+static void coverage_erase(PacketAssembler* assembler, const FragmentNode* node) {
+    assembler->coverage_root = coverage_erase_node(assembler->coverage_root, node);
+}
+
+// Block bitmap: bit b is set once bytes [b * 8, b * 8 + 8) are held. Set runs
+// of bits are exactly the merged intervals the list would hold, so checks on
+// a range of blocks are a handful of 64-bit mask operations.
+static uint64_t bitmap_word_mask(int word, int first, int end) {
+    int lo = first > word * 64 ? first - word * 64 : 0;
+    int hi = end < (word + 1) * 64 ? end - word * 64 : 64;
+    uint64_t mask = hi == 64 ? ~UINT64_C(0) : (UINT64_C(1) << hi) - 1;
+    return mask & (~UINT64_C(0) << lo);
+}
+
+static bool bitmap_test(const PacketAssembler* assembler, int block) {
+    if (block < 0 || block >= assembler->bitmap_words * 64) return false;
+    return (assembler->coverage_bitmap[block / 64] >> (block % 64)) & 1;
+}
+
+// Blocks past the end of the bitmap are not held yet.
+static bool bitmap_range_any(const PacketAssembler* assembler, int first, int end) {
+    int last_word = (end - 1) / 64 < assembler->bitmap_words ? (end - 1) / 64 : assembler->bitmap_words - 1;
+    for (int w = first / 64; w <= last_word; w++) {
+        if (assembler->coverage_bitmap[w] & bitmap_word_mask(w, first, end)) return true;
+    }
+    return false;
+}
+
+static bool bitmap_range_all(const PacketAssembler* assembler, int first, int end) {
+    if (end > assembler->bitmap_words * 64) return false;
+    for (int w = first / 64; w <= (end - 1) / 64; w++) {
+        uint64_t mask = bitmap_word_mask(w, first, end);
+        if ((assembler->coverage_bitmap[w] & mask) != mask) return false;
+    }
+    return true;
+}
+
+static void bitmap_set_range(PacketAssembler* assembler, int first, int end) {
+    for (int w = first / 64; w <= (end - 1) / 64; w++) {
+        assembler->coverage_bitmap[w] |= bitmap_word_mask(w, first, end);
+    }
+}
+
+// Finds the next run of held blocks at or after *block and returns it as a
+// byte interval; the final block of a packet may be only partly filled.
+static bool bitmap_next_run(const PacketAssembler* assembler, int* block, int* offset, int* length) {
+    int blocks = assembler->bitmap_words * 64;
+    int b = *block;
+    while (b < blocks && !bitmap_test(assembler, b)) {
+        if (b % 64 == 0 && assembler->coverage_bitmap[b / 64] == 0) b += 64;
+        else b++;
+    }
+    if (b >= blocks) return false;
+
+    int end = b;
+    while (end < blocks && bitmap_test(assembler, end)) {
+        if (end % 64 == 0 && assembler->coverage_bitmap[end / 64] == ~UINT64_C(0)) end += 64;
+        else end++;
+    }
+    int end_byte = end * COVERAGE_BLOCK_BYTES;
+    if (end_byte > assembler->highest_byte_seen) end_byte = assembler->highest_byte_seen;
+
+    *offset = b * COVERAGE_BLOCK_BYTES;
+    *length = end_byte - *offset;
+    *block = end;
+    return true;
+}
+
+static bool bitmap_fragment_fits(const PacketAssembler* assembler, int offset, int length, bool is_last_fragment) {
+    if (length == 0 || offset % COVERAGE_BLOCK_BYTES != 0) return false;
+    if ((offset + length) % COVERAGE_BLOCK_BYTES == 0) return true;
+    // Only the packet's final block may be partial.
+    if (assembler->total_size_expected == PACKET_SIZE_UNKNOWN) return is_last_fragment;
+    return offset + length == assembler->total_size_expected;
+}
+
+// Spills the spans to a payload allocation once the inline slots run out.
+static int assembler_reserve_spans(PacketAssembler* assembler, int needed) {
+    if (needed <= assembler->span_capacity) return 0;
+
+    int capacity = assembler->span_capacity * 2;
+    while (capacity < needed) capacity *= 2;
+    FragmentSpan* spans = (FragmentSpan*)pools_alloc_payload(assembler->pools, capacity * (int)sizeof(FragmentSpan));
+    if (spans == NULL) return -1;
+    memcpy(spans, assembler->spans, assembler->fragment_count * sizeof(FragmentSpan));
+    if (assembler->spans != assembler->inline_spans) {
+        pools_free_payload(assembler->pools, (char*)assembler->spans, assembler->span_capacity * (int)sizeof(FragmentSpan));
+    }
+    assembler->spans = spans;
+    assembler->span_capacity = capacity;
+    return 0;
+}
+
+static void assembler_reset_spans(PacketAssembler* assembler) {
+    if (assembler->spans != assembler->inline_spans) {
+        pools_free_payload(assembler->pools, (char*)assembler->spans, assembler->span_capacity * (int)sizeof(FragmentSpan));
+    }
+    assembler->spans = assembler->inline_spans;
+    assembler->span_capacity = ASSEMBLER_INLINE_SPANS;
+}
+
+// Rebuilds the bitmap's runs as buffer-mode fragment nodes (or spans) under
+// the fallback index. On failure the bitmap is left as it was.
+static int assembler_demote_bitmap(PacketAssembler* assembler) {
+    if (assembler->fallback_coverage == COVERAGE_ARRAY) {
+        // fragment_count already holds the number of runs; the spans are
+        // refilled from empty so the reservation copies nothing.
+        int runs = assembler->fragment_count;
+        assembler->fragment_count = 0;
+        if (assembler_reserve_spans(assembler, runs) != 0) {
+            assembler->fragment_count = runs;
+            return -1;
+        }
+        int block = 0, offset, length;
+        while (bitmap_next_run(assembler, &block, &offset, &length)) {
+            FragmentSpan* span = &assembler->spans[assembler->fragment_count++];
+            span->offset = offset;
+            span->length = length;
+            span->data = NULL;
+        }
+        assembler->coverage = COVERAGE_ARRAY;
+        pools_free_payload(assembler->pools, (char*)assembler->coverage_bitmap, assembler->bitmap_words * (int)sizeof(uint64_t));
+        assembler->coverage_bitmap = NULL;
+        assembler->bitmap_words = 0;
+        return 0;
+    }
+
+    FragmentNode* head = NULL;
+    FragmentNode** tail = &head;
+    int block = 0, offset, length;
+    while (bitmap_next_run(assembler, &block, &offset, &length)) {
+        FragmentNode* node = (FragmentNode*)defrag_alloc(assembler->pools, POOL_FRAGMENT, sizeof(FragmentNode));
+        if (node == NULL) {
+            while (head != NULL) {
+                FragmentNode* to_free = head;
+                head = head->next;
+                defrag_free(assembler->pools, POOL_FRAGMENT, to_free);
+            }
+            return -1;
+        }
+        node->offset = offset;
+        node->length = length;
+        node->data = NULL;
+        node->next = NULL;
+        *tail = node;
+        tail = &node->next;
+    }
+
+    assembler->fragment_list_head = head;
+    assembler->coverage = assembler->fallback_coverage;
+    if (assembler->coverage == COVERAGE_TREE) {
+        for (FragmentNode* node = head; node != NULL; node = node->next) {
+            coverage_insert(assembler, node);
+        }
+    }
+    pools_free_payload(assembler->pools, (char*)assembler->coverage_bitmap, assembler->bitmap_words * (int)sizeof(uint64_t));
+    assembler->coverage_bitmap = NULL;
+    assembler->bitmap_words = 0;
+    return 0;
+}
+
+// A buffer-mode assembler of unknown size grows its buffer in powers of two
+// until the last fragment fixes the size, then trims it to fit exactly.
+static int assembler_reserve_buffer(PacketAssembler* assembler, int size, bool exact) {
+    // An empty first fragment still gets a buffer, so later code never
+    // offsets a NULL one.
+    if (!exact && size <= assembler->buffer_size && assembler->buffer != NULL) return 0;
+
+    int new_size = size;
+    if (!exact) {
+        new_size = assembler->buffer_size > 0 ? assembler->buffer_size : ASSEMBLER_MIN_BUFFER_BYTES;
+        while (new_size < size) new_size *= 2;
+        if (new_size > MAX_PACKET_SIZE_BYTES) new_size = MAX_PACKET_SIZE_BYTES;
+    }
+
+    char* new_buffer;
+    if (assembler->buffer == NULL) {
+        new_buffer = pools_alloc_payload(assembler->pools, new_size);
+    } else {
+        new_buffer = pools_resize_payload(assembler->pools, assembler->buffer, assembler->buffer_size, new_size);
+        if (new_buffer != NULL && new_buffer != assembler->buffer) {
+            assembler->bytes_copied += assembler->buffer_size < new_size ? assembler->buffer_size : new_size;
+        }
+    }
+    if (new_buffer == NULL) return -1;
+    assembler->buffer = new_buffer;
+    assembler->buffer_size = new_size;
+    return 0;
+}
+
+// Decides whether a new fragment at `offset` replaces the bytes it shares
+// with a held interval starting at `held_start`.
+static bool overlap_new_wins(OverlapPolicy policy, int held_start, int offset) {
+    switch (policy) {
+        case OVERLAP_LAST: return true;
+        case OVERLAP_BSD: return held_start > offset;
+        case OVERLAP_LINUX: return held_start >= offset;
+        default: return false;
+    }
+}
+
+static void assembler_note_fragment(PacketAssembler* assembler, int offset, int length, int fresh_bytes, bool is_last_fragment) {
+    assembler->total_received_bytes += fresh_bytes;
+    if (offset + length > assembler->highest_byte_seen) {
+        assembler->highest_byte_seen = offset + length;
+    }
+    if (is_last_fragment) {
+        assembler->last_fragment_seen = true;
+        if (assembler->total_size_expected == PACKET_SIZE_UNKNOWN) {
+            assembler->total_size_expected = offset + length;
+        }
+    }
+}
+
+// Gather mode's completion count. A fragment placed in the gap between
+// `gap_start` and `gap_end` (-1 when no interval follows it) leaves a gap on
+// each side it does not reach, so the count moves by at most one. Called
+// after the fragment is noted, so a last fragment has already fixed the size.
+static void assembler_fill_gap(PacketAssembler* assembler, int gap_start, int gap_end, int offset, int length) {
+    if (gap_end < 0) {
+        gap_end = assembler->total_size_expected != PACKET_SIZE_UNKNOWN ? assembler->total_size_expected : INT_MAX;
+    }
+    assembler->holes += (offset > gap_start) + (offset + length < gap_end) - 1;
+}
+
+// Checks shared by both overlap paths before any byte is written.
+static bool assembler_accept_overlap(PacketAssembler* assembler, int offset, int length, bool is_last_fragment) {
+    // A retransmitted last fragment may overlap itself; a different one may not.
+    if (is_last_fragment && assembler->last_fragment_seen && offset + length != assembler->total_size_expected) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (LFF already received, this is a new invalid fragment).", assembler->packet_id);
+        return false;
+    }
+    if (assembler->total_size_expected == PACKET_SIZE_UNKNOWN) {
+        if (assembler_reserve_buffer(assembler, offset + length, is_last_fragment) != 0) return false;
+        if (assembler->coverage == COVERAGE_BITMAP && assembler_reserve_bitmap(assembler, offset + length) != 0) return false;
+    }
+    return true;
+}
+
+// Copies a fragment's bytes into place. With checksums on they are summed in
+// the same pass, so completion can verify the packet without rereading it.
+static void assembler_copy_in(PacketAssembler* assembler, char* to, const char* from, int length, int packet_offset) {
+    if (length == 0) return;
+    if (!assembler->checksum) {
+        memcpy(to, from, length);
+        return;
+    }
+    assembler->checksum_sum += checksum_network_order(checksum_copy(to, from, length), packet_offset);
+}
+
+// Writes the piece [from, to) of a new fragment: into a gap, over held bytes
+// it wins, or nowhere if the held bytes win. Returns the fresh bytes written.
+static int overlap_write(PacketAssembler* assembler, int from, int to, const char* data, int offset, bool held, bool new_wins) {
+    if (from >= to) return 0;
+    if (held && !new_wins) {
+        assembler->bytes_trimmed += to - from;
+        return 0;
+    }
+    if (held && assembler->checksum) {
+        // Ones'-complement subtraction of the bytes about to be replaced.
+        assembler->checksum_sum += 0xffff - checksum_network_order(checksum_add(assembler->buffer + from, to - from), from);
+    }
+    assembler_copy_in(assembler, assembler->buffer + from, data + (from - offset), to - from, from);
+    assembler->bytes_copied += to - from;
+    if (held) {
+        assembler->bytes_overwritten += to - from;
+        return 0;
+    }
+    return to - from;
+}
+
+// Resolves a fragment that overlaps held intervals, starting at `first`. The
+// overlapped intervals collapse in place into `first`, so trimming allocates
+// nothing. `left` is the interval before `first` when the two may now touch.
+static int assembler_resolve_overlap(PacketAssembler* assembler, FragmentNode* left, FragmentNode* first,
+                                     int offset, const char* data, int length, bool is_last_fragment) {
+    int end = offset + length;
+    int pos = offset;
+    int fresh = 0;
+    FragmentNode* last = first;
+    for (FragmentNode* node = first; node != NULL && node->offset < end; node = node->next) {
+        fresh += overlap_write(assembler, pos, node->offset, data, offset, false, true);
+        if (node->offset > pos) pos = node->offset;
+        int held_end = node->offset + node->length < end ? node->offset + node->length : end;
+        overlap_write(assembler, pos, held_end, data, offset, true,
+                      overlap_new_wins(assembler->overlap_policy, node->offset, offset));
+        if (held_end > pos) pos = held_end;
+        last = node;
+    }
+    fresh += overlap_write(assembler, pos, end, data, offset, false, true);
+
+    int union_start = first->offset < offset ? first->offset : offset;
+    int union_end = last->offset + last->length > end ? last->offset + last->length : end;
+    while (first != last) {
+        FragmentNode* gone = first->next;
+        first->next = gone->next;
+        if (gone == last) last = first;
+        if (assembler->coverage == COVERAGE_TREE) coverage_erase(assembler, gone);
+        defrag_free(assembler->pools, POOL_FRAGMENT, gone);
+        assembler->fragment_count--;
+    }
+    if (union_start != first->offset && assembler->coverage == COVERAGE_TREE) {
+        coverage_erase(assembler, first);
+        first->offset = union_start;
+        coverage_insert(assembler, first);
+    }
+    first->offset = union_start;
+    first->length = union_end - union_start;
+
+    FragmentNode* next = first->next;
+    if (next != NULL && union_end == next->offset) {
+        first->length += next->length;
+        first->next = next->next;
+        if (assembler->coverage == COVERAGE_TREE) coverage_erase(assembler, next);
+        defrag_free(assembler->pools, POOL_FRAGMENT, next);
+        assembler->fragment_count--;
+    }
+    if (left != NULL && left->offset + left->length == first->offset) {
+        left->length += first->length;
+        left->next = first->next;
+        if (assembler->coverage == COVERAGE_TREE) coverage_erase(assembler, first);
+        defrag_free(assembler->pools, POOL_FRAGMENT, first);
+        assembler->fragment_count--;
+    }
+
+    assembler_note_fragment(assembler, offset, length, fresh, is_last_fragment);
+    return fresh > 0 ? FRAGMENT_ADDED : FRAGMENT_DUPLICATE;
+}
+
+// Bitmap form of the same resolution. Only the held run covering `offset`
+// can start at or before it; every other run in range starts after it.
+static int assembler_resolve_overlap_bitmap(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment) {
+    int first = offset / COVERAGE_BLOCK_BYTES;
+    int end = (offset + length + COVERAGE_BLOCK_BYTES - 1) / COVERAGE_BLOCK_BYTES;
+    int frag_end = offset + length;
+
+    int runs_before = 0;
+    int scan_from = first > 0 ? first - 1 : 0;
+    for (int b = scan_from; b <= end; b++) {
+        if (bitmap_test(assembler, b) && (b == scan_from || !bitmap_test(assembler, b - 1))) runs_before++;
+    }
+
+    int left_start = bitmap_test(assembler, first - 1) ? offset - 1 : offset;
+    bool in_left_run = bitmap_test(assembler, first);
+    int fresh = 0;
+    for (int b = first; b < end; ) {
+        bool held = bitmap_test(assembler, b);
+        int e = b + 1;
+        while (e < end && bitmap_test(assembler, e) == held) e++;
+        int from = b * COVERAGE_BLOCK_BYTES;
+        int to = e * COVERAGE_BLOCK_BYTES < frag_end ? e * COVERAGE_BLOCK_BYTES : frag_end;
+        int held_start = in_left_run ? left_start : from;
+        fresh += overlap_write(assembler, from, to, data, offset, held,
+                               overlap_new_wins(assembler->overlap_policy, held_start, offset));
+        in_left_run = false;
+        b = e;
+    }
+
+    bitmap_set_range(assembler, first, end);
+    assembler->fragment_count += 1 - runs_before;
+    assembler_note_fragment(assembler, offset, length, fresh, is_last_fragment);
+    return fresh > 0 ? FRAGMENT_ADDED : FRAGMENT_DUPLICATE;
+}
+
+static int assembler_add_fragment_bitmap(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment) {
+    int first = offset / COVERAGE_BLOCK_BYTES;
+    int end = (offset + length + COVERAGE_BLOCK_BYTES - 1) / COVERAGE_BLOCK_BYTES;
+    bool joins_left = bitmap_test(assembler, first - 1);
+    bool joins_right = bitmap_test(assembler, end);
+
+    if (assembler->overlap_policy != OVERLAP_REJECT && bitmap_range_any(assembler, first, end)) {
+        if (!assembler_accept_overlap(assembler, offset, length, is_last_fragment)) return FRAGMENT_INVALID;
+        return assembler_resolve_overlap_bitmap(assembler, offset, data, length, is_last_fragment);
+    }
+
+    // A duplicate is a fragment that matches one held interval exactly.
+    if (!joins_left && !joins_right && bitmap_range_all(assembler, first, end)) {
+        return FRAGMENT_DUPLICATE;
+    }
+    if (bitmap_range_any(assembler, first, end)) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d overlaps with data already held).",
+               assembler->packet_id, offset);
+        return FRAGMENT_INVALID;
+    }
+    if (is_last_fragment && assembler->last_fragment_seen) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (LFF already received, this is a new invalid fragment).", assembler->packet_id);
+        return FRAGMENT_INVALID;
+    }
+
+    bool size_known = assembler->total_size_expected != PACKET_SIZE_UNKNOWN;
+    if (!size_known && (assembler_reserve_buffer(assembler, offset + length, is_last_fragment) != 0 ||
+                        assembler_reserve_bitmap(assembler, offset + length) != 0)) {
+        return FRAGMENT_INVALID;
+    }
+
+    assembler_copy_in(assembler, assembler->buffer + offset, data, length, offset);
+    bitmap_set_range(assembler, first, end);
+    assembler->bytes_copied += length;
+    assembler->total_received_bytes += length;
+    assembler->fragment_count += 1 - joins_left - joins_right;
+    if (offset + length > assembler->highest_byte_seen) {
+        assembler->highest_byte_seen = offset + length;
+    }
+    if (is_last_fragment) {
+        assembler->last_fragment_seen = true;
+        if (!size_known) {
+            assembler->total_size_expected = offset + length;
+        }
+    }
+    return FRAGMENT_ADDED;
+}
+
+// Span array: the same merged intervals as the list, stored contiguously, so
+// finding a fragment's neighbours is a binary search over a cache line or two
+// instead of a pointer chase. Returns the first span starting at or after `offset`.
+static int span_search(const PacketAssembler* assembler, int offset) {
+    int lo = 0, hi = assembler->fragment_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (assembler->spans[mid].offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool span_overlaps(const PacketAssembler* assembler, int offset, int length) {
+    int i = span_search(assembler, offset);
+    if (i > 0 && assembler->spans[i - 1].offset + assembler->spans[i - 1].length > offset) return true;
+    return i < assembler->fragment_count && assembler->spans[i].offset < offset + length;
+}
+
+// Overlap policies work on fragment nodes, so a packet that sees an overlap
+// moves its spans to the list, data and all. On failure nothing changes.
+static int assembler_demote_spans(PacketAssembler* assembler) {
+    FragmentNode* head = NULL;
+    FragmentNode** tail = &head;
+    for (int i = 0; i < assembler->fragment_count; i++) {
+        FragmentNode* node = (FragmentNode*)defrag_alloc(assembler->pools, POOL_FRAGMENT, sizeof(FragmentNode));
+        if (node == NULL) {
+            while (head != NULL) {
+                FragmentNode* to_free = head;
+                head = head->next;
+                defrag_free(assembler->pools, POOL_FRAGMENT, to_free);
+            }
+            return -1;
+        }
+        node->offset = assembler->spans[i].offset;
+        node->length = assembler->spans[i].length;
+        node->data = assembler->spans[i].data;
+        node->next = NULL;
+        *tail = node;
+        tail = &node->next;
+    }
+
+    assembler->fragment_list_head = head;
+    assembler->coverage = COVERAGE_LIST;
+    assembler_reset_spans(assembler);
+    return 0;
+}
+
+static int assembler_add_fragment_array(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment) {
+    int count = assembler->fragment_count;
+    int i = span_search(assembler, offset);
+    FragmentSpan* prev = i > 0 ? &assembler->spans[i - 1] : NULL;
+    FragmentSpan* next = i < count ? &assembler->spans[i] : NULL;
+
+    if (next != NULL && next->offset == offset && next->length == length) {
+        return FRAGMENT_DUPLICATE;
+    }
+    if (prev != NULL && prev->offset + prev->length > offset) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).",
+               assembler->packet_id, offset, prev->offset);
+        return FRAGMENT_INVALID;
+    }
+    if (next != NULL && offset + length > next->offset) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).",
+               assembler->packet_id, offset, next->offset);
+        return FRAGMENT_INVALID;
+    }
+    if (is_last_fragment && assembler->last_fragment_seen) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (LFF already received, this is a new invalid fragment).", assembler->packet_id);
+        return FRAGMENT_INVALID;
+    }
+
+    bool size_known = assembler->total_size_expected != PACKET_SIZE_UNKNOWN;
+    if (assembler->mode == REASSEMBLY_BUFFER && !size_known &&
+        assembler_reserve_buffer(assembler, offset + length, is_last_fragment) != 0) {
+        return FRAGMENT_INVALID;
+    }
+
+    // Gather mode keeps every fragment as a span of its own.
+    bool gather = assembler->mode == REASSEMBLY_GATHER;
+    int gap_start = prev != NULL ? prev->offset + prev->length : 0;
+    int gap_end = next != NULL ? next->offset : -1;
+    bool joins_prev = !gather && prev != NULL && gap_start == offset;
+    bool joins_next = !gather && next != NULL && offset + length == gap_end;
+    if (!joins_prev && !joins_next) {
+        if (assembler_reserve_spans(assembler, count + 1) != 0) return FRAGMENT_INVALID;
+        prev = i > 0 ? &assembler->spans[i - 1] : NULL;
+        next = i < count ? &assembler->spans[i] : NULL;
+    }
+
+    // Every allocation happens before the spans change, so a failure leaves
+    // the packet as it was. Merge mode copies each byte into its final run
+    // once instead of first into a node of its own.
+    if (assembler->mode != REASSEMBLY_BUFFER) {
+        if (joins_prev) {
+            int new_len = prev->length + length + (joins_next ? next->length : 0);
+            char* merged = pools_resize_payload(assembler->pools, prev->data, prev->length, new_len);
+            if (merged == NULL) return FRAGMENT_INVALID;
+            if (merged != prev->data) assembler->bytes_copied += prev->length;
+            assembler_copy_in(assembler, merged + prev->length, data, length, offset);
+            assembler->bytes_copied += length;
+            if (joins_next) {
+                memcpy(merged + prev->length + length, next->data, next->length);
+                assembler->bytes_copied += next->length;
+                pools_free_payload(assembler->pools, next->data, next->length);
+            }
+            prev->data = merged;
+        } else if (joins_next) {
+            char* merged = pools_alloc_payload(assembler->pools, length + next->length);
+            if (merged == NULL) return FRAGMENT_INVALID;
+            assembler_copy_in(assembler, merged, data, length, offset);
+            memcpy(merged + length, next->data, next->length);
+            assembler->bytes_copied += length + next->length;
+            pools_free_payload(assembler->pools, next->data, next->length);
+            next->data = merged;
+        } else {
+            char* copy = pools_alloc_payload(assembler->pools, length);
+            if (copy == NULL) return FRAGMENT_INVALID;
+            assembler_copy_in(assembler, copy, data, length, offset);
+            assembler->bytes_copied += length;
+            data = copy;
+        }
+    } else {
+        assembler_copy_in(assembler, assembler->buffer + offset, data, length, offset);
+        assembler->bytes_copied += length;
+    }
+
+    if (joins_prev) {
+        prev->length += length;
+        if (joins_next) {
+            prev->length += next->length;
+            memmove(next, next + 1, (count - i - 1) * sizeof(FragmentSpan));
+            assembler->fragment_count--;
+        }
+    } else if (joins_next) {
+        next->offset = offset;
+        next->length += length;
+    } else {
+        memmove(&assembler->spans[i + 1], &assembler->spans[i], (count - i) * sizeof(FragmentSpan));
+        assembler->spans[i].offset = offset;
+        assembler->spans[i].length = length;
+        assembler->spans[i].data = assembler->mode != REASSEMBLY_BUFFER ? (char*)data : NULL;
+        assembler->fragment_count++;
+    }
+
+    assembler->total_received_bytes += length;
+    if (offset + length > assembler->highest_byte_seen) {
+        assembler->highest_byte_seen = offset + length;
+    }
+    if (is_last_fragment) {
+        assembler->last_fragment_seen = true;
+        if (!size_known) {
+            assembler->total_size_expected = offset + length;
+        }
+    }
+    // An empty last fragment fills no gap unless it closes the open end.
+    if (gather && (length > 0 || !size_known)) {
+        assembler_fill_gap(assembler, gap_start, gap_end, offset, length);
+    }
+    return FRAGMENT_ADDED;
+}
+
+// Finds the first held interval that ends after `pos`.
+static bool assembler_next_held(const PacketAssembler* assembler, int pos, int* start, int* end) {
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        for (int i = 0; i < assembler->fragment_count; i++) {
+            const FragmentSpan* span = &assembler->spans[i];
+            if (span->offset + span->length > pos) {
+                *start = span->offset;
+                *end = span->offset + span->length;
+                return true;
+            }
+        }
+        return false;
+    }
+    FragmentNode* node = assembler->fragment_list_head;
+    if (assembler->coverage == COVERAGE_TREE) {
+        FragmentNode* prev = coverage_find_prev(assembler->coverage_root, pos);
+        if (prev != NULL) node = prev;
+    }
+    while (node != NULL && node->offset + node->length <= pos) node = node->next;
+    if (node == NULL) return false;
+    *start = node->offset;
+    *end = node->offset + node->length;
+    return true;
+}
+
+// A stream keeps the bytes it already holds, like a TCP receiver given a
+// retransmission that was cut up differently. Each gap the fragment covers
+// is added on its own; the held bytes are counted as trimmed.
+static int assembler_add_stream_pieces(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment) {
+    int end = offset + length;
+    int pos = offset;
+    bool added = false;
+    while (pos < end) {
+        int held_start, held_end;
+        bool held = assembler_next_held(assembler, pos, &held_start, &held_end);
+        if (held && held_start <= pos) {
+            int stop = held_end < end ? held_end : end;
+            assembler->bytes_trimmed += stop - pos;
+            pos = stop;
+            continue;
+        }
+        int stop = held && held_start < end ? held_start : end;
+        int result = assembler_add_fragment(assembler, pos, data + (pos - offset), stop - pos, is_last_fragment && stop == end);
+        if (result == FRAGMENT_INVALID) return added ? FRAGMENT_ADDED : FRAGMENT_INVALID;
+        added = added || result == FRAGMENT_ADDED;
+        pos = stop;
+    }
+    // The end was already held; the flag still marks the end of the stream.
+    if (is_last_fragment && !assembler->last_fragment_seen &&
+        assembler_add_fragment(assembler, end, data + length, 0, true) == FRAGMENT_ADDED) {
+        added = true;
+    }
+    return added ? FRAGMENT_ADDED : FRAGMENT_DUPLICATE;
+}
+
 int assembler_add_fragment(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment) {
 
     if (offset < 0) {
-         printf("Skipping fragment for packet %d (Invalid offset: %d).\n", assembler->packet_id, offset);
+         DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Invalid offset: %d).", assembler->packet_id, offset);
          return FRAGMENT_INVALID;
     }
-    if (offset + length > assembler->total_size_expected) {
-        printf("Skipping fragment for packet %d (Fragment at offset %d, length %d exceeds total size %d).\n",assembler->packet_id, offset, length, assembler->total_size_expected);
-        return FRAGMENT_INVALID;
+    if (assembler->streaming && offset < assembler->delivered_offset && length >= 0) {
+        // Bytes the consumer already has are trimmed, like a TCP receiver
+        // dropping the old part of a retransmission. A last fragment ending
+        // exactly there still marks the end of the stream.
+        long end = (long)offset + length;
+        if (end < assembler->delivered_offset || (end == assembler->delivered_offset && !is_last_fragment)) {
+            assembler->bytes_trimmed += length;
+            return FRAGMENT_DUPLICATE;
+        }
+        int delivered = assembler->delivered_offset - offset;
+        assembler->bytes_trimmed += delivered;
+        offset += delivered;
+        data += delivered;
+        length -= delivered;
     }
-
-    FragmentNode* new_frag = (FragmentNode*)malloc(sizeof(FragmentNode));
-    if (new_frag == NULL) 
+    bool size_known = assembler->total_size_expected != PACKET_SIZE_UNKNOWN;
+    int size_limit = size_known ? assembler->total_size_expected : MAX_PACKET_SIZE_BYTES;
+    if (assembler->streaming) {
+        // A stream of unknown length is bounded by its receive window alone.
+        long window_end = (long)assembler->delivered_offset + assembler->stream_window;
+        if (!size_known) size_limit = INT_MAX;
+        if (length >= 0 && (long)offset + length > window_end && window_end < size_limit) {
+            DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d, length %d is beyond the receive window ending at %ld).",
+                   assembler->packet_id, offset, length, window_end);
+            return FRAGMENT_INVALID;
+        }
+    }
+    if (length < 0 || offset > size_limit - length) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d, length %d exceeds total size %d).",assembler->packet_id, offset, length, size_limit);
         return FRAGMENT_INVALID;
-    
-    new_frag->offset = offset;
-    new_frag->length = length;
-    new_frag->data = (char*)malloc(length + 1); 
-    if (new_frag->data == NULL) {
-        free(new_frag);
+    }
+    if (!size_known && is_last_fragment && (offset + length < assembler->highest_byte_seen || offset + length == 0)) {
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (LFF ends at %d, but data up to %d is already held).",
+               assembler->packet_id, offset + length, assembler->highest_byte_seen);
         return FRAGMENT_INVALID;
     }
-    memcpy(new_frag->data, data, length);
-    new_frag->data[length] = '\0';
-    new_frag->next = NULL;
+
+    if (assembler->streaming && length > 0) {
+        int held_start, held_end;
+        if (assembler_next_held(assembler, offset, &held_start, &held_end) && held_start < offset + length &&
+            !(held_start == offset && held_end == offset + length)) {
+            return assembler_add_stream_pieces(assembler, offset, data, length, is_last_fragment);
+        }
+    }
+
+    if (assembler->mode == REASSEMBLY_GATHER && length == 0 && !is_last_fragment) {
+        // Gather mode has no interval to keep for an empty fragment.
+        return FRAGMENT_DUPLICATE;
+    }
+
+    if (assembler->coverage == COVERAGE_BITMAP) {
+        if (bitmap_fragment_fits(assembler, offset, length, is_last_fragment)) {
+            return assembler_add_fragment_bitmap(assembler, offset, data, length, is_last_fragment);
+        }
+        if (assembler_demote_bitmap(assembler) != 0) return FRAGMENT_INVALID;
+    }
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        if (assembler->overlap_policy == OVERLAP_REJECT || !span_overlaps(assembler, offset, length)) {
+            return assembler_add_fragment_array(assembler, offset, data, length, is_last_fragment);
+        }
+        if (assembler_demote_spans(assembler) != 0) return FRAGMENT_INVALID;
+    }
 
     FragmentNode* curr = assembler->fragment_list_head;
     FragmentNode* prev = NULL;
 
-    while (curr != NULL && curr->offset < offset) {
-        prev = curr;
-        curr = curr->next;
+    if (assembler->coverage == COVERAGE_TREE) {
+        prev = coverage_find_prev(assembler->coverage_root, offset);
+        curr = prev != NULL ? prev->next : assembler->fragment_list_head;
+    } else {
+        while (curr != NULL && curr->offset < offset) {
+            prev = curr;
+            curr = curr->next;
+        }
     }
+
+    if (assembler->overlap_policy != OVERLAP_REJECT) {
+        bool overlaps_prev = prev != NULL && prev->offset + prev->length > offset;
+        bool overlaps_curr = curr != NULL && curr->offset < offset + length;
+        if (overlaps_prev || overlaps_curr) {
+            if (!assembler_accept_overlap(assembler, offset, length, is_last_fragment)) return FRAGMENT_INVALID;
+            return assembler_resolve_overlap(assembler, overlaps_prev ? NULL : prev, overlaps_prev ? prev : curr,
+                                             offset, data, length, is_last_fragment);
+        }
+    }
+
     if (curr != NULL && curr->offset == offset && curr->length == length) {
-        free(new_frag->data);
-        free(new_frag);
         return FRAGMENT_DUPLICATE;
     }
 
     if (prev != NULL && (prev->offset + prev->length) > offset) {
-        printf("Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).\n",
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).",
                assembler->packet_id, offset, prev->offset);
-        free(new_frag->data);
-        free(new_frag);
         return FRAGMENT_INVALID;
     }
 
     if (curr != NULL && (offset + length) > curr->offset) {
-        printf("Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).\n",
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (Fragment at offset %d overlaps with existing fragment at offset %d).",
                assembler->packet_id, offset, curr->offset);
-        free(new_frag->data);
-        free(new_frag);
         return FRAGMENT_INVALID;
     }
 
     if (is_last_fragment && assembler->last_fragment_seen) {
-        printf("Skipping fragment for packet %d (LFF already received, this is a new invalid fragment).\n", assembler->packet_id);
-        free(new_frag->data);
-        free(new_frag);
+        DEFRAG_LOG(assembler->logger, "Skipping fragment for packet %d (LFF already received, this is a new invalid fragment).", assembler->packet_id);
         return FRAGMENT_INVALID;
     }
 
+    if (assembler->mode == REASSEMBLY_BUFFER && !size_known &&
+        assembler_reserve_buffer(assembler, offset + length, is_last_fragment) != 0) {
+        return FRAGMENT_INVALID;
+    }
+
+    FragmentNode* new_frag = (FragmentNode*)defrag_alloc(assembler->pools, POOL_FRAGMENT, sizeof(FragmentNode));
+    if (new_frag == NULL) 
+        return FRAGMENT_INVALID;
+    
+    new_frag->offset = offset;
+    new_frag->length = length;
+    new_frag->data = NULL;
+    if (assembler->mode != REASSEMBLY_BUFFER) {
+        new_frag->data = pools_alloc_payload(assembler->pools, length); 
+        if (new_frag->data == NULL) {
+            defrag_free(assembler->pools, POOL_FRAGMENT, new_frag);
+            return FRAGMENT_INVALID;
+        }
+        assembler_copy_in(assembler, new_frag->data, data, length, offset);
+        assembler->bytes_copied += length;
+    }
+    new_frag->next = NULL;
+
     FragmentNode* node_to_check_from = NULL;
     if (prev == NULL) {
         new_frag->next = assembler->fragment_list_head;
@@ -102,11 +1012,32 @@ int assembler_add_fragment(PacketAssembler* assembler, int offset, const char* d
         prev->next = new_frag;
         node_to_check_from = prev; 
     }
+    if (assembler->coverage == COVERAGE_TREE) {
+        coverage_insert(assembler, new_frag);
+    }
+    if (assembler->mode == REASSEMBLY_BUFFER) {
+        assembler_copy_in(assembler, assembler->buffer + offset, data, length, offset);
+        assembler->bytes_copied += length;
+    }
     assembler->total_received_bytes += length;
     assembler->fragment_count++;
+    if (offset + length > assembler->highest_byte_seen) {
+        assembler->highest_byte_seen = offset + length;
+    }
     
     if (is_last_fragment) {
         assembler->last_fragment_seen = true;
+        if (!size_known) {
+            assembler->total_size_expected = offset + length;
+        }
+    }
+
+    if (assembler->mode == REASSEMBLY_GATHER) {
+        if (length > 0 || !size_known) {
+            assembler_fill_gap(assembler, prev != NULL ? prev->offset + prev->length : 0,
+                               curr != NULL ? curr->offset : -1, offset, length);
+        }
+        return FRAGMENT_ADDED;
     }
 
     while (node_to_check_from != NULL && node_to_check_from->next != NULL) {
@@ -114,23 +1045,46 @@ int assembler_add_fragment(PacketAssembler* assembler, int offset, const char* d
         
         if ((node_to_check_from->offset + node_to_check_from->length) == next_node->offset) {
             int new_len = node_to_check_from->length + next_node->length;
-            char* new_data = (char*)realloc(node_to_check_from->data, new_len + 1);
+
+            if (assembler->mode == REASSEMBLY_BUFFER) {
+                if (assembler->coverage == COVERAGE_TREE) {
+                    coverage_erase(assembler, next_node);
+                }
+                // The payload already sits in place; only the interval grows.
+                node_to_check_from->length = new_len;
+                node_to_check_from->next = next_node->next;
+                defrag_free(assembler->pools, POOL_FRAGMENT, next_node);
+                assembler->fragment_count--;
+                continue;
+            }
+
+            char* old_data = node_to_check_from->data;
+            char* new_data = pools_resize_payload(assembler->pools, old_data, node_to_check_from->length, new_len);
             
             if (new_data) {
+                if (new_data != old_data) {
+                    assembler->bytes_copied += node_to_check_from->length;
+                }
                 memcpy(new_data + node_to_check_from->length, next_node->data, next_node->length);
-                new_data[new_len] = '\0';
+                assembler->bytes_copied += next_node->length;
                 
                 node_to_check_from->data = new_data;
                 node_to_check_from->length = new_len;
                 
                 node_to_check_from->next = next_node->next;
-                free(next_node->data);
-                free(next_node);
+                if (assembler->coverage == COVERAGE_TREE) {
+                    coverage_erase(assembler, next_node);
+                }
+                pools_free_payload(assembler->pools, next_node->data, next_node->length);
+                defrag_free(assembler->pools, POOL_FRAGMENT, next_node);
                 
                 assembler->fragment_count--;
             } else {
                 node_to_check_from = node_to_check_from->next;
             }
+        } else if (node_to_check_from->offset >= offset) {
+            // Everything past the new fragment was already merged.
+            break;
         } else {
             node_to_check_from = node_to_check_from->next;
         }
@@ -141,6 +1095,23 @@ int assembler_add_fragment(PacketAssembler* assembler, int offset, const char* d
 
 
 bool assembler_is_complete(PacketAssembler* assembler) {
+    if (assembler->streaming) {
+        // Everything up to the end of the stream has been handed over.
+        return assembler->last_fragment_seen && assembler->delivered_offset == assembler->total_size_expected;
+    }
+    if (assembler->mode == REASSEMBLY_GATHER) {
+        return assembler->last_fragment_seen && assembler->holes == 0;
+    }
+    if (assembler->coverage == COVERAGE_BITMAP) {
+        // Held blocks never overlap, so a full byte count is full coverage.
+        return assembler->last_fragment_seen &&
+               assembler->total_received_bytes == assembler->total_size_expected;
+    }
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        return assembler->last_fragment_seen &&
+               assembler->total_received_bytes == assembler->total_size_expected &&
+               assembler->fragment_count == 1 && assembler->spans[0].offset == 0;
+    }
     if (assembler->last_fragment_seen &&
         assembler->total_received_bytes == assembler->total_size_expected &&
         assembler->fragment_list_head != NULL &&
@@ -152,114 +1123,673 @@ bool assembler_is_complete(PacketAssembler* assembler) {
     return false;
 }
 
-char* assembler_get_assembled_data(PacketAssembler* assembler) {
-    if (!assembler_is_complete(assembler) || assembler->fragment_list_head == NULL) {
-        return NULL;
-    }
-    
-    FragmentNode* head = assembler->fragment_list_head;
-    
-    char* full_data = (char*)malloc(head->length + 1);
-    if (full_data == NULL) return NULL;
-    
-    memcpy(full_data, head->data, head->length);
-    full_data[head->length] = '\0';
-    
-    return full_data; 
+char* assembler_get_assembled_data(PacketAssembler* assembler) {
+    if (assembler->streaming || !assembler_is_complete(assembler)) {
+        return NULL;
+    }
+    
+    // Merged and buffered packets already sit in one contiguous buffer, so it
+    // is detached and handed over rather than copied. Gather mode copies its
+    // pieces together here, once.
+    char* full_data;
+    if (assembler->mode == REASSEMBLY_GATHER) {
+        full_data = pools_alloc_payload(assembler->pools, assembler->total_size_expected);
+        if (full_data == NULL) return NULL;
+        if (assembler->coverage == COVERAGE_ARRAY) {
+            for (int i = 0; i < assembler->fragment_count; i++) {
+                memcpy(full_data + assembler->spans[i].offset, assembler->spans[i].data, assembler->spans[i].length);
+            }
+        } else {
+            for (FragmentNode* node = assembler->fragment_list_head; node != NULL; node = node->next) {
+                memcpy(full_data + node->offset, node->data, node->length);
+            }
+        }
+        assembler->bytes_copied += assembler->total_size_expected;
+    } else if (assembler->mode == REASSEMBLY_BUFFER) {
+        full_data = assembler->buffer;
+        assembler->buffer = NULL;
+    } else if (assembler->coverage == COVERAGE_ARRAY) {
+        full_data = assembler->spans[0].data;
+        assembler->spans[0].data = NULL;
+    } else {
+        full_data = assembler->fragment_list_head->data;
+        assembler->fragment_list_head->data = NULL;
+    }
+    return full_data; 
+}
+
+// Describes a complete packet as its pieces in offset order, without copying
+// it. Returns the number of parts, or -1 if the packet is not complete or
+// needs more than `max_parts`. The parts point into the assembler's own
+// storage and are valid until it is released.
+int assembler_gather(PacketAssembler* assembler, struct iovec* parts, int max_parts) {
+    if (assembler->streaming || !assembler_is_complete(assembler)) {
+        return -1;
+    }
+    if (assembler->mode == REASSEMBLY_BUFFER) {
+        if (max_parts < 1) return -1;
+        parts[0].iov_base = assembler->buffer;
+        parts[0].iov_len = (size_t)assembler->total_size_expected;
+        return 1;
+    }
+    if (assembler->fragment_count > max_parts) return -1;
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        for (int i = 0; i < assembler->fragment_count; i++) {
+            parts[i].iov_base = assembler->spans[i].data;
+            parts[i].iov_len = (size_t)assembler->spans[i].length;
+        }
+    } else {
+        int i = 0;
+        for (FragmentNode* node = assembler->fragment_list_head; node != NULL; node = node->next, i++) {
+            parts[i].iov_base = node->data;
+            parts[i].iov_len = (size_t)node->length;
+        }
+    }
+    return assembler->fragment_count;
+}
+
+void assembler_free_assembled_data(PacketAssembler* assembler, char* data) {
+    pools_free_payload(assembler->pools, data, assembler->total_size_expected);
+}
+
+// Detaches the held run that starts at the delivered offset, if there is one.
+// The caller owns the returned data and releases it with `*length` bytes.
+char* assembler_pop_prefix(PacketAssembler* assembler, int* length) {
+    char* data;
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        if (assembler->fragment_count == 0 || assembler->spans[0].offset != assembler->delivered_offset) return NULL;
+        data = assembler->spans[0].data;
+        *length = assembler->spans[0].length;
+        memmove(assembler->spans, assembler->spans + 1, (assembler->fragment_count - 1) * sizeof(FragmentSpan));
+    } else {
+        FragmentNode* head = assembler->fragment_list_head;
+        if (head == NULL || head->offset != assembler->delivered_offset) return NULL;
+        if (assembler->coverage == COVERAGE_TREE) coverage_erase(assembler, head);
+        assembler->fragment_list_head = head->next;
+        data = head->data;
+        *length = head->length;
+        defrag_free(assembler->pools, POOL_FRAGMENT, head);
+    }
+    assembler->fragment_count--;
+    assembler->delivered_offset += *length;
+    return data;
+}
+
+// The ones'-complement sum of the seed and every byte held. A packet that
+// carries its own valid checksum sums to 0xffff.
+uint16_t assembler_checksum(const PacketAssembler* assembler) {
+    return checksum_fold(assembler->checksum_sum + assembler->checksum_seed);
+}
+
+
+
+static unsigned int packet_table_hash(int key) {
+    unsigned int h = (unsigned int)key;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// The addresses and protocol fold into one word that is xored into the ID
+// ahead of the table's mixer; a plain packet ID folds them to zero and hashes
+// exactly as before. The word is forced odd for keyed flows, and the mixer is
+// a bijection, so a slot whose hash and ID match a plain ID is never a flow.
+static bool flow_key_keyed(const FlowKey* key) {
+    return (key->source | key->destination | key->protocol) != 0;
+}
+
+static unsigned int flow_key_mix(const FlowKey* key) {
+    uint64_t h = (uint64_t)key->source * 0x9e3779b97f4a7c15ull ^
+                 ((uint64_t)key->destination << 8 | key->protocol) * 0xc2b2ae3d27d4eb4full;
+    unsigned int mix = (unsigned int)(h >> 32) | 1u;
+    return flow_key_keyed(key) ? mix : 0;
+}
+
+static bool flow_key_equal(const FlowKey* a, const FlowKey* b) {
+    return a->id == b->id && a->source == b->source && a->destination == b->destination && a->protocol == b->protocol;
+}
+
+void flow_key_init(FlowKey* key, uint32_t source, uint32_t destination, uint8_t protocol, uint32_t id) {
+    key->source = source;
+    key->destination = destination;
+    key->id = id;
+    key->protocol = protocol;
+}
+
+unsigned int flow_key_hash(const FlowKey* key) {
+    return packet_table_hash((int)(key->id ^ flow_key_mix(key)));
+}
+
+static void packet_table_init(PacketTable* table) {
+    table->slots = NULL;
+    table->capacity = 0;
+    table->count = 0;
+}
+
+static void packet_table_free(PacketTable* table) {
+    free(table->slots);
+    packet_table_init(table);
+}
+
+// `flow` is NULL for a plain packet ID, whose hash and ID are the whole key.
+// A keyed flow only reaches its node once both already match.
+static PacketNode* packet_table_find(PacketTable* table, unsigned int hash, int key, const FlowKey* flow) {
+    if (table->count == 0) return NULL;
+
+    unsigned int mask = (unsigned int)table->capacity - 1;
+    unsigned int i = hash & mask;
+    while (table->slots[i].node != NULL) {
+        if (table->slots[i].hash == hash && table->slots[i].key == key &&
+            (flow == NULL || flow_key_equal(&table->slots[i].node->flow, flow))) {
+            return table->slots[i].node;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void packet_table_place(PacketSlot* slots, int capacity, unsigned int hash, int key, PacketNode* node) {
+    unsigned int mask = (unsigned int)capacity - 1;
+    unsigned int i = hash & mask;
+    while (slots[i].node != NULL) {
+        i = (i + 1) & mask;
+    }
+    slots[i].hash = hash;
+    slots[i].key = key;
+    slots[i].node = node;
+}
+
+static int packet_table_grow(PacketTable* table) {
+    int new_capacity = table->capacity == 0 ? PACKET_TABLE_MIN_CAPACITY : table->capacity * 2;
+    PacketSlot* new_slots = (PacketSlot*)calloc(new_capacity, sizeof(PacketSlot));
+    if (new_slots == NULL) return -1;
+
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i].node != NULL) {
+            packet_table_place(new_slots, new_capacity, table->slots[i].hash, table->slots[i].key, table->slots[i].node);
+        }
+    }
+    free(table->slots);
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+    return 0;
+}
+
+static int packet_table_insert(PacketTable* table, PacketNode* node) {
+    // Keep the load factor at or below 3/4 so probe sequences stay short.
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        if (packet_table_grow(table) != 0) return -1;
+    }
+    packet_table_place(table->slots, table->capacity, node->flow_hash, node->assembler.packet_id, node);
+    table->count++;
+    return 0;
+}
+
+static void packet_table_remove(PacketTable* table, const PacketNode* node) {
+    if (table->count == 0) return;
+
+    unsigned int mask = (unsigned int)table->capacity - 1;
+    unsigned int i = node->flow_hash & mask;
+    while (table->slots[i].node != NULL && table->slots[i].node != node) {
+        i = (i + 1) & mask;
+    }
+    if (table->slots[i].node == NULL) return;
+
+    // Backward-shift deletion: pull later entries of the probe run into the
+    // hole so lookups never need tombstones.
+    unsigned int hole = i;
+    unsigned int j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (table->slots[j].node == NULL) break;
+        unsigned int home = table->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            table->slots[hole] = table->slots[j];
+            hole = j;
+        }
+    }
+    table->slots[hole].node = NULL;
+    table->count--;
+}
+
+void system_config_init(SystemConfig* config) {
+    config->max_packets = MAX_PACKETS_IN_SYSTEM;
+    config->reassembly_mode = REASSEMBLY_MERGE;
+    config->coverage_index = COVERAGE_LIST;
+    config->use_pools = true;
+    config->auto_register = false;
+    config->bitmap_coverage = true;
+    config->overlap_policy = OVERLAP_REJECT;
+    config->byte_budget = 0;
+    config->eviction_policy = EVICT_OLDEST;
+    config->metrics_timing = false;
+    config->streaming = false;
+    config->stream_window = MAX_PACKET_SIZE_BYTES;
+    config->verify_checksum = false;
+    config->packet_timeout_seconds = PACKET_TIMEOUT_SECONDS;
+    // A coarse clock would go stale for callers that never batch or prune.
+    config->clock_source = CLOCK_SOURCE_MONOTONIC;
+}
+
+void system_init(DefragmenterSystem* system) {
+    SystemConfig config;
+    system_config_init(&config);
+    system_init_with_config(system, &config);
+}
+
+void system_init_with_config(DefragmenterSystem* system, const SystemConfig* config) {
+    system->head = NULL; 
+    system->tail = NULL;
+    packet_table_init(&system->table);
+    memset(&system->stats, 0, sizeof(SystemStats)); 
+    system->current_packet_count = 0;
+    system->current_fragment_count = 0;
+    system->config = *config;
+    if (system->config.coverage_index == COVERAGE_BITMAP) system->config.coverage_index = COVERAGE_LIST;
+    system->on_complete = NULL;
+    system->on_complete_user = NULL;
+    system->on_complete_flow = NULL;
+    system->on_complete_flow_user = NULL;
+    system->on_stream = NULL;
+    system->on_stream_user = NULL;
+    system->on_gather = NULL;
+    system->on_gather_user = NULL;
+    system->gather_parts = NULL;
+    system->gather_capacity = 0;
+    system->logger.handler = NULL;
+    system->logger.user = NULL;
+    system->eviction_heap = NULL;
+    system->eviction_heap_count = 0;
+    system->eviction_heap_capacity = 0;
+    histogram_init(&system->metrics.insert_latency_ns);
+    histogram_init(&system->metrics.merges_per_insert);
+    histogram_init(&system->metrics.completion_time_ns);
+    histogram_init(&system->metrics.fragments_per_packet);
+    system->timeout_ns = (uint64_t)(config->packet_timeout_seconds * 1e9);
+    // An external clock starts at zero and waits for the caller's first time.
+    system->clock_ns = config->clock_source == CLOCK_SOURCE_EXTERNAL ? 0 : defrag_monotonic_ns();
+
+    size_t object_sizes[POOL_KIND_COUNT];
+    object_sizes[POOL_FRAGMENT] = sizeof(FragmentNode);
+    object_sizes[POOL_PACKET] = sizeof(PacketNode);
+    pools_init(&system->pools, config->use_pools, object_sizes);
+}
+
+uint64_t system_clock_now(DefragmenterSystem* system) {
+    return system->config.clock_source == CLOCK_SOURCE_MONOTONIC ? defrag_monotonic_ns() : system->clock_ns;
+}
+
+// The latency histograms measure real time whatever the engine clock is. An
+// engine clock that is already monotonic supplies `now` as is.
+static uint64_t system_real_now(DefragmenterSystem* system, uint64_t now) {
+    return system->config.clock_source == CLOCK_SOURCE_MONOTONIC ? now : defrag_monotonic_ns();
+}
+
+// Refreshes a coarse clock. Meant for a periodic ticker; batches and prune
+// passes call it too, so a coarse clock is never older than the last of them.
+void system_clock_tick(DefragmenterSystem* system) {
+    if (system->config.clock_source == CLOCK_SOURCE_COARSE) {
+        system->clock_ns = defrag_monotonic_ns();
+    }
+}
+
+// Moves an external clock to `now_ns`. Capture timestamps can step back when
+// frames are reordered; the clock holds still rather than running backwards.
+void system_clock_set(DefragmenterSystem* system, uint64_t now_ns) {
+    if (now_ns > system->clock_ns) {
+        system->clock_ns = now_ns;
+    }
+}
+
+static PacketNode* system_lookup(DefragmenterSystem* system, int id) {
+    return packet_table_find(&system->table, packet_table_hash(id), id, NULL);
+}
+
+static PacketNode* system_lookup_flow(DefragmenterSystem* system, const FlowKey* flow, unsigned int hash) {
+    return packet_table_find(&system->table, hash, (int)flow->id, flow_key_keyed(flow) ? flow : NULL);
+}
+
+PacketAssembler* system_find_packet(DefragmenterSystem* system, int id) {
+    PacketNode* node = system_lookup(system, id);
+    return node != NULL ? &node->assembler : NULL;
+}
+
+// The packet list is kept in last-seen order: the head is the packet idle the
+// longest, the tail the one touched most recently.
+static void system_list_append(DefragmenterSystem* system, PacketNode* node) {
+    node->next = NULL;
+    node->prev = system->tail;
+    if (system->tail != NULL) system->tail->next = node;
+    else system->head = node;
+    system->tail = node;
+}
+
+static void system_list_detach(DefragmenterSystem* system, PacketNode* node) {
+    if (node->prev == NULL) system->head = node->next;
+    else node->prev->next = node->next;
+    if (node->next == NULL) system->tail = node->prev;
+    else node->next->prev = node->prev;
+}
+
+// Min-heap over eviction keys, kept only for the policies that cannot read
+// their victim off the packet list. Each node remembers its heap slot, so a
+// key change or removal costs O(log n).
+static bool system_uses_eviction_heap(const DefragmenterSystem* system) {
+    return system->config.byte_budget > 0 && system->config.eviction_policy != EVICT_OLDEST;
+}
+
+static long system_eviction_key(const DefragmenterSystem* system, const PacketNode* node) {
+    if (system->config.eviction_policy == EVICT_LARGEST) return -node->buffered_bytes;
+
+    // Received share of the packet in 1/65536ths. A packet of unknown size is
+    // measured against the largest size it could turn out to have.
+    const PacketAssembler* assembler = &node->assembler;
+    int size = assembler->total_size_expected != PACKET_SIZE_UNKNOWN ? assembler->total_size_expected : MAX_PACKET_SIZE_BYTES;
+    return (long)assembler->total_received_bytes * 65536 / size;
+}
+
+static void eviction_heap_place(DefragmenterSystem* system, PacketNode* node, int index) {
+    system->eviction_heap[index] = node;
+    node->heap_index = index;
+}
+
+static void eviction_heap_sift_up(DefragmenterSystem* system, int index) {
+    PacketNode* node = system->eviction_heap[index];
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (system->eviction_heap[parent]->eviction_key <= node->eviction_key) break;
+        eviction_heap_place(system, system->eviction_heap[parent], index);
+        index = parent;
+    }
+    eviction_heap_place(system, node, index);
+}
+
+static void eviction_heap_sift_down(DefragmenterSystem* system, int index) {
+    PacketNode* node = system->eviction_heap[index];
+    int count = system->eviction_heap_count;
+    while (1) {
+        int child = index * 2 + 1;
+        if (child >= count) break;
+        if (child + 1 < count && system->eviction_heap[child + 1]->eviction_key < system->eviction_heap[child]->eviction_key) {
+            child++;
+        }
+        if (system->eviction_heap[child]->eviction_key >= node->eviction_key) break;
+        eviction_heap_place(system, system->eviction_heap[child], index);
+        index = child;
+    }
+    eviction_heap_place(system, node, index);
+}
+
+static void eviction_heap_push(DefragmenterSystem* system, PacketNode* node) {
+    if (system->eviction_heap_count == system->eviction_heap_capacity) {
+        int capacity = system->eviction_heap_capacity == 0 ? EVICTION_HEAP_MIN_CAPACITY : system->eviction_heap_capacity * 2;
+        PacketNode** heap = (PacketNode**)realloc(system->eviction_heap, capacity * sizeof(PacketNode*));
+        if (heap == NULL) {
+            // The packet stays out of the heap; it can still time out.
+            DEFRAG_LOG(&system->logger, "ERROR: Could not grow eviction heap. Out of memory.");
+            return;
+        }
+        system->eviction_heap = heap;
+        system->eviction_heap_capacity = capacity;
+    }
+    node->eviction_key = system_eviction_key(system, node);
+    eviction_heap_place(system, node, system->eviction_heap_count++);
+    eviction_heap_sift_up(system, node->heap_index);
+}
+
+static void eviction_heap_remove(DefragmenterSystem* system, PacketNode* node) {
+    int index = node->heap_index;
+    if (index < 0) return;
+    node->heap_index = -1;
+
+    PacketNode* moved = system->eviction_heap[--system->eviction_heap_count];
+    if (moved == node) return;
+    eviction_heap_place(system, moved, index);
+    eviction_heap_sift_up(system, index);
+    eviction_heap_sift_down(system, moved->heap_index);
 }
 
+static void eviction_heap_update(DefragmenterSystem* system, PacketNode* node) {
+    if (node->heap_index < 0) return;
+    long key = system_eviction_key(system, node);
+    if (key == node->eviction_key) return;
+    node->eviction_key = key;
+    eviction_heap_sift_up(system, node->heap_index);
+    eviction_heap_sift_down(system, node->heap_index);
+}
 
+static void system_touch_packet(DefragmenterSystem* system, PacketNode* node, uint64_t now) {
+    node->assembler.last_seen_timestamp = now;
+    if (system->tail != node) {
+        system_list_detach(system, node);
+        system_list_append(system, node);
+    }
+}
 
-void system_init(DefragmenterSystem* system) {
-    system->head = NULL; 
-    memset(&system->stats, 0, sizeof(SystemStats)); 
-    system->current_packet_count = 0;
+static void system_unlink_packet(DefragmenterSystem* system, PacketNode* node) {
+    system_list_detach(system, node);
+
+    packet_table_remove(&system->table, node);
+    eviction_heap_remove(system, node);
+    system->stats.current_buffered_bytes -= node->buffered_bytes;
+    system->current_fragment_count -= node->assembler.fragment_count;
+    system->stats.total_bytes_copied += node->assembler.bytes_copied;
+    system->stats.total_bytes_trimmed += node->assembler.bytes_trimmed;
+    system->stats.total_bytes_overwritten += node->assembler.bytes_overwritten;
+    assembler_release(&node->assembler);
+    pools_free(&system->pools, POOL_PACKET, node);
+    system->current_packet_count--;
 }
 
-PacketAssembler* system_find_packet(DefragmenterSystem* system, int id) {
-    PacketNode* curr = system->head;
-    while (curr != NULL) {
-        if (curr->assembler->packet_id == id) {
-            return curr->assembler;
+// The packet being worked on is never its own victim, so the budget can be
+// exceeded by at most that one packet.
+static PacketNode* system_select_victim(DefragmenterSystem* system, PacketNode* keep) {
+    if (!system_uses_eviction_heap(system)) {
+        PacketNode* oldest = system->head;
+        return oldest != keep ? oldest : oldest->next;
+    }
+    if (system->eviction_heap_count == 0) return NULL;
+    if (system->eviction_heap[0] != keep) return system->eviction_heap[0];
+
+    PacketNode* best = NULL;
+    for (int child = 1; child <= 2 && child < system->eviction_heap_count; child++) {
+        if (best == NULL || system->eviction_heap[child]->eviction_key < best->eviction_key) {
+            best = system->eviction_heap[child];
         }
-        curr = curr->next;
     }
-    return NULL;
+    return best;
+}
+
+static void system_enforce_budget(DefragmenterSystem* system, PacketNode* keep) {
+    while (system->stats.current_buffered_bytes > system->config.byte_budget) {
+        PacketNode* victim = system_select_victim(system, keep);
+        if (victim == NULL) break;
+        DEFRAG_LOG(&system->logger, "--- PACKET %d EVICTED (%ld bytes buffered, budget %ld) ---",
+               victim->assembler.packet_id, system->stats.current_buffered_bytes, system->config.byte_budget);
+        system->stats.total_packets_evicted++;
+        system_unlink_packet(system, victim);
+    }
 }
 
 void system_remove_packet(DefragmenterSystem* system, int id) {
-    PacketNode* curr = system->head;
-    PacketNode* prev = NULL;
-    while (curr != NULL) {
-        if (curr->assembler->packet_id == id) {
-            if (prev == NULL) system->head = curr->next;
-            else prev->next = curr->next;
-            free_assembler(curr->assembler);
-            free(curr);
-            system->current_packet_count--;
-            return;
-        }
-        prev = curr;
-        curr = curr->next;
+    PacketNode* node = system_lookup(system, id);
+    if (node != NULL) {
+        system_unlink_packet(system, node);
     }
 }
 
-int system_register_packet(DefragmenterSystem* system, int id, int packet_size_in_bytes) {
+// Creates a packet that is known not to exist yet. Registration validates the
+// size first; auto-registration creates packets of unknown size. `now` is the
+// caller's clock reading, so a packet created by a batch is stamped with the
+// same time as the fragments that follow it.
+static PacketNode* system_create_packet(DefragmenterSystem* system, const FlowKey* flow, unsigned int hash,
+                                       int packet_size_in_bytes, uint64_t now) {
+    int id = (int)flow->id;
+    if (system->current_packet_count >= system->config.max_packets) {
+        DEFRAG_LOG(&system->logger, "ERROR: System is full (%d / %d). Cannot add new packet %d.",
+               system->current_packet_count, system->config.max_packets, id);
+        return NULL;
+    }
+
+    long bytes_before = system->pools.payload_bytes_in_use;
+    PacketNode* new_node = (PacketNode*)pools_alloc(&system->pools, POOL_PACKET);
+    if (new_node == NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not create list node. Out of memory.");
+        return NULL;
+    }
+    PacketAssembler* assembler = &new_node->assembler;
+    if (assembler_init(assembler, id, packet_size_in_bytes, &system->config, &system->pools, now) != 0) {
+        pools_free(&system->pools, POOL_PACKET, new_node);
+        return NULL;
+    }
+    assembler->logger = &system->logger;
+    new_node->flow = *flow;
+    new_node->flow_hash = hash;
+
+    if (packet_table_insert(&system->table, new_node) != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not grow packet table. Out of memory.");
+        assembler_release(assembler);
+        pools_free(&system->pools, POOL_PACKET, new_node);
+        return NULL;
+    }
+    system_list_append(system, new_node);
+    system->current_packet_count++;
+
+    new_node->buffered_bytes = system->pools.payload_bytes_in_use - bytes_before;
+    new_node->heap_index = -1;
+    new_node->fragments_received = 0;
+    new_node->created_timestamp = assembler->last_seen_timestamp;
+    new_node->created_monotonic_ns = system_real_now(system, now);
+    system->stats.current_buffered_bytes += new_node->buffered_bytes;
+    if (system_uses_eviction_heap(system)) eviction_heap_push(system, new_node);
+    if (system->config.byte_budget > 0) system_enforce_budget(system, new_node);
+    return new_node;
+}
 
+static int system_register(DefragmenterSystem* system, const FlowKey* flow, unsigned int hash, int packet_size_in_bytes) {
+    int id = (int)flow->id;
     if (packet_size_in_bytes <= 0) {
-        printf("ERROR: Packet size must be greater than 0.\n");
+        DEFRAG_LOG(&system->logger, "ERROR: Packet size must be greater than 0.");
         return -1;
     }
-    if (packet_size_in_bytes > MAX_PACKET_SIZE_BYTES) {
-        printf("ERROR: Packet size %d exceeds system limit of %d bytes.\n", 
+    // A stream is bounded by its receive window, not by the packet limit.
+    if (packet_size_in_bytes > MAX_PACKET_SIZE_BYTES && !system->config.streaming) {
+        DEFRAG_LOG(&system->logger, "ERROR: Packet size %d exceeds system limit of %d bytes.", 
                packet_size_in_bytes, MAX_PACKET_SIZE_BYTES);
         return -1;
     }
 
-    if (system_find_packet(system, id) != NULL) {
-        printf("ERROR: Packet %d is already being assembled.\n", id);
-        return -1;
-    }
-    if (system->current_packet_count >= MAX_PACKETS_IN_SYSTEM) {
-        printf("ERROR: System is full (%d / %d). Cannot add new packet %d.\n",
-               system->current_packet_count, MAX_PACKETS_IN_SYSTEM, id);
+    if (system_lookup_flow(system, flow, hash) != NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Packet %d is already being assembled.", id);
         return -1;
     }
+    if (system_create_packet(system, flow, hash, packet_size_in_bytes, system_clock_now(system)) == NULL) return -1;
+    
+    DEFRAG_LOG(&system->logger, "--- Packet %d registered. Total size: %d bytes. ---", id, packet_size_in_bytes);
+    return 0; 
+}
 
-    PacketAssembler* assembler = create_assembler(id, packet_size_in_bytes);
-    if (assembler == NULL) return -1;
+int system_register_packet(DefragmenterSystem* system, int id, int packet_size_in_bytes) {
+    FlowKey flow;
+    flow_key_init(&flow, 0, 0, 0, (uint32_t)id);
+    return system_register(system, &flow, packet_table_hash(id), packet_size_in_bytes);
+}
 
-    PacketNode* new_node = (PacketNode*)malloc(sizeof(PacketNode));
-    if (new_node == NULL) {
-        printf("ERROR: Could not create list node. Out of memory.\n");
-        free_assembler(assembler);
+// Registers a packet under its full flow key, so senders that reuse an IP ID
+// reassemble separately.
+int system_register_flow(DefragmenterSystem* system, const FlowKey* flow, int packet_size_in_bytes) {
+    return system_register(system, flow, flow_key_hash(flow), packet_size_in_bytes);
+}
+
+// Opens a stream whose length is only known once its last fragment arrives.
+int system_register_stream(DefragmenterSystem* system, int id) {
+    if (!system->config.streaming) {
+        DEFRAG_LOG(&system->logger, "ERROR: Streams need SystemConfig.streaming.");
         return -1;
     }
-    
-    new_node->assembler = assembler;
-    new_node->next = system->head;
-    system->head = new_node;
-    system->current_packet_count++;
-    
-    printf("--- Packet %d registered. Total size: %d bytes. ---\n", id, packet_size_in_bytes);
-    return 0; 
+    if (system_find_packet(system, id) != NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Packet %d is already being assembled.", id);
+        return -1;
+    }
+    FlowKey flow;
+    flow_key_init(&flow, 0, 0, 0, (uint32_t)id);
+    if (system_create_packet(system, &flow, packet_table_hash(id), PACKET_SIZE_UNKNOWN, system_clock_now(system)) == NULL) return -1;
+
+    DEFRAG_LOG(&system->logger, "--- Stream %d opened. ---", id);
+    return 0;
 }
 
 int system_add_fragment(DefragmenterSystem* system, int id, int offset, const char* data, bool is_last_fragment) {
-    system->stats.total_fragments_processed++;
-    
-    PacketAssembler* assembler = system_find_packet(system, id);
+    return system_add_fragment_ex(system, id, offset, (const uint8_t*)data, strlen(data),
+                                  is_last_fragment ? FRAGMENT_FLAG_LAST : 0);
+}
 
-    if (assembler == NULL) {
-        printf("Skipping fragment for packet %d (Packet not registered).\n", id);
-        system->stats.total_invalid_fragments++;
-        return -1;
+// Hands every run that now starts at the delivered offset to the stream
+// handler and releases it. The handler runs while the packet is still live,
+// so it must not add fragments to or remove packets from this system.
+static void system_deliver_stream(DefragmenterSystem* system, PacketAssembler* assembler) {
+    int length;
+    int stream_offset = assembler->delivered_offset;
+    char* data;
+    while ((data = assembler_pop_prefix(assembler, &length)) != NULL) {
+        system->stats.total_bytes_streamed += length;
+        if (system->on_stream != NULL) {
+            system->on_stream(system->on_stream_user, assembler->packet_id, stream_offset, data, length,
+                              assembler_is_complete(assembler));
+        }
+        pools_free_payload(&system->pools, data, length);
+        stream_offset = assembler->delivered_offset;
+    }
+}
+
+// Hands a complete packet to the gather handler as its held pieces. The
+// parts point into the packet, so the handler runs before it is released and
+// must not add fragments to or remove packets from this system.
+static void system_deliver_gather(DefragmenterSystem* system, PacketNode* node) {
+    PacketAssembler* assembler = &node->assembler;
+    if (assembler->fragment_count > system->gather_capacity) {
+        int capacity = system->gather_capacity == 0 ? SYSTEM_BATCH_CHUNK : system->gather_capacity;
+        while (capacity < assembler->fragment_count) capacity *= 2;
+        struct iovec* parts = (struct iovec*)realloc(system->gather_parts, capacity * sizeof(struct iovec));
+        if (parts == NULL) {
+            DEFRAG_LOG(&system->logger, "ERROR: Could not deliver packet %d. Out of memory.", assembler->packet_id);
+            return;
+        }
+        system->gather_parts = parts;
+        system->gather_capacity = capacity;
+    }
+    int count = assembler_gather(assembler, system->gather_parts, system->gather_capacity);
+    if (count >= 0) {
+        system->on_gather(system->on_gather_user, &node->flow, system->gather_parts, count, assembler->total_size_expected);
     }
+}
 
-    assembler->last_seen_timestamp = time(NULL);
-    int length = strlen(data); 
+static int system_apply_fragment(DefragmenterSystem* system, PacketNode* node, int offset,
+                                 const uint8_t* data, size_t len, unsigned int flags, uint64_t now, bool* completed) {
+    PacketAssembler* assembler = &node->assembler;
+    system_touch_packet(system, node, now);
+    int length = len > INT_MAX ? INT_MAX : (int)len; 
 
-    int result = assembler_add_fragment(assembler, offset, data, length, is_last_fragment);
+    // Every payload byte the assembler holds comes from the system's pools,
+    // so the pool counter's movement is this fragment's cost.
+    long bytes_before = system->pools.payload_bytes_in_use;
+    int fragments_before = assembler->fragment_count;
+    uint64_t started = system->config.metrics_timing ? defrag_monotonic_ns() : 0;
+    int result = assembler_add_fragment(assembler, offset, (const char*)data, length, (flags & FRAGMENT_FLAG_LAST) != 0);
+    if (assembler->streaming && result == FRAGMENT_ADDED) {
+        system_deliver_stream(system, assembler);
+    }
+    if (system->config.metrics_timing) {
+        histogram_record(&system->metrics.insert_latency_ns, defrag_monotonic_ns() - started);
+    }
+    long bytes_added = system->pools.payload_bytes_in_use - bytes_before;
+    node->buffered_bytes += bytes_added;
+    system->stats.current_buffered_bytes += bytes_added;
+    system->current_fragment_count += assembler->fragment_count - fragments_before;
+    node->fragments_received++;
 
     if (result == FRAGMENT_DUPLICATE) {
         system->stats.total_duplicates_discarded++;
@@ -267,30 +1797,248 @@ int system_add_fragment(DefragmenterSystem* system, int id, int offset, const ch
     else if (result == FRAGMENT_INVALID) {
         system->stats.total_invalid_fragments++;
     }
+    else if (result == FRAGMENT_ADDED) {
+        // An added fragment is one new interval; every merge removes one.
+        system->stats.total_fragments_added++;
+        histogram_record(&system->metrics.merges_per_insert,
+                         (uint64_t)(fragments_before + 1 - assembler->fragment_count));
+    }
 
-    if (assembler_is_complete(assembler)) {
-        printf("\n");
-        char* full_packet = assembler_get_assembled_data(assembler);
-        if (full_packet) {
-            printf("--- PACKET %d COMPLETE ---\n%s\n------------------------\n", 
-                   assembler->packet_id, full_packet);
-            free(full_packet);
+    *completed = false;
+    if (assembler_is_complete(assembler) && assembler->checksum && assembler_checksum(assembler) != 0xffff) {
+        DEFRAG_LOG(&system->logger, "--- PACKET %d FAILED CHECKSUM (sum 0x%04x) ---",
+               assembler->packet_id, assembler_checksum(assembler));
+        system->stats.total_checksum_failures++;
+        // A stream has already handed its bytes over; it still ends.
+        if (!assembler->streaming) {
+            system_unlink_packet(system, node);
+            return result;
         }
+    }
+    if (assembler_is_complete(assembler)) {
+        int packet_id = assembler->packet_id;
+        FlowKey flow = node->flow;
+        int packet_length = assembler->total_size_expected;
+        char* full_packet = system->on_gather == NULL ? assembler_get_assembled_data(assembler) : NULL;
         
         system->stats.packets_completed++;
-        system_remove_packet(system, id);
+        uint64_t real_now = system_real_now(system, now);
+        histogram_record(&system->metrics.completion_time_ns,
+                         real_now > node->created_monotonic_ns ? real_now - node->created_monotonic_ns : 0);
+        histogram_record(&system->metrics.fragments_per_packet, (uint64_t)node->fragments_received);
+        if (system->on_gather != NULL) {
+            system_deliver_gather(system, node);
+        }
+        system_unlink_packet(system, node);
+        *completed = true;
+
+        // The packet is gone from the table before the consumer runs, so the
+        // handler may register the same ID again.
+        if (full_packet) {
+            if (system->on_complete_flow != NULL) {
+                system->on_complete_flow(system->on_complete_flow_user, &flow, full_packet, packet_length);
+            } else if (system->on_complete != NULL) {
+                system->on_complete(system->on_complete_user, packet_id, full_packet, packet_length);
+            } else {
+                system_release_packet_data(system, full_packet, packet_length);
+            }
+        }
+    } else if (system->config.byte_budget > 0) {
+        eviction_heap_update(system, node);
+        system_enforce_budget(system, node);
+    }
+    return result;
+}
+
+static int system_add_keyed_fragment(DefragmenterSystem* system, const FlowKey* flow, unsigned int hash,
+                                     int offset, const uint8_t* data, size_t len, unsigned int flags) {
+    system->stats.total_fragments_processed++;
+    
+    uint64_t now = system_clock_now(system);
+    PacketNode* node = system_lookup_flow(system, flow, hash);
+    if (node == NULL && system->config.auto_register) {
+        node = system_create_packet(system, flow, hash, PACKET_SIZE_UNKNOWN, now);
+    }
+
+    if (node == NULL) {
+        DEFRAG_LOG(&system->logger, "Skipping fragment for packet %d (Packet not registered).", (int)flow->id);
+        system->stats.total_invalid_fragments++;
+        return -1;
     }
+
+    bool completed;
+    system_apply_fragment(system, node, offset, data, len, flags, now, &completed);
     return 0;
 }
 
-int system_get_fragment_count(DefragmenterSystem* system) {
-    int total = 0;
-    PacketNode* curr = system->head;
-    while (curr != NULL) {
-        total += curr->assembler->fragment_count; 
-        curr = curr->next;
+int system_add_fragment_ex(DefragmenterSystem* system, int id, int offset, const uint8_t* data, size_t len, unsigned int flags) {
+    FlowKey flow;
+    flow_key_init(&flow, 0, 0, 0, (uint32_t)id);
+    return system_add_keyed_fragment(system, &flow, packet_table_hash(id), offset, data, len, flags);
+}
+
+int system_add_flow_fragment(DefragmenterSystem* system, const FlowKey* flow, int offset, const uint8_t* data, size_t len, unsigned int flags) {
+    return system_add_keyed_fragment(system, flow, flow_key_hash(flow), offset, data, len, flags);
+}
+
+// A descriptor's key: its flow, or its packet ID widened into `scratch`.
+static const FlowKey* descriptor_flow(const FragmentDescriptor* fragment, FlowKey* scratch) {
+    if (fragment->flow != NULL) return fragment->flow;
+    flow_key_init(scratch, 0, 0, 0, (uint32_t)fragment->packet_id);
+    return scratch;
+}
+
+size_t system_add_fragments_batch(DefragmenterSystem* system, const FragmentDescriptor* fragments, size_t count,
+                                  int* results, int* completed_ids) {
+    PacketNode* resolved[SYSTEM_BATCH_CHUNK];
+    unsigned int hashes[SYSTEM_BATCH_CHUNK];
+    FlowKey keys[SYSTEM_BATCH_CHUNK];
+    const FlowKey* flows[SYSTEM_BATCH_CHUNK];
+    size_t completed_count = 0;
+    system_clock_tick(system);
+    uint64_t now = system_clock_now(system);
+
+    for (size_t base = 0; base < count; base += SYSTEM_BATCH_CHUNK) {
+        size_t n = count - base < SYSTEM_BATCH_CHUNK ? count - base : SYSTEM_BATCH_CHUNK;
+        const FragmentDescriptor* chunk = fragments + base;
+
+        // Resolve every packet of the chunk before touching any of them, so
+        // the table and assembler cache misses overlap instead of queueing.
+        for (size_t i = 0; i < n; i++) {
+            flows[i] = descriptor_flow(&chunk[i], &keys[i]);
+            hashes[i] = chunk[i].flow != NULL ? flow_key_hash(chunk[i].flow) : packet_table_hash(chunk[i].packet_id);
+        }
+        if (system->table.count > 0) {
+            unsigned int mask = (unsigned int)system->table.capacity - 1;
+            for (size_t i = 0; i < n; i++) {
+                DEFRAG_PREFETCH(&system->table.slots[hashes[i] & mask]);
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            resolved[i] = system_lookup_flow(system, flows[i], hashes[i]);
+            if (resolved[i] != NULL) DEFRAG_PREFETCH(resolved[i]);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            system->stats.total_fragments_processed++;
+            long evicted_before = system->stats.total_packets_evicted;
+            long failures_before = system->stats.total_checksum_failures;
+            PacketNode* node = resolved[i];
+            if (node == NULL && system->config.auto_register) {
+                // The packet's first fragment creates it; its later fragments
+                // in this chunk resolved to NULL and now pick it up.
+                node = system_create_packet(system, flows[i], hashes[i], PACKET_SIZE_UNKNOWN, now);
+                for (size_t j = i + 1; node != NULL && j < n; j++) {
+                    if (resolved[j] == NULL && hashes[j] == hashes[i] && flow_key_equal(flows[j], flows[i])) resolved[j] = node;
+                }
+            }
+            if (node == NULL) {
+                DEFRAG_LOG(&system->logger, "Skipping fragment for packet %d (Packet not registered).", (int)flows[i]->id);
+                system->stats.total_invalid_fragments++;
+                if (results != NULL) results[base + i] = FRAGMENT_NO_PACKET;
+                continue;
+            }
+
+            bool completed;
+            int result = system_apply_fragment(system, node, chunk[i].offset, chunk[i].data,
+                                               chunk[i].length, chunk[i].flags, now, &completed);
+            if (results != NULL) results[base + i] = result;
+            if (completed) {
+                if (completed_ids != NULL) completed_ids[completed_count] = (int)flows[i]->id;
+                completed_count++;
+                // Later fragments of the same packet now see it as gone,
+                // exactly as they would one call at a time.
+                for (size_t j = i + 1; j < n; j++) {
+                    if (resolved[j] == node) resolved[j] = NULL;
+                }
+            }
+            if (system->stats.total_packets_evicted != evicted_before ||
+                system->stats.total_checksum_failures != failures_before) {
+                // Evicted or rejected packets may still be referenced later in the chunk.
+                for (size_t j = i + 1; j < n; j++) {
+                    resolved[j] = system_lookup_flow(system, flows[j], hashes[j]);
+                }
+            }
+        }
     }
-    return total;
+    return completed_count;
+}
+
+void system_set_completion_handler(DefragmenterSystem* system, CompletionHandler handler, void* user) {
+    system->on_complete = handler;
+    system->on_complete_user = user;
+}
+
+// Replaces the completion handler for consumers that need the whole key.
+void system_set_flow_completion_handler(DefragmenterSystem* system, FlowCompletionHandler handler, void* user) {
+    system->on_complete_flow = handler;
+    system->on_complete_flow_user = user;
+}
+
+void system_set_stream_handler(DefragmenterSystem* system, StreamHandler handler, void* user) {
+    system->on_stream = handler;
+    system->on_stream_user = user;
+}
+
+// Replaces whole-packet delivery: completed packets are described in place
+// and never copied into one buffer.
+void system_set_gather_handler(DefragmenterSystem* system, GatherHandler handler, void* user) {
+    system->on_gather = handler;
+    system->on_gather_user = user;
+}
+
+void system_set_log_handler(DefragmenterSystem* system, LogHandler handler, void* user) {
+    system->logger.handler = handler;
+    system->logger.user = user;
+}
+
+// The caller's share of the checksum, typically the transport pseudo-header.
+int system_set_checksum_seed(DefragmenterSystem* system, int id, uint16_t seed) {
+    PacketNode* node = system_lookup(system, id);
+    if (node == NULL) return -1;
+    node->assembler.checksum_seed = seed;
+    return 0;
+}
+
+int system_set_flow_checksum_seed(DefragmenterSystem* system, const FlowKey* flow, uint16_t seed) {
+    PacketNode* node = system_lookup_flow(system, flow, flow_key_hash(flow));
+    if (node == NULL) return -1;
+    node->assembler.checksum_seed = seed;
+    return 0;
+}
+
+void system_release_packet_data(DefragmenterSystem* system, char* data, int length) {
+    pools_free_payload(&system->pools, data, length);
+}
+
+int system_get_fragment_count(DefragmenterSystem* system) {
+    return system->current_fragment_count;
+}
+
+void system_stats_accumulate(SystemStats* total, const SystemStats* part) {
+    total->total_fragments_processed += part->total_fragments_processed;
+    total->packets_completed += part->packets_completed;
+    total->total_duplicates_discarded += part->total_duplicates_discarded;
+    total->total_invalid_fragments += part->total_invalid_fragments;
+    total->total_packets_timed_out += part->total_packets_timed_out;
+    total->total_bytes_copied += part->total_bytes_copied;
+    total->total_bytes_trimmed += part->total_bytes_trimmed;
+    total->total_bytes_overwritten += part->total_bytes_overwritten;
+    total->total_packets_evicted += part->total_packets_evicted;
+    total->total_fragments_added += part->total_fragments_added;
+    total->total_bytes_streamed += part->total_bytes_streamed;
+    total->total_checksum_failures += part->total_checksum_failures;
+    total->current_buffered_bytes += part->current_buffered_bytes;
+}
+
+void system_metrics_snapshot(DefragmenterSystem* system, MetricsSnapshot* snapshot) {
+    snapshot->stats = system->stats;
+    snapshot->packets_in_flight = system->current_packet_count;
+    snapshot->fragments_in_flight = system->current_fragment_count;
+    snapshot->table_used = system->table.count;
+    snapshot->table_capacity = system->table.capacity;
+    snapshot->systems = 1;
+    snapshot->metrics = system->metrics;
 }
 
 int system_get_packet_count(DefragmenterSystem* system) {
@@ -300,16 +2048,74 @@ int system_get_packet_count(DefragmenterSystem* system) {
 void system_show_stats(DefragmenterSystem* system) {
     printf("\n--- SYSTEM STATISTICS ---\n");
     printf("Total Fragments Processed: %ld\n", system->stats.total_fragments_processed);
+    printf("Fragments Added: %ld\n", system->stats.total_fragments_added);
     printf("Packets Completed: %ld\n", system->stats.packets_completed);
     printf("Packets Timed Out: %ld\n", system->stats.total_packets_timed_out);
     printf("Fragments Discarded (Duplicate/Overlap): %ld\n", system->stats.total_duplicates_discarded);
     printf("Fragments Discarded (Invalid/Bounds): %ld\n", system->stats.total_invalid_fragments);
+    printf("Payload Bytes Copied: %ld\n", system->stats.total_bytes_copied);
+    if (system->config.streaming) {
+        printf("Stream Bytes Delivered: %ld\n", system->stats.total_bytes_streamed);
+    }
+    if (system->config.verify_checksum) {
+        printf("Packets Failing Checksum: %ld\n", system->stats.total_checksum_failures);
+    }
+    printf("Overlap Bytes Trimmed / Overwritten: %ld / %ld\n",
+           system->stats.total_bytes_trimmed, system->stats.total_bytes_overwritten);
+    printf("Packets Evicted: %ld\n", system->stats.total_packets_evicted);
+    if (system->config.byte_budget > 0) {
+        printf("Buffered Bytes (Current): %ld / %ld\n", system->stats.current_buffered_bytes, system->config.byte_budget);
+    } else {
+        printf("Buffered Bytes (Current): %ld\n", system->stats.current_buffered_bytes);
+    }
     printf("Packets in Reassembly (Current): %d / %d\n", 
-           system_get_packet_count(system), MAX_PACKETS_IN_SYSTEM);
+           system_get_packet_count(system), system->config.max_packets);
     printf("Fragments in Reassembly (Current): %d\n", system_get_fragment_count(system));
+    printf("Pool High-Water (Fragments / Packets): %ld / %ld\n",
+           system->pools.objects[POOL_FRAGMENT].high_water,
+           system->pools.objects[POOL_PACKET].high_water);
+    printf("Payload Pool High-Water: %ld bytes\n", system->pools.payload_bytes_high_water);
+    printf("Heap Allocations: %ld\n", system->pools.heap_allocations);
     printf("--------------------------\n");
 }
 
+// Walks the intervals a packet holds in offset order, whichever index keeps them.
+typedef struct {
+    const PacketAssembler* assembler;
+    const FragmentNode* node;
+    int index;
+} IntervalCursor;
+
+static void interval_cursor_init(IntervalCursor* cursor, const PacketAssembler* assembler) {
+    cursor->assembler = assembler;
+    cursor->node = assembler->fragment_list_head;
+    cursor->index = 0;
+}
+
+static bool interval_cursor_next(IntervalCursor* cursor, int* offset, int* length, const char** data) {
+    const PacketAssembler* assembler = cursor->assembler;
+    if (assembler->coverage == COVERAGE_BITMAP) {
+        if (!bitmap_next_run(assembler, &cursor->index, offset, length)) return false;
+        *data = assembler->buffer + *offset;
+        return true;
+    }
+    if (assembler->coverage == COVERAGE_ARRAY) {
+        if (cursor->index >= assembler->fragment_count) return false;
+        const FragmentSpan* span = &assembler->spans[cursor->index++];
+        *offset = span->offset;
+        *length = span->length;
+        *data = span->data != NULL ? span->data : assembler->buffer + span->offset;
+        return true;
+    }
+    const FragmentNode* node = cursor->node;
+    if (node == NULL) return false;
+    *offset = node->offset;
+    *length = node->length;
+    *data = node->data != NULL ? node->data : assembler->buffer + node->offset;
+    cursor->node = node->next;
+    return true;
+}
+
 void system_print_packet_status(DefragmenterSystem* system, int packet_id) {
     PacketAssembler* assembler = system_find_packet(system, packet_id);
 
@@ -322,22 +2128,32 @@ void system_print_packet_status(DefragmenterSystem* system, int packet_id) {
 
     printf("\n--- STATUS FOR PACKET %d ---\n", packet_id);
     printf("  State: In Progress\n");
-    printf("  Total Size: %d bytes\n", assembler->total_size_expected);
-    printf("  Received Bytes: %d / %d\n", assembler->total_received_bytes, assembler->total_size_expected);
+    if (assembler->total_size_expected == PACKET_SIZE_UNKNOWN) {
+        printf("  Total Size: Unknown (data seen up to %d bytes)\n", assembler->highest_byte_seen);
+        printf("  Received Bytes: %d / ?\n", assembler->total_received_bytes);
+    } else {
+        printf("  Total Size: %d bytes\n", assembler->total_size_expected);
+        printf("  Received Bytes: %d / %d\n", assembler->total_received_bytes, assembler->total_size_expected);
+    }
+    if (assembler->streaming) {
+        printf("  Delivered Bytes: %d (window %d)\n", assembler->delivered_offset, assembler->stream_window);
+    }
     printf("  Fragments Held: %d\n", assembler->fragment_count); 
     printf("  Last Fragment Flag (LFF): %s\n", assembler->last_fragment_seen ? "SEEN" : "*** MISSING ***");
-    printf("  Time remaining until timeout: %.0f seconds\n",
-           PACKET_TIMEOUT_SECONDS - difftime(time(NULL), assembler->last_seen_timestamp));
+    printf("  Time remaining until timeout: %.3f seconds\n",
+           (double)((int64_t)system->timeout_ns - (int64_t)(system_clock_now(system) - assembler->last_seen_timestamp)) / 1e9);
     
     printf("  Fragment List (Sorted by Offset):\n");
-    FragmentNode* frag = assembler->fragment_list_head;
-    if (frag == NULL) {
+    if (assembler->fragment_count == 0) {
         printf("    (None)\n");
     }
-    while (frag != NULL) {
-        printf("    Offset: %-5d | Length: %-5d | Data: \"%.20s\"\n", 
-               frag->offset, frag->length, frag->data);
-        frag = frag->next;
+    IntervalCursor cursor;
+    interval_cursor_init(&cursor, assembler);
+    int offset, length;
+    const char* data;
+    while (interval_cursor_next(&cursor, &offset, &length, &data)) {
+        printf("    Offset: %-5d | Length: %-5d | Data: \"%.*s\"\n", 
+               offset, length, length < 20 ? length : 20, data);
     }
     printf("-----------------------------\n");
 }
@@ -347,38 +2163,357 @@ void system_cleanup(DefragmenterSystem* system) {
     while (curr != NULL) {
         PacketNode* to_free = curr;
         curr = curr->next;
-        free_assembler(to_free->assembler);
-        free(to_free);
+        assembler_release(&to_free->assembler);
+        pools_free(&system->pools, POOL_PACKET, to_free);
     }
     system->head = NULL;
+    system->tail = NULL;
+    packet_table_free(&system->table);
+    free(system->eviction_heap);
+    system->eviction_heap = NULL;
+    system->eviction_heap_count = 0;
+    system->eviction_heap_capacity = 0;
+    free(system->gather_parts);
+    system->gather_parts = NULL;
+    system->gather_capacity = 0;
+    system->stats.current_buffered_bytes = 0;
+    pools_destroy(&system->pools);
     system->current_packet_count = 0;
+    system->current_fragment_count = 0;
 }
 
 void system_prune_timeouts(DefragmenterSystem* system) {
-    PacketNode* curr = system->head;
-    PacketNode* prev = NULL;
-    time_t now = time(NULL);
+    system_clock_tick(system);
+    uint64_t now = system_clock_now(system);
 
-    while (curr != NULL) {
-        double time_elapsed = difftime(now, curr->assembler->last_seen_timestamp);
-        if (time_elapsed > PACKET_TIMEOUT_SECONDS) {
-            printf("\n--- PACKET %d TIMED OUT (%.0f seconds) ---\n", 
-                   curr->assembler->packet_id, time_elapsed);
-            
-            system->stats.total_packets_timed_out++;
-            PacketNode* to_free = curr; 
+    // Oldest first: stop at the first packet that has not expired, so a pass
+    // costs only as much as the number of packets it removes.
+    while (system->head != NULL) {
+        PacketNode* oldest = system->head;
+        uint64_t idle = now - oldest->assembler.last_seen_timestamp;
+        if (oldest->assembler.last_seen_timestamp > now || idle <= system->timeout_ns) {
+            break;
+        }
+        DEFRAG_LOG(&system->logger, "--- PACKET %d TIMED OUT (%.3f seconds) ---",
+               oldest->assembler.packet_id, idle / 1e9);
+        
+        system->stats.total_packets_timed_out++;
+        system_unlink_packet(system, oldest);
+    }
+}
+#define SNAPSHOT_HASH_SEED UINT64_C(0xcbf29ce484222325)
+#define SNAPSHOT_HASH_PRIME UINT64_C(0x100000001b3)
 
-            if (prev == NULL) system->head = curr->next;
-            else prev->next = curr->next;
-            
-            curr = curr->next;
+static size_t snapshot_pad8(size_t bytes) {
+    return (bytes + 7) & ~(size_t)7;
+}
 
-            free_assembler(to_free->assembler);
-            free(to_free);
-            system->current_packet_count--;
-        } else {
-            prev = curr;
-            curr = curr->next;
+// FNV-1a over 64-bit words with a fold, so every bit reaches the whole hash.
+static uint64_t snapshot_hash(uint64_t hash, const void* data, size_t bytes) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i + 8 <= bytes; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, 8);
+        hash = (hash ^ word) * SNAPSHOT_HASH_PRIME;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+// The header is hashed last, with its checksum field read as zero.
+static uint64_t snapshot_hash_header(uint64_t hash, const SnapshotHeader* header) {
+    unsigned char bytes[sizeof(SnapshotHeader) + 8] = { 0 };
+    memcpy(bytes, header, sizeof(SnapshotHeader));
+    memset(bytes + offsetof(SnapshotHeader, checksum), 0, sizeof(header->checksum));
+    return snapshot_hash(hash, bytes, snapshot_pad8(sizeof(SnapshotHeader)));
+}
+
+typedef struct {
+    FILE* out;
+    uint64_t hash;
+    uint64_t written;
+} SnapshotWriter;
+
+// Writes `bytes` and zero padding up to the next 8-byte boundary, hashing both.
+static void snapshot_write(SnapshotWriter* writer, const void* data, size_t bytes) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    size_t whole = bytes & ~(size_t)7;
+    size_t padded = snapshot_pad8(bytes);
+    fwrite(data, 1, bytes, writer->out);
+    fwrite(zeros, 1, padded - bytes, writer->out);
+    writer->hash = snapshot_hash(writer->hash, data, whole);
+    if (padded != whole) {
+        unsigned char tail[8] = { 0 };
+        memcpy(tail, (const char*)data + whole, bytes - whole);
+        writer->hash = snapshot_hash(writer->hash, tail, 8);
+    }
+    writer->written += padded;
+}
+
+static void snapshot_write_zeros(SnapshotWriter* writer, size_t bytes) {
+    static const char zeros[SNAPSHOT_ALIGN];
+    while (bytes > 0) {
+        size_t chunk = bytes < sizeof(zeros) ? bytes : sizeof(zeros);
+        snapshot_write(writer, zeros, chunk);
+        bytes -= chunk;
+    }
+}
+
+// Packets are written oldest first, so restoring them in file order rebuilds
+// the timeout list as it was.
+int system_snapshot(DefragmenterSystem* system, const char* path) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not create snapshot %s.", path);
+        return -1;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_bytes = sizeof(SnapshotHeader);
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.flags = system->config.streaming ? SNAPSHOT_FLAG_STREAMING : 0;
+    header.packet_count = (uint64_t)system->current_packet_count;
+    header.records_offset = snapshot_pad8(sizeof(SnapshotHeader));
+    header.stats = system->stats;
+    fwrite(&header, 1, sizeof(header), out);
+    fwrite("\0\0\0\0\0\0\0", 1, header.records_offset - sizeof(header), out);
+
+    SnapshotWriter writer = { out, SNAPSHOT_HASH_SEED, header.records_offset };
+    uint64_t now = system_clock_now(system);
+    uint64_t payload_cursor = 0;
+    int offset, length;
+    const char* data;
+
+    for (PacketNode* node = system->head; node != NULL; node = node->next) {
+        const PacketAssembler* assembler = &node->assembler;
+        SnapshotPacket record;
+        memset(&record, 0, sizeof(record));
+        record.packet_id = assembler->packet_id;
+        record.total_size_expected = assembler->total_size_expected;
+        record.total_received_bytes = assembler->total_received_bytes;
+        record.highest_byte_seen = assembler->highest_byte_seen;
+        record.delivered_offset = assembler->delivered_offset;
+        record.interval_count = assembler->fragment_count;
+        record.fragments_received = node->fragments_received;
+        record.last_fragment_seen = assembler->last_fragment_seen;
+        record.checksum_seed = assembler->checksum_seed;
+        record.source = node->flow.source;
+        record.destination = node->flow.destination;
+        record.protocol = node->flow.protocol;
+        record.idle_ns = now > assembler->last_seen_timestamp ? now - assembler->last_seen_timestamp : 0;
+        record.age_ns = now > node->created_timestamp ? now - node->created_timestamp : 0;
+        record.bytes_copied = assembler->bytes_copied;
+        record.bytes_trimmed = assembler->bytes_trimmed;
+        record.bytes_overwritten = assembler->bytes_overwritten;
+        snapshot_write(&writer, &record, sizeof(record));
+
+        IntervalCursor cursor;
+        interval_cursor_init(&cursor, assembler);
+        while (interval_cursor_next(&cursor, &offset, &length, &data)) {
+            SnapshotInterval interval = { offset, length, payload_cursor };
+            snapshot_write(&writer, &interval, sizeof(interval));
+            payload_cursor += snapshot_pad8((size_t)length);
+        }
+    }
+
+    header.payload_offset = (writer.written + SNAPSHOT_ALIGN - 1) & ~(uint64_t)(SNAPSHOT_ALIGN - 1);
+    snapshot_write_zeros(&writer, header.payload_offset - writer.written);
+    for (PacketNode* node = system->head; node != NULL; node = node->next) {
+        IntervalCursor cursor;
+        interval_cursor_init(&cursor, &node->assembler);
+        while (interval_cursor_next(&cursor, &offset, &length, &data)) {
+            snapshot_write(&writer, data, (size_t)length);
+        }
+    }
+
+    header.file_bytes = writer.written;
+    header.checksum = snapshot_hash_header(writer.hash, &header);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, 1, sizeof(header), out);
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0) failed = true;
+    if (failed) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not write snapshot %s.", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Checks the whole file before anything is created, so a damaged snapshot
+// leaves the system untouched.
+static int snapshot_validate(const DefragmenterSystem* system, const char* map, size_t size) {
+    const SnapshotHeader* header = (const SnapshotHeader*)map;
+    if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Not a snapshot file.");
+        return -1;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->header_bytes != sizeof(SnapshotHeader) ||
+        header->byte_order != SNAPSHOT_BYTE_ORDER) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot version %u was written by an incompatible build.", header->version);
+        return -1;
+    }
+    if (header->file_bytes != size || header->records_offset != snapshot_pad8(sizeof(SnapshotHeader)) ||
+        header->payload_offset < header->records_offset || header->payload_offset > size ||
+        header->payload_offset % SNAPSHOT_ALIGN != 0 || size % 8 != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot is truncated or has a damaged header.");
+        return -1;
+    }
+    uint64_t hash = snapshot_hash(SNAPSHOT_HASH_SEED, map + header->records_offset, size - header->records_offset);
+    if (snapshot_hash_header(hash, header) != header->checksum) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot checksum mismatch.");
+        return -1;
+    }
+    if (((header->flags & SNAPSHOT_FLAG_STREAMING) != 0) != system->config.streaming) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot streaming mode does not match the system configuration.");
+        return -1;
+    }
+
+    uint64_t cursor = header->records_offset;
+    uint64_t payload_bytes = size - header->payload_offset;
+    for (uint64_t i = 0; i < header->packet_count; i++) {
+        if (header->payload_offset - cursor < sizeof(SnapshotPacket)) return -1;
+        const SnapshotPacket* record = (const SnapshotPacket*)(map + cursor);
+        cursor += sizeof(SnapshotPacket);
+        int limit = system->config.streaming ? INT_MAX : MAX_PACKET_SIZE_BYTES;
+        if (record->interval_count < 0 || record->total_size_expected < 0 || record->total_size_expected > limit ||
+            (header->payload_offset - cursor) / sizeof(SnapshotInterval) < (uint64_t)record->interval_count) {
+            return -1;
+        }
+        const SnapshotInterval* intervals = (const SnapshotInterval*)(map + cursor);
+        cursor += (uint64_t)record->interval_count * sizeof(SnapshotInterval);
+        for (int k = 0; k < record->interval_count; k++) {
+            if (intervals[k].offset < 0 || intervals[k].length <= 0 ||
+                intervals[k].payload_offset > payload_bytes ||
+                payload_bytes - intervals[k].payload_offset < (uint64_t)intervals[k].length) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int system_restore_packet(DefragmenterSystem* system, const SnapshotPacket* record,
+                                 const SnapshotInterval* intervals, const char* payload, uint64_t now) {
+    FlowKey flow;
+    flow_key_init(&flow, record->source, record->destination, record->protocol, (uint32_t)record->packet_id);
+    unsigned int hash = flow_key_hash(&flow);
+    if (system_lookup_flow(system, &flow, hash) != NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot holds packet %d twice.", record->packet_id);
+        return -1;
+    }
+    PacketNode* node = system_create_packet(system, &flow, hash, record->total_size_expected, now);
+    if (node == NULL) return -1;
+
+    // Intervals were accepted once already; the receive window they were
+    // checked against may have been larger than this system's.
+    PacketAssembler* assembler = &node->assembler;
+    long bytes_before = system->pools.payload_bytes_in_use;
+    int window = assembler->stream_window;
+    assembler->delivered_offset = record->delivered_offset;
+    assembler->stream_window = INT_MAX;
+    for (int k = 0; k < record->interval_count; k++) {
+        const SnapshotInterval* interval = &intervals[k];
+        if (assembler_add_fragment(assembler, interval->offset, payload + interval->payload_offset,
+                                   interval->length, false) != FRAGMENT_ADDED) {
+            DEFRAG_LOG(&system->logger, "ERROR: Snapshot packet %d holds an invalid interval.", record->packet_id);
+            node->buffered_bytes += system->pools.payload_bytes_in_use - bytes_before;
+            system->stats.current_buffered_bytes += system->pools.payload_bytes_in_use - bytes_before;
+            system->current_fragment_count += assembler->fragment_count;
+            assembler->bytes_copied = 0;
+            assembler->bytes_trimmed = 0;
+            assembler->bytes_overwritten = 0;
+            system_unlink_packet(system, node);
+            return -1;
+        }
+    }
+    assembler->stream_window = window;
+
+    assembler->last_fragment_seen = record->last_fragment_seen != 0;
+    assembler->checksum_seed = record->checksum_seed;
+    assembler->total_received_bytes = record->total_received_bytes;
+    assembler->highest_byte_seen = record->highest_byte_seen;
+    assembler->bytes_copied = record->bytes_copied;
+    assembler->bytes_trimmed = record->bytes_trimmed;
+    assembler->bytes_overwritten = record->bytes_overwritten;
+    assembler->last_seen_timestamp = now > record->idle_ns ? now - record->idle_ns : 0;
+    node->created_timestamp = now > record->age_ns ? now - record->age_ns : 0;
+    if (node->created_monotonic_ns > record->age_ns) node->created_monotonic_ns -= record->age_ns;
+    node->fragments_received = record->fragments_received;
+
+    long added = system->pools.payload_bytes_in_use - bytes_before;
+    node->buffered_bytes += added;
+    system->stats.current_buffered_bytes += added;
+    system->current_fragment_count += assembler->fragment_count;
+    eviction_heap_update(system, node);
+    if (system->config.byte_budget > 0) system_enforce_budget(system, node);
+    return 0;
+}
+
+// The file is mapped rather than read: payloads are copied once, straight
+// from the page cache into pool memory.
+int system_restore(DefragmenterSystem* system, const char* path) {
+    if (system->current_packet_count != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Restore needs a system with no packets in flight.");
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not open snapshot %s.", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot %s is too short.", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char* map = (const char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not map snapshot %s.", path);
+        return -1;
+    }
+
+    int result = snapshot_validate(system, map, size);
+    if (result != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Snapshot %s rejected.", path);
+        munmap((void*)map, size);
+        return -1;
+    }
+
+    const SnapshotHeader* header = (const SnapshotHeader*)map;
+    posix_madvise((void*)(map + header->payload_offset), size - header->payload_offset, POSIX_MADV_SEQUENTIAL);
+    SystemStats stats_before = system->stats;
+    system->stats = header->stats;
+    system->stats.current_buffered_bytes = 0;
+
+    uint64_t now = system_clock_now(system);
+    uint64_t cursor = header->records_offset;
+    const char* payload = map + header->payload_offset;
+    for (uint64_t i = 0; i < header->packet_count && result == 0; i++) {
+        const SnapshotPacket* record = (const SnapshotPacket*)(map + cursor);
+        const SnapshotInterval* intervals = (const SnapshotInterval*)(map + cursor + sizeof(SnapshotPacket));
+        cursor += sizeof(SnapshotPacket) + (uint64_t)record->interval_count * sizeof(SnapshotInterval);
+        result = system_restore_packet(system, record, intervals, payload, now);
+    }
+    munmap((void*)map, size);
+
+    if (result != 0) {
+        // All or nothing: drop what was restored before the failure.
+        while (system->head != NULL) {
+            system->head->assembler.bytes_copied = 0;
+            system->head->assembler.bytes_trimmed = 0;
+            system->head->assembler.bytes_overwritten = 0;
+            system_unlink_packet(system, system->head);
         }
+        system->stats = stats_before;
+        return -1;
     }
-}
\ No newline at end of file
+    DEFRAG_LOG(&system->logger, "--- Restored %d packets from %s. ---", system->current_packet_count, path);
+    return 0;
+}
@@ -5,20 +5,89 @@
 #include <stdlib.h>   
 #include <string.h>   
 #include <stdbool.h>  
+#include <stdint.h>
+#include <limits.h>
 #include <time.h>     
+#include <sys/uio.h>
+#include "pool.h"
+#include "metrics.h"
+#include "checksum.h"
 
 
 #define FRAGMENT_OK 0
 #define FRAGMENT_DUPLICATE 1
 #define FRAGMENT_INVALID 2
 #define FRAGMENT_ADDED 3
+#define FRAGMENT_NO_PACKET 4
+
+#define FRAGMENT_FLAG_LAST 0x1
+
+#define DEFRAG_LOG(logger, ...) \
+    do { \
+        if ((logger) != NULL && (logger)->handler != NULL) defrag_log((logger), __VA_ARGS__); \
+    } while (0)
 
 
 #define MAX_PACKET_SIZE_BYTES 65535
+#define PACKET_SIZE_UNKNOWN 0
 #define MAX_PACKETS_IN_SYSTEM 128     
 #define PACKET_TIMEOUT_SECONDS 60   
+#define PACKET_TABLE_MIN_CAPACITY 16
+#define EVICTION_HEAP_MIN_CAPACITY 16
+#define ASSEMBLER_MIN_BUFFER_BYTES 64
+#define SYSTEM_BATCH_CHUNK 64
+#define COVERAGE_BLOCK_BYTES 8
+#define ASSEMBLER_INLINE_SPANS 4
+
+
+// REASSEMBLY_GATHER keeps every fragment in its own node and never merges;
+// completion is tracked by counting the gaps left in the packet.
+typedef enum {
+    REASSEMBLY_MERGE,
+    REASSEMBLY_BUFFER,
+    REASSEMBLY_GATHER
+} ReassemblyMode;
+
+// COVERAGE_BITMAP is the state of a buffer-mode packet tracked by the block
+// bitmap (SystemConfig.bitmap_coverage). Configured as coverage_index, it is
+// treated as COVERAGE_LIST.
+typedef enum {
+    COVERAGE_LIST,
+    COVERAGE_TREE,
+    COVERAGE_BITMAP,
+    COVERAGE_ARRAY
+} CoverageIndex;
+
+// How bytes a new fragment shares with data already held are resolved. The
+// BSD and Linux policies decide per held interval, by where it starts
+// relative to the new fragment.
+typedef enum {
+    OVERLAP_REJECT,
+    OVERLAP_FIRST,
+    OVERLAP_LAST,
+    OVERLAP_BSD,
+    OVERLAP_LINUX
+} OverlapPolicy;
 
+// Where the engine's "now" comes from; every timeout, age and idle time runs
+// on it. Only CLOCK_SOURCE_MONOTONIC reads the clock per fragment. A coarse
+// clock is refreshed once per batch, per prune pass and by
+// system_clock_tick. An external clock only moves with system_clock_set,
+// e.g. to capture timestamps, so a replay times out exactly as it did live.
+// MONOTONIC is the default because the other two only advance when the
+// caller batches, prunes or ticks; the per-fragment saving needs an opt-in.
+typedef enum {
+    CLOCK_SOURCE_MONOTONIC,
+    CLOCK_SOURCE_COARSE,
+    CLOCK_SOURCE_EXTERNAL
+} ClockSource;
 
+// Which packet gives way when the byte budget is exceeded.
+typedef enum {
+    EVICT_OLDEST,
+    EVICT_LARGEST,
+    EVICT_LEAST_COMPLETE
+} EvictionPolicy;
 
 typedef struct {
     long total_fragments_processed;
@@ -26,48 +95,300 @@ typedef struct {
     long total_duplicates_discarded;
     long total_invalid_fragments;
     long total_packets_timed_out;
+    long total_bytes_copied;
+    long total_bytes_trimmed;
+    long total_bytes_overwritten;
+    long total_packets_evicted;
+    long total_fragments_added;
+    long total_bytes_streamed;
+    long total_checksum_failures;
+    long current_buffered_bytes;
 } SystemStats;
 
+// Identifies a packet by the IPv4 header fields its fragments share. A key
+// with no addresses and no protocol is the plain packet ID, so the int API
+// and the flow API name the same packet when they agree on `id`.
+typedef struct {
+    uint32_t source;
+    uint32_t destination;
+    uint32_t id;
+    uint8_t protocol;
+} FlowKey;
+
+typedef void (*LogHandler)(void* user, const char* message);
+typedef void (*CompletionHandler)(void* user, int packet_id, char* data, int length);
+typedef void (*FlowCompletionHandler)(void* user, const FlowKey* flow, char* data, int length);
+typedef void (*StreamHandler)(void* user, int packet_id, int stream_offset, const char* data, int length, bool end_of_stream);
+typedef void (*GatherHandler)(void* user, const FlowKey* flow, const struct iovec* parts, int part_count, int length);
+
+typedef struct {
+    LogHandler handler;
+    void* user;
+} DefragLogger;
+
 typedef struct FragmentNode {
     int offset;
     int length;
     char* data;
     struct FragmentNode* next;
+    struct FragmentNode* left;
+    struct FragmentNode* right;
+    unsigned int priority;
 } FragmentNode;
 
+// One held interval in COVERAGE_ARRAY. `data` is only set in REASSEMBLY_MERGE.
+typedef struct {
+    int offset;
+    int length;
+    char* data;
+} FragmentSpan;
+
+// Everything a fragment touches on the common path sits in the first 64
+// bytes; packets live in cache-line-aligned pool slots, so it is one line.
 typedef struct {
     int packet_id;
     int total_size_expected;  
     int total_received_bytes;
+    int highest_byte_seen;
+    int buffer_size;
     int fragment_count;     
     bool last_fragment_seen;
-    
+    bool checksum;
+    ReassemblyMode mode;
+    CoverageIndex coverage;
+    OverlapPolicy overlap_policy;
+    uint64_t last_seen_timestamp;
     FragmentNode* fragment_list_head;
-    
-    time_t last_seen_timestamp;
-    
+    char* buffer;
+
+    // COVERAGE_ARRAY keeps its intervals sorted in `spans`, which points at
+    // `inline_spans` until the packet needs more than ASSEMBLER_INLINE_SPANS.
+    FragmentSpan* spans;
+    int span_capacity;
+
+    // REASSEMBLY_GATHER: gaps between held intervals, counting the leading
+    // one and the trailing one up to the end (open while the size is unknown).
+    int holes;
+
+    // Streaming packets hand over their contiguous prefix as it forms;
+    // `delivered_offset` is the next byte the consumer expects.
+    bool streaming;
+    int delivered_offset;
+    int stream_window;
+    FragmentSpan inline_spans[ASSEMBLER_INLINE_SPANS];
+
+    FragmentNode* coverage_root;
+    unsigned int coverage_seed;
+    uint64_t* coverage_bitmap;
+    int bitmap_words;
+    CoverageIndex fallback_coverage;
+    long bytes_copied;
+    long bytes_trimmed;
+    long bytes_overwritten;
+
+    // Ones'-complement sum of the bytes held, in network order, kept while
+    // they are copied in; `checksum_seed` is the caller's pseudo-header sum.
+    uint64_t checksum_sum;
+    uint16_t checksum_seed;
+    MemoryPools* pools;
+    const DefragLogger* logger;
 } PacketAssembler;
 
+// `flow`, when set, identifies the packet instead of `packet_id`.
+typedef struct {
+    int packet_id;
+    int offset;
+    const uint8_t* data;
+    size_t length;
+    unsigned int flags;
+    const FlowKey* flow;
+} FragmentDescriptor;
+
+// The assembler is stored in the node, so a table hit reaches the packet's
+// state without a further pointer chase.
 typedef struct PacketNode {
-    PacketAssembler* assembler;
+    PacketAssembler assembler;
+    struct PacketNode* prev;
     struct PacketNode* next;
+    long buffered_bytes;
+    long eviction_key;
+    int heap_index;
+    int fragments_received;
+    uint64_t created_timestamp;
+    uint64_t created_monotonic_ns;
+    FlowKey flow;
+    unsigned int flow_hash;
 } PacketNode;
 
+// A slot keeps the packet's full hash next to its ID, so a probe rejects
+// other flows that reuse the ID without touching their nodes.
+typedef struct {
+    unsigned int hash;
+    int key;
+    PacketNode* node;
+} PacketSlot;
+
+typedef struct {
+    PacketSlot* slots;
+    int capacity;
+    int count;
+} PacketTable;
+
+typedef struct {
+    int max_packets;
+    ReassemblyMode reassembly_mode;
+    CoverageIndex coverage_index;
+    bool use_pools;
+    bool auto_register;
+    bool bitmap_coverage;
+    OverlapPolicy overlap_policy;
+    long byte_budget;
+    EvictionPolicy eviction_policy;
+    bool metrics_timing;
+    bool streaming;
+    int stream_window;
+    bool verify_checksum;
+    double packet_timeout_seconds;
+    ClockSource clock_source;
+} SystemConfig;
+
+typedef struct {
+    Histogram insert_latency_ns;
+    Histogram merges_per_insert;
+    Histogram completion_time_ns;
+    Histogram fragments_per_packet;
+} SystemMetrics;
+
+// A point-in-time copy of everything the engine counts. Snapshots of several
+// systems (or shards) merge into one.
+typedef struct {
+    SystemStats stats;
+    int packets_in_flight;
+    int fragments_in_flight;
+    int table_used;
+    int table_capacity;
+    int systems;
+    SystemMetrics metrics;
+} MetricsSnapshot;
+
 typedef struct {
     PacketNode* head;
+    PacketNode* tail;
+    PacketTable table;
     SystemStats stats;
     int current_packet_count;
+    int current_fragment_count;
+    SystemConfig config;
+    MemoryPools pools;
+    PacketNode** eviction_heap;
+    int eviction_heap_count;
+    int eviction_heap_capacity;
+    uint64_t timeout_ns;
+    uint64_t clock_ns;
+    CompletionHandler on_complete;
+    void* on_complete_user;
+    FlowCompletionHandler on_complete_flow;
+    void* on_complete_flow_user;
+    StreamHandler on_stream;
+    void* on_stream_user;
+    GatherHandler on_gather;
+    void* on_gather_user;
+    struct iovec* gather_parts;
+    int gather_capacity;
+    DefragLogger logger;
+    SystemMetrics metrics;
 } DefragmenterSystem;
 
+// Snapshot file layout, all in host byte order:
+//   SnapshotHeader
+//   per packet, in last-seen order: SnapshotPacket, then its SnapshotIntervals
+//   payload region, starting on a SNAPSHOT_ALIGN boundary
+// Every record and every interval's payload is padded to 8 bytes. The
+// checksum covers the whole file, with the header's checksum field as zero.
+// Times are stored as ages, because monotonic clocks do not survive a restart.
+#define SNAPSHOT_MAGIC "DFRGSNAP"
+#define SNAPSHOT_VERSION 4
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_ALIGN 64
+#define SNAPSHOT_FLAG_STREAMING 0x1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_bytes;
+    uint32_t byte_order;
+    uint32_t flags;
+    uint64_t packet_count;
+    uint64_t file_bytes;
+    uint64_t records_offset;
+    uint64_t payload_offset;
+    uint64_t checksum;
+    SystemStats stats;
+} SnapshotHeader;
+
+typedef struct {
+    int32_t packet_id;
+    int32_t total_size_expected;
+    int32_t total_received_bytes;
+    int32_t highest_byte_seen;
+    int32_t delivered_offset;
+    int32_t interval_count;
+    int32_t fragments_received;
+    uint8_t last_fragment_seen;
+    uint8_t protocol;
+    uint16_t checksum_seed;
+    uint32_t source;
+    uint32_t destination;
+    uint64_t idle_ns;
+    uint64_t age_ns;
+    int64_t bytes_copied;
+    int64_t bytes_trimmed;
+    int64_t bytes_overwritten;
+} SnapshotPacket;
+
+typedef struct {
+    int32_t offset;
+    int32_t length;
+    uint64_t payload_offset;
+} SnapshotInterval;
+
 PacketAssembler* create_assembler(int packet_id, int total_size);
+PacketAssembler* create_assembler_with_config(int packet_id, int total_size, const SystemConfig* config, MemoryPools* pools);
 void free_assembler(PacketAssembler* assembler);
+uint64_t defrag_monotonic_ns(void);
 int assembler_add_fragment(PacketAssembler* assembler, int offset, const char* data, int length, bool is_last_fragment);
 bool assembler_is_complete(PacketAssembler* assembler);
 char* assembler_get_assembled_data(PacketAssembler* assembler);
+void assembler_free_assembled_data(PacketAssembler* assembler, char* data);
+char* assembler_pop_prefix(PacketAssembler* assembler, int* length);
+uint16_t assembler_checksum(const PacketAssembler* assembler);
+int assembler_gather(PacketAssembler* assembler, struct iovec* parts, int max_parts);
+
+void defrag_log(const DefragLogger* logger, const char* format, ...);
 
+void flow_key_init(FlowKey* key, uint32_t source, uint32_t destination, uint8_t protocol, uint32_t id);
+unsigned int flow_key_hash(const FlowKey* key);
+
+void system_config_init(SystemConfig* config);
 void system_init(DefragmenterSystem* system);
+void system_init_with_config(DefragmenterSystem* system, const SystemConfig* config);
 int system_register_packet(DefragmenterSystem* system, int id, int packet_size_in_bytes);
+int system_register_stream(DefragmenterSystem* system, int id);
 int system_add_fragment(DefragmenterSystem* system, int id, int offset, const char* data, bool is_last_fragment);
+int system_add_fragment_ex(DefragmenterSystem* system, int id, int offset, const uint8_t* data, size_t len, unsigned int flags);
+int system_register_flow(DefragmenterSystem* system, const FlowKey* flow, int packet_size_in_bytes);
+int system_add_flow_fragment(DefragmenterSystem* system, const FlowKey* flow, int offset, const uint8_t* data, size_t len, unsigned int flags);
+size_t system_add_fragments_batch(DefragmenterSystem* system, const FragmentDescriptor* fragments, size_t count,
+                                  int* results, int* completed_ids);
+
+void system_set_completion_handler(DefragmenterSystem* system, CompletionHandler handler, void* user);
+void system_set_flow_completion_handler(DefragmenterSystem* system, FlowCompletionHandler handler, void* user);
+void system_set_stream_handler(DefragmenterSystem* system, StreamHandler handler, void* user);
+void system_set_gather_handler(DefragmenterSystem* system, GatherHandler handler, void* user);
+void system_set_log_handler(DefragmenterSystem* system, LogHandler handler, void* user);
+int system_set_checksum_seed(DefragmenterSystem* system, int id, uint16_t seed);
+int system_set_flow_checksum_seed(DefragmenterSystem* system, const FlowKey* flow, uint16_t seed);
+void system_release_packet_data(DefragmenterSystem* system, char* data, int length);
 
 void system_show_stats(DefragmenterSystem* system);
 int system_get_fragment_count(DefragmenterSystem* system);
@@ -75,5 +396,16 @@ int system_get_packet_count(DefragmenterSystem* system);
 void system_print_packet_status(DefragmenterSystem* system, int packet_id);
 void system_cleanup(DefragmenterSystem* system);
 void system_prune_timeouts(DefragmenterSystem* system);
+uint64_t system_clock_now(DefragmenterSystem* system);
+void system_clock_tick(DefragmenterSystem* system);
+void system_clock_set(DefragmenterSystem* system, uint64_t now_ns);
+int system_snapshot(DefragmenterSystem* system, const char* path);
+int system_restore(DefragmenterSystem* system, const char* path);
+
+void system_stats_accumulate(SystemStats* total, const SystemStats* part);
+void system_metrics_snapshot(DefragmenterSystem* system, MetricsSnapshot* snapshot);
+void metrics_snapshot_merge(MetricsSnapshot* into, const MetricsSnapshot* from);
+void metrics_write_json(const MetricsSnapshot* snapshot, FILE* out);
+void metrics_write_prometheus(const MetricsSnapshot* snapshot, FILE* out);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,558 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "ingest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+
+// Records are parsed where they were read. A record that straddles two
+// buffers is finished in `carry`, the only payload the frontend copies.
+typedef struct {
+    DefragmenterSystem* system;
+    IngestStats* stats;
+    size_t magic_seen;
+    uint8_t* carry;
+    size_t carry_bytes;
+    size_t carry_need;
+    long stream_offset;
+    FragmentDescriptor batch[INGEST_BATCH];
+    FlowKey keys[INGEST_BATCH];
+    int batch_count;
+} IngestParser;
+
+void ingest_config_init(IngestConfig* config) {
+    config->backend = INGEST_AUTO;
+    config->buffer_count = INGEST_DEFAULT_BUFFERS;
+    config->buffer_bytes = INGEST_DEFAULT_BUFFER_BYTES;
+}
+
+const char* ingest_backend_name(IngestBackend backend) {
+    switch (backend) {
+        case INGEST_URING: return "io_uring";
+        case INGEST_READ: return "read";
+        default: return "auto";
+    }
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+size_t ingest_record_bytes(int length) {
+    return INGEST_HEADER_BYTES + (((size_t)length + INGEST_RECORD_ALIGN - 1) & ~(size_t)(INGEST_RECORD_ALIGN - 1));
+}
+
+void ingest_write_header(uint8_t* header, const FlowKey* flow, int offset, int length, bool is_last_fragment) {
+    write_le32(header, flow->source);
+    write_le32(header + 4, flow->destination);
+    write_le32(header + 8, flow->id);
+    header[12] = flow->protocol;
+    header[13] = is_last_fragment ? 1 : 0;
+    header[14] = (uint8_t)length;
+    header[15] = (uint8_t)(length >> 8);
+    write_le32(header + 16, (uint32_t)offset);
+    write_le32(header + 20, 0);
+}
+
+// Returns the whole record's size, or -1 for bytes that cannot be a header.
+int ingest_parse_header(const uint8_t* header, FlowKey* flow, int* offset, int* length, unsigned int* flags) {
+    uint32_t record_offset = read_le32(header + 16);
+    if ((header[13] & ~1u) != 0 || read_le32(header + 20) != 0 || record_offset > INT_MAX) return -1;
+
+    flow_key_init(flow, read_le32(header), read_le32(header + 4), header[12], read_le32(header + 8));
+    *offset = (int)record_offset;
+    *length = header[14] | header[15] << 8;
+    *flags = (header[13] & 1) ? FRAGMENT_FLAG_LAST : 0;
+    return (int)ingest_record_bytes(*length);
+}
+
+static void ingest_flush(IngestParser* parser) {
+    if (parser->batch_count == 0) return;
+    system_add_fragments_batch(parser->system, parser->batch, (size_t)parser->batch_count, NULL, NULL);
+    parser->stats->batches++;
+    parser->batch_count = 0;
+}
+
+// Parses the record at `record` into the next batch slot; it is only queued
+// if the whole record is present. Returns the record's size or -1.
+static int ingest_queue(IngestParser* parser, const uint8_t* record, size_t available) {
+    int i = parser->batch_count;
+    int offset, length;
+    unsigned int flags;
+    int bytes = ingest_parse_header(record, &parser->keys[i], &offset, &length, &flags);
+    if (bytes < 0) {
+        DEFRAG_LOG(&parser->system->logger, "ERROR: Corrupt fragment record at byte %ld.", parser->stream_offset);
+        return -1;
+    }
+    if ((size_t)bytes > available) return bytes;
+
+    FragmentDescriptor* fragment = &parser->batch[i];
+    fragment->packet_id = (int)parser->keys[i].id;
+    fragment->offset = offset;
+    fragment->data = record + INGEST_HEADER_BYTES;
+    fragment->length = (size_t)length;
+    fragment->flags = flags;
+    fragment->flow = &parser->keys[i];
+    parser->stats->records++;
+    parser->stream_offset += bytes;
+    if (++parser->batch_count == INGEST_BATCH) ingest_flush(parser);
+    return bytes;
+}
+
+// Everything queued from `data` is applied before this returns, so the
+// caller may reuse the buffer at once: the engine copies payloads in.
+static int ingest_consume(IngestParser* parser, const uint8_t* data, size_t bytes) {
+    size_t pos = 0;
+    while (parser->magic_seen < INGEST_MAGIC_BYTES && pos < bytes) {
+        if (data[pos++] != (uint8_t)INGEST_MAGIC[parser->magic_seen++]) {
+            DEFRAG_LOG(&parser->system->logger, "ERROR: Input is not a fragment record stream.");
+            return -1;
+        }
+        parser->stream_offset++;
+    }
+
+    while (parser->carry_bytes > 0 && pos < bytes) {
+        size_t need = parser->carry_bytes < INGEST_HEADER_BYTES ? INGEST_HEADER_BYTES : parser->carry_need;
+        size_t take = need - parser->carry_bytes < bytes - pos ? need - parser->carry_bytes : bytes - pos;
+        memcpy(parser->carry + parser->carry_bytes, data + pos, take);
+        parser->carry_bytes += take;
+        pos += take;
+        if (parser->carry_bytes < need) break;
+
+        int record = ingest_queue(parser, parser->carry, parser->carry_bytes);
+        if (record < 0) return -1;
+        if ((size_t)record == parser->carry_bytes) {
+            parser->stats->copied_records++;
+            parser->carry_bytes = 0;
+        } else {
+            parser->carry_need = (size_t)record;
+        }
+    }
+
+    while (parser->carry_bytes == 0 && bytes - pos >= INGEST_HEADER_BYTES) {
+        int record = ingest_queue(parser, data + pos, bytes - pos);
+        if (record < 0) return -1;
+        if ((size_t)record > bytes - pos) {
+            parser->carry_need = (size_t)record;
+            break;
+        }
+        parser->stats->zero_copy_records++;
+        pos += (size_t)record;
+    }
+    ingest_flush(parser);
+
+    if (parser->carry_bytes == 0 && pos < bytes) {
+        memcpy(parser->carry, data + pos, bytes - pos);
+        parser->carry_bytes = bytes - pos;
+    }
+    return 0;
+}
+
+static int ingest_finish(IngestParser* parser) {
+    if (parser->magic_seen < INGEST_MAGIC_BYTES || parser->carry_bytes > 0) {
+        DEFRAG_LOG(&parser->system->logger, "ERROR: Fragment record stream ends inside a record (byte %ld).",
+                   parser->stream_offset);
+        return -1;
+    }
+    return 0;
+}
+
+static int ingest_read_loop(IngestParser* parser, int fd, const IngestConfig* config) {
+    uint8_t* buffer = (uint8_t*)malloc(config->buffer_bytes);
+    if (buffer == NULL) {
+        DEFRAG_LOG(&parser->system->logger, "ERROR: Could not allocate the read buffer. Out of memory.");
+        return -1;
+    }
+    int result = 0;
+    while (result == 0) {
+        ssize_t got = read(fd, buffer, config->buffer_bytes);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) {
+            DEFRAG_LOG(&parser->system->logger, "ERROR: Read failed: %s.", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (got == 0) break;
+        parser->stats->reads++;
+        parser->stats->bytes_read += got;
+        result = ingest_consume(parser, buffer, (size_t)got);
+    }
+    free(buffer);
+    return result == 0 ? ingest_finish(parser) : -1;
+}
+
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+// The three io_uring mappings, driven through the raw system calls so the
+// frontend needs no liburing.
+typedef struct {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_map;
+    size_t sq_map_bytes;
+    void* cq_map;
+    size_t cq_map_bytes;
+    size_t sqes_bytes;
+    unsigned pending;
+} IngestRing;
+
+// One read buffer; buffer `seq % buffer_count` holds stream chunk `seq`.
+typedef struct {
+    uint8_t* data;
+    size_t filled;
+    size_t expected;
+    bool done;
+} IngestSlot;
+
+typedef struct {
+    IngestRing ring;
+    IngestSlot* slots;
+    int count;
+    int fd;
+    bool fixed;
+    bool seekable;
+    size_t buffer_bytes;
+    uint64_t file_bytes;
+    uint64_t chunks;
+    unsigned depth;
+    uint64_t next_submit;
+    uint64_t next_consume;
+    unsigned inflight;
+    bool eof;
+} IngestWindow;
+
+static void ingest_ring_free(IngestRing* ring) {
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_bytes);
+    if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_bytes);
+    if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_bytes);
+    if (ring->fd >= 0) close(ring->fd);
+}
+
+static int ingest_ring_setup(IngestRing* ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -1;
+
+    ring->sq_map_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_map && ring->cq_map_bytes > ring->sq_map_bytes) ring->sq_map_bytes = ring->cq_map_bytes;
+
+    ring->sq_map = mmap(NULL, ring->sq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        ingest_ring_free(ring);
+        return -1;
+    }
+    ring->cq_map = single_map ? ring->sq_map
+                              : mmap(NULL, ring->cq_map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = ring->cq_map == MAP_FAILED ? MAP_FAILED
+                                            : mmap(NULL, ring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cq_map == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring->cq_map == MAP_FAILED) ring->cq_map = NULL;
+        ingest_ring_free(ring);
+        return -1;
+    }
+    ring->sqes = (struct io_uring_sqe*)sqes;
+
+    char* sq = (char*)ring->sq_map;
+    char* cq = (char*)ring->cq_map;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+// The caller never has more reads in flight than the ring has entries, so
+// there is always room for one more.
+static void ingest_ring_read(IngestRing* ring, int fd, bool fixed, int buffer_index, void* data, size_t length,
+                             uint64_t offset, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)length;
+    sqe->buf_index = (uint16_t)(fixed ? buffer_index : 0);
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+static int ingest_ring_enter(IngestRing* ring, unsigned wait) {
+    while (ring->pending > 0 || wait > 0) {
+        int submitted = (int)syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait,
+                                     wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->pending -= (unsigned)submitted;
+        if (ring->pending == 0) return 0;
+        wait = 0;
+    }
+    return 0;
+}
+
+static bool ingest_ring_reap(IngestRing* ring, struct io_uring_cqe* cqe) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Reads the rest of chunk `seq` into its buffer.
+static void ingest_window_issue(IngestWindow* window, uint64_t seq) {
+    int index = (int)(seq % (uint64_t)window->count);
+    IngestSlot* slot = &window->slots[index];
+    uint64_t offset = window->seekable ? seq * window->buffer_bytes + slot->filled : 0;
+    ingest_ring_read(&window->ring, window->fd, window->fixed, index, slot->data + slot->filled,
+                     slot->expected - slot->filled, offset, seq);
+    window->inflight++;
+}
+
+// Starts reads into every free buffer the depth allows. The buffer being
+// consumed is never free, so it is safe to call before parsing it.
+static void ingest_window_fill(IngestWindow* window) {
+    while (!window->eof && window->inflight < window->depth && window->next_submit < window->chunks &&
+           window->next_submit < window->next_consume + (uint64_t)window->count) {
+        IngestSlot* slot = &window->slots[window->next_submit % (uint64_t)window->count];
+        uint64_t offset = window->next_submit * window->buffer_bytes;
+        slot->filled = 0;
+        slot->done = false;
+        slot->expected = window->buffer_bytes;
+        if (window->seekable && window->file_bytes - offset < window->buffer_bytes) {
+            slot->expected = (size_t)(window->file_bytes - offset);
+        }
+        ingest_window_issue(window, window->next_submit++);
+    }
+}
+
+static int ingest_window_reap(IngestWindow* window, IngestParser* parser) {
+    struct io_uring_cqe cqe;
+    while (ingest_ring_reap(&window->ring, &cqe)) {
+        uint64_t seq = cqe.user_data;
+        IngestSlot* slot = &window->slots[seq % (uint64_t)window->count];
+        window->inflight--;
+        if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+            ingest_window_issue(window, seq);
+            continue;
+        }
+        if (cqe.res < 0) {
+            DEFRAG_LOG(&parser->system->logger, "ERROR: Read failed: %s.", strerror(-cqe.res));
+            return -1;
+        }
+        if (cqe.res == 0) {
+            slot->done = true;
+            window->eof = true;
+            continue;
+        }
+        parser->stats->reads++;
+        parser->stats->bytes_read += cqe.res;
+        slot->filled += (size_t)cqe.res;
+        // A file read that comes back short is continued in place; a stream
+        // hands over whatever it had.
+        if (!window->seekable || slot->filled == slot->expected) slot->done = true;
+        else ingest_window_issue(window, seq);
+    }
+    return 0;
+}
+
+// Reads are issued into a window of buffers and consumed strictly in stream
+// order, so reassembly of one buffer overlaps the reads of the next. Regular
+// files keep every free buffer in flight at its own offset; a socket or pipe
+// has one read in flight, issued before the previous buffer is parsed.
+static int ingest_uring_loop(IngestParser* parser, int fd, const IngestConfig* config) {
+    DefragmenterSystem* system = parser->system;
+    IngestWindow window;
+    memset(&window, 0, sizeof(window));
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Cannot stat the input: %s.", strerror(errno));
+        return -1;
+    }
+    window.fd = fd;
+    window.count = config->buffer_count;
+    window.buffer_bytes = config->buffer_bytes;
+    window.seekable = S_ISREG(st.st_mode);
+    window.file_bytes = (uint64_t)st.st_size;
+    window.chunks = window.seekable ? (window.file_bytes + window.buffer_bytes - 1) / window.buffer_bytes : UINT64_MAX;
+    window.depth = window.seekable ? (unsigned)window.count : 1;
+
+    if (ingest_ring_setup(&window.ring, (unsigned)window.count) != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: io_uring is unavailable: %s.", strerror(errno));
+        return -1;
+    }
+    void* memory = NULL;
+    window.slots = (IngestSlot*)calloc((size_t)window.count, sizeof(IngestSlot));
+    struct iovec* iov = (struct iovec*)calloc((size_t)window.count, sizeof(struct iovec));
+    if (window.slots == NULL || iov == NULL || posix_memalign(&memory, 4096, window.buffer_bytes * (size_t)window.count) != 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not allocate the ingest buffers. Out of memory.");
+        free(window.slots);
+        free(iov);
+        ingest_ring_free(&window.ring);
+        return -1;
+    }
+    for (int i = 0; i < window.count; i++) {
+        window.slots[i].data = (uint8_t*)memory + window.buffer_bytes * (size_t)i;
+        iov[i].iov_base = window.slots[i].data;
+        iov[i].iov_len = window.buffer_bytes;
+    }
+    // Registered buffers are pinned once, so no read has to map its pages.
+    // Without them (e.g. a low RLIMIT_MEMLOCK) plain reads still work.
+    window.fixed = syscall(__NR_io_uring_register, window.ring.fd, IORING_REGISTER_BUFFERS, iov, (unsigned)window.count) == 0;
+    parser->stats->registered_buffers = window.fixed;
+
+    int result = 0;
+    while (result == 0) {
+        ingest_window_fill(&window);
+        if (window.next_consume == window.next_submit) break;
+
+        IngestSlot* head = &window.slots[window.next_consume % (uint64_t)window.count];
+        if (ingest_ring_enter(&window.ring, head->done ? 0 : 1) != 0) {
+            DEFRAG_LOG(&system->logger, "ERROR: io_uring_enter failed: %s.", strerror(errno));
+            result = -1;
+            break;
+        }
+        result = ingest_window_reap(&window, parser);
+        if (result != 0 || !head->done) continue;
+
+        // Refill first, so the next reads are under way while this buffer
+        // is reassembled; its slot is only released afterwards.
+        ingest_window_fill(&window);
+        if (ingest_ring_enter(&window.ring, 0) != 0) {
+            DEFRAG_LOG(&system->logger, "ERROR: io_uring_enter failed: %s.", strerror(errno));
+            result = -1;
+            break;
+        }
+        result = ingest_consume(parser, head->data, head->filled);
+        window.next_consume++;
+    }
+
+    // Reads still in flight target these buffers; wait them out first.
+    struct io_uring_cqe cqe;
+    while (window.inflight > 0 && ingest_ring_enter(&window.ring, 1) == 0) {
+        while (ingest_ring_reap(&window.ring, &cqe)) window.inflight--;
+    }
+    ingest_ring_free(&window.ring);
+    free(memory);
+    free(window.slots);
+    free(iov);
+    return result == 0 ? ingest_finish(parser) : -1;
+}
+
+// A ring can be set up on kernels that predate IORING_OP_READ (5.6), where
+// every read would complete with -EINVAL, so the opcode is probed as well.
+// The probe arrived in the same release; a kernel that rejects it has no
+// IORING_OP_READ either.
+static bool ingest_uring_available(void) {
+    IngestRing ring;
+    if (ingest_ring_setup(&ring, 1) != 0) return false;
+    size_t probe_bytes = sizeof(struct io_uring_probe) + (IORING_OP_READ + 1) * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probe_bytes);
+    bool supported = false;
+    if (probe != NULL &&
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, (unsigned)(IORING_OP_READ + 1)) == 0) {
+        supported = probe->last_op >= IORING_OP_READ && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+    free(probe);
+    ingest_ring_free(&ring);
+    return supported;
+}
+
+#else
+
+static int ingest_uring_loop(IngestParser* parser, int fd, const IngestConfig* config) {
+    (void)fd;
+    (void)config;
+    DEFRAG_LOG(&parser->system->logger, "ERROR: io_uring is not supported on this platform.");
+    return -1;
+}
+
+static bool ingest_uring_available(void) {
+    return false;
+}
+
+#endif
+
+// Feeds every fragment record readable from `fd` into the system, in
+// batches. INGEST_AUTO uses io_uring where the kernel allows it and falls
+// back to read().
+int ingest_fd(DefragmenterSystem* system, int fd, const IngestConfig* config, IngestStats* stats) {
+    memset(stats, 0, sizeof(IngestStats));
+    if (config->buffer_count < 2 || config->buffer_bytes < INGEST_HEADER_BYTES) {
+        DEFRAG_LOG(&system->logger, "ERROR: Ingestion needs at least 2 buffers of %d bytes.", INGEST_HEADER_BYTES);
+        return -1;
+    }
+
+    IngestParser* parser = (IngestParser*)malloc(sizeof(IngestParser));
+    uint8_t* carry = (uint8_t*)malloc(INGEST_MAX_RECORD_BYTES);
+    if (parser == NULL || carry == NULL) {
+        DEFRAG_LOG(&system->logger, "ERROR: Could not allocate the ingest parser. Out of memory.");
+        free(parser);
+        free(carry);
+        return -1;
+    }
+    memset(parser, 0, sizeof(IngestParser));
+    parser->system = system;
+    parser->stats = stats;
+    parser->carry = carry;
+
+    IngestBackend backend = config->backend;
+    if (backend == INGEST_AUTO) backend = ingest_uring_available() ? INGEST_URING : INGEST_READ;
+    stats->backend = backend;
+    int result = backend == INGEST_URING ? ingest_uring_loop(parser, fd, config) : ingest_read_loop(parser, fd, config);
+
+    free(carry);
+    free(parser);
+    return result;
+}
+
+int ingest_file(DefragmenterSystem* system, const char* path, const IngestConfig* config, IngestStats* stats) {
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) {
+        DEFRAG_LOG(&system->logger, "ERROR: Cannot open %s: %s.", path, strerror(errno));
+        memset(stats, 0, sizeof(IngestStats));
+        return -1;
+    }
+    int result = ingest_fd(system, fd, config, stats);
+    if (fd != STDIN_FILENO) close(fd);
+    return result;
+}
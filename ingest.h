@@ -0,0 +1,53 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "defrag.h"
+
+
+// A fragment record stream starts with INGEST_MAGIC. Each fragment is then a
+// 24-byte little-endian header (source, destination, id, protocol, flags,
+// length, offset, 4 reserved zero bytes) followed by `length` payload bytes,
+// padded to INGEST_RECORD_ALIGN. Flag bit 0 marks the last fragment.
+#define INGEST_MAGIC "DFRGING1"
+#define INGEST_MAGIC_BYTES 8
+#define INGEST_HEADER_BYTES 24
+#define INGEST_RECORD_ALIGN 8
+#define INGEST_MAX_RECORD_BYTES (INGEST_HEADER_BYTES + MAX_PACKET_SIZE_BYTES + INGEST_RECORD_ALIGN)
+#define INGEST_BATCH 256
+#define INGEST_DEFAULT_BUFFERS 8
+#define INGEST_DEFAULT_BUFFER_BYTES (256 * 1024)
+
+typedef enum {
+    INGEST_AUTO,
+    INGEST_URING,
+    INGEST_READ
+} IngestBackend;
+
+typedef struct {
+    IngestBackend backend;
+    int buffer_count;
+    size_t buffer_bytes;
+} IngestConfig;
+
+typedef struct {
+    IngestBackend backend;
+    bool registered_buffers;
+    long reads;
+    long bytes_read;
+    long records;
+    long zero_copy_records;
+    long copied_records;
+    long batches;
+} IngestStats;
+
+void ingest_config_init(IngestConfig* config);
+const char* ingest_backend_name(IngestBackend backend);
+
+size_t ingest_record_bytes(int length);
+void ingest_write_header(uint8_t* header, const FlowKey* flow, int offset, int length, bool is_last_fragment);
+int ingest_parse_header(const uint8_t* header, FlowKey* flow, int* offset, int* length, unsigned int* flags);
+
+int ingest_fd(DefragmenterSystem* system, int fd, const IngestConfig* config, IngestStats* stats);
+int ingest_file(DefragmenterSystem* system, const char* path, const IngestConfig* config, IngestStats* stats);
+
+#endif
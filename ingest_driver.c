@@ -0,0 +1,456 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#include "ingest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define INGEST_FRAGMENT_BYTES 1480
+#define INGEST_WINDOW 64
+#define INGEST_PATTERN_SPREAD 4096
+#define INGEST_SEND_CHUNK (64 * 1024)
+
+
+typedef struct {
+    DefragmenterSystem* system;
+    long completed;
+    long corrupt;
+} IngestCheck;
+
+static uint8_t fill_pattern[MAX_PACKET_SIZE_BYTES + INGEST_PATTERN_SPREAD];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_random(unsigned int* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void fill_pattern_init(void) {
+    unsigned int seed = 0x5eed;
+    for (size_t i = 0; i < sizeof(fill_pattern); i++) fill_pattern[i] = (uint8_t)next_random(&seed);
+}
+
+static const uint8_t* packet_payload(uint32_t packet) {
+    return fill_pattern + packet % INGEST_PATTERN_SPREAD;
+}
+
+// Packet p travels as flow (10.x.y.z with p's high bits, 10.0.0.1, UDP, p's
+// low 16 bits), so IP IDs repeat across senders as they do on a real link.
+static void packet_flow(FlowKey* flow, uint32_t packet) {
+    flow_key_init(flow, 0x0a000000u | (packet >> 16), 0x0a000001u, 17, packet & 0xffff);
+}
+
+static void check_completed_packet(void* user, const FlowKey* flow, char* data, int length) {
+    IngestCheck* check = (IngestCheck*)user;
+    uint32_t packet = (flow->source & 0xffffffu) << 16 | flow->id;
+    check->completed++;
+    if (memcmp(data, packet_payload(packet), (size_t)length) != 0) check->corrupt++;
+    system_release_packet_data(check->system, data, length);
+}
+
+static void print_log_message(void* user, const char* message) {
+    (void)user;
+    fprintf(stderr, "%s\n", message);
+}
+
+static void ingest_system_init(DefragmenterSystem* system, const SystemConfig* config, IngestCheck* check) {
+    system_init_with_config(system, config);
+    system_set_flow_completion_handler(system, check_completed_packet, check);
+    system_set_log_handler(system, print_log_message, NULL);
+    check->system = system;
+    check->completed = 0;
+    check->corrupt = 0;
+}
+
+static int write_all(int fd, const void* data, size_t bytes) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (bytes > 0) {
+        ssize_t written = write(fd, p, bytes);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return -1;
+        p += written;
+        bytes -= (size_t)written;
+    }
+    return 0;
+}
+
+static ssize_t read_all(int fd, void* data, size_t bytes) {
+    uint8_t* p = (uint8_t*)data;
+    size_t got = 0;
+    while (got < bytes) {
+        ssize_t n = read(fd, p + got, bytes - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += (size_t)n;
+    }
+    return (ssize_t)got;
+}
+
+// Packets of 64..9000 bytes in IP-sized fragments; the fragments of
+// INGEST_WINDOW packets at a time are shuffled together.
+static int run_generate(const char* path, int packets, unsigned int seed) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        printf("ERROR: Cannot create %s.\n", path);
+        return 1;
+    }
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+    fwrite(INGEST_MAGIC, 1, INGEST_MAGIC_BYTES, out);
+
+    enum { MAX_WINDOW_FRAGMENTS = INGEST_WINDOW * (9000 / INGEST_FRAGMENT_BYTES + 1) };
+    uint32_t plan_packet[MAX_WINDOW_FRAGMENTS];
+    int plan_offset[MAX_WINDOW_FRAGMENTS];
+    int plan_length[MAX_WINDOW_FRAGMENTS];
+    bool plan_last[MAX_WINDOW_FRAGMENTS];
+    static const uint8_t padding[INGEST_RECORD_ALIGN];
+    long fragments = 0;
+    seed = seed != 0 ? seed : 1;
+
+    for (int base = 0; base < packets; base += INGEST_WINDOW) {
+        int count = 0;
+        for (int p = base; p < packets && p < base + INGEST_WINDOW; p++) {
+            int size = 64 + (int)(next_random(&seed) % (9000 - 64 + 1));
+            for (int offset = 0; offset < size; offset += INGEST_FRAGMENT_BYTES) {
+                plan_packet[count] = (uint32_t)p;
+                plan_offset[count] = offset;
+                plan_length[count] = size - offset < INGEST_FRAGMENT_BYTES ? size - offset : INGEST_FRAGMENT_BYTES;
+                plan_last[count] = offset + INGEST_FRAGMENT_BYTES >= size;
+                count++;
+            }
+        }
+        for (int i = count - 1; i > 0; i--) {
+            int j = (int)(next_random(&seed) % (unsigned int)(i + 1));
+            uint32_t packet = plan_packet[i]; plan_packet[i] = plan_packet[j]; plan_packet[j] = packet;
+            int offset = plan_offset[i]; plan_offset[i] = plan_offset[j]; plan_offset[j] = offset;
+            int length = plan_length[i]; plan_length[i] = plan_length[j]; plan_length[j] = length;
+            bool last = plan_last[i]; plan_last[i] = plan_last[j]; plan_last[j] = last;
+        }
+        for (int i = 0; i < count; i++) {
+            FlowKey flow;
+            uint8_t header[INGEST_HEADER_BYTES];
+            packet_flow(&flow, plan_packet[i]);
+            ingest_write_header(header, &flow, plan_offset[i], plan_length[i], plan_last[i]);
+            fwrite(header, 1, sizeof(header), out);
+            fwrite(packet_payload(plan_packet[i]) + plan_offset[i], 1, (size_t)plan_length[i], out);
+            fwrite(padding, 1, ingest_record_bytes(plan_length[i]) - INGEST_HEADER_BYTES - (size_t)plan_length[i], out);
+        }
+        fragments += count;
+    }
+    bool failed = ferror(out) != 0;
+    if (fclose(out) != 0 || failed) {
+        printf("ERROR: Could not write %s.\n", path);
+        return 1;
+    }
+    printf("Wrote %d packets in %ld fragments to %s.\n", packets, fragments, path);
+    return 0;
+}
+
+// What callers did before the frontend: one read() for each header and one
+// for each payload, and one system_add_flow_fragment per fragment.
+static int plain_ingest(DefragmenterSystem* system, int fd, long* records) {
+    static uint8_t record[INGEST_MAX_RECORD_BYTES];
+    uint8_t magic[INGEST_MAGIC_BYTES];
+    if (read_all(fd, magic, sizeof(magic)) != (ssize_t)sizeof(magic) || memcmp(magic, INGEST_MAGIC, sizeof(magic)) != 0) {
+        printf("ERROR: Input is not a fragment record stream.\n");
+        return -1;
+    }
+    *records = 0;
+    ssize_t got;
+    while ((got = read_all(fd, record, INGEST_HEADER_BYTES)) == INGEST_HEADER_BYTES) {
+        FlowKey flow;
+        int offset, length;
+        unsigned int flags;
+        int bytes = ingest_parse_header(record, &flow, &offset, &length, &flags);
+        if (bytes < 0 || read_all(fd, record + INGEST_HEADER_BYTES, (size_t)bytes - INGEST_HEADER_BYTES) != bytes - INGEST_HEADER_BYTES) {
+            printf("ERROR: Corrupt or truncated fragment record.\n");
+            return -1;
+        }
+        system_add_flow_fragment(system, &flow, offset, record + INGEST_HEADER_BYTES, (size_t)length, flags);
+        (*records)++;
+    }
+    return got == 0 ? 0 : -1;
+}
+
+static void print_ingest_report(const char* name, const IngestStats* stats, const DefragmenterSystem* system,
+                                const IngestCheck* check, double elapsed) {
+    printf("--- INGEST %s ---\n", name);
+    printf("Backend: %s%s\n", ingest_backend_name(stats->backend),
+           stats->backend == INGEST_URING ? (stats->registered_buffers ? " (registered buffers)" : " (unregistered buffers)") : "");
+    printf("Bytes Read: %ld in %ld reads\n", stats->bytes_read, stats->reads);
+    printf("Fragments: %ld (%ld in place, %ld copied across buffers) in %ld batches\n",
+           stats->records, stats->zero_copy_records, stats->copied_records, stats->batches);
+    printf("Throughput: %.1f MB/s, %.0f fragments/sec\n", elapsed > 0 ? stats->bytes_read / elapsed / 1e6 : 0.0,
+           elapsed > 0 ? stats->records / elapsed : 0.0);
+    printf("Packets Completed: %ld (%ld corrupt)\n", check->completed, check->corrupt);
+    printf("Packets Still In Reassembly: %d\n", system->current_packet_count);
+}
+
+static int accept_unix_socket(const char* path) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (listener < 0 || strlen(path) >= sizeof(address.sun_path)) {
+        printf("ERROR: Cannot listen on %s.\n", path);
+        if (listener >= 0) close(listener);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0) {
+        printf("ERROR: Cannot listen on %s: %s.\n", path, strerror(errno));
+        close(listener);
+        return -1;
+    }
+    int fd = accept(listener, NULL, NULL);
+    close(listener);
+    unlink(path);
+    return fd;
+}
+
+static int run_ingest(const char* source, bool listen_socket, const IngestConfig* ingest_config, const SystemConfig* config) {
+    DefragmenterSystem system;
+    IngestCheck check;
+    IngestStats stats;
+    ingest_system_init(&system, config, &check);
+
+    int fd = listen_socket ? accept_unix_socket(source) : strcmp(source, "-") == 0 ? STDIN_FILENO : open(source, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR: Cannot open %s.\n", source);
+        system_cleanup(&system);
+        return 1;
+    }
+    double start = now_seconds();
+    int result = ingest_fd(&system, fd, ingest_config, &stats);
+    double elapsed = now_seconds() - start;
+    if (fd != STDIN_FILENO) close(fd);
+
+    print_ingest_report(source, &stats, &system, &check, elapsed);
+    system_cleanup(&system);
+    return result == 0 && check.corrupt == 0 ? 0 : 1;
+}
+
+static int send_fd(int fd, int to) {
+    static uint8_t chunk[INGEST_SEND_CHUNK];
+    ssize_t got;
+    while ((got = read(fd, chunk, sizeof(chunk))) > 0 || (got < 0 && errno == EINTR)) {
+        if (got > 0 && write_all(to, chunk, (size_t)got) != 0) return -1;
+    }
+    return got == 0 ? 0 : -1;
+}
+
+static int run_send(const char* path, const char* socket_path) {
+    int fd = open(path, O_RDONLY);
+    int to = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+    if (fd < 0 || to < 0 || connect(to, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        printf("ERROR: Cannot send %s to %s.\n", path, socket_path);
+        if (fd >= 0) close(fd);
+        if (to >= 0) close(to);
+        return 1;
+    }
+    int result = send_fd(fd, to);
+    close(fd);
+    close(to);
+    return result == 0 ? 0 : 1;
+}
+
+typedef enum {
+    BENCH_PLAIN,
+    BENCH_READ,
+    BENCH_URING
+} BenchIngest;
+
+typedef enum {
+    SOURCE_FILE,
+    SOURCE_COLD_FILE,
+    SOURCE_SOCKET
+} BenchSource;
+
+// A cold file has its pages dropped from the page cache first, so reads go
+// to the device. The socket variant streams the file through an AF_UNIX
+// socket pair from a child process, so reads wait on a live producer.
+static int bench_one(const char* path, BenchIngest how, BenchSource source, const IngestConfig* ingest_config,
+                     const SystemConfig* config, long expected) {
+    static const char* names[] = { "read()+add_fragment", "frontend, read()", "frontend, io_uring" };
+    static const char* source_names[] = { "file", "cold", "socket" };
+    DefragmenterSystem system;
+    IngestCheck check;
+    IngestStats stats;
+    memset(&stats, 0, sizeof(stats));
+    ingest_system_init(&system, config, &check);
+
+    int fd = open(path, O_RDONLY);
+    pid_t child = -1;
+    if (fd >= 0 && source == SOURCE_COLD_FILE) {
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (fd >= 0 && source == SOURCE_SOCKET) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+            close(fd);
+            fd = -1;
+        } else {
+            fflush(stdout);
+            child = fork();
+            if (child == 0) {
+                close(pair[0]);
+                _exit(send_fd(fd, pair[1]) == 0 ? 0 : 1);
+            }
+            close(pair[1]);
+            close(fd);
+            fd = pair[0];
+        }
+    }
+    if (fd < 0) {
+        printf("ERROR: Cannot open %s.\n", path);
+        system_cleanup(&system);
+        return 1;
+    }
+
+    IngestConfig backend_config = *ingest_config;
+    backend_config.backend = how == BENCH_URING ? INGEST_URING : INGEST_READ;
+    double start = now_seconds();
+    int result = how == BENCH_PLAIN ? plain_ingest(&system, fd, &stats.records)
+                                    : ingest_fd(&system, fd, &backend_config, &stats);
+    double elapsed = now_seconds() - start;
+    close(fd);
+    if (child > 0) waitpid(child, NULL, 0);
+
+    struct stat st;
+    double megabytes = stat(path, &st) == 0 ? st.st_size / 1e6 : 0.0;
+    printf("%-8s %-22s %10.1f %14.0f %10ld %8ld\n", source_names[source], names[how],
+           megabytes / elapsed, stats.records / elapsed, check.completed, check.corrupt);
+    bool ok = result == 0 && check.completed == expected && check.corrupt == 0;
+    system_cleanup(&system);
+    return ok ? 0 : 1;
+}
+
+static long count_packets(const char* path) {
+    DefragmenterSystem system;
+    SystemConfig config;
+    IngestConfig ingest_config;
+    IngestCheck check;
+    IngestStats stats;
+    system_config_init(&config);
+    config.max_packets = 1 << 20;
+    config.auto_register = true;
+    ingest_config_init(&ingest_config);
+    ingest_config.backend = INGEST_READ;
+    ingest_system_init(&system, &config, &check);
+    int result = ingest_file(&system, path, &ingest_config, &stats);
+    system_cleanup(&system);
+    return result == 0 ? check.completed : -1;
+}
+
+static int run_bench(const char* path, const IngestConfig* ingest_config, const SystemConfig* config) {
+    long expected = count_packets(path);
+    if (expected < 0) return 1;
+    printf("%-8s %-22s %10s %14s %10s %8s\n", "source", "ingest", "MB/s", "frags/sec", "completed", "corrupt");
+    int failures = 0;
+    for (int source = SOURCE_FILE; source <= SOURCE_SOCKET; source++) {
+        for (int how = BENCH_PLAIN; how <= BENCH_URING; how++) {
+            failures += bench_one(path, (BenchIngest)how, (BenchSource)source, ingest_config, config, expected);
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+
+static void print_usage(void) {
+    printf("Usage:\n");
+    printf("  ingest_driver generate FILE [--packets N] [--seed N]\n");
+    printf("  ingest_driver run FILE|- [--listen] [--read | --uring] [--buffers N] [--buffer-bytes N] [--buffer] [--array]\n");
+    printf("  ingest_driver send FILE SOCKET\n");
+    printf("  ingest_driver bench FILE [--buffers N] [--buffer-bytes N] [--buffer] [--array]\n");
+    printf("With --listen, FILE is an AF_UNIX socket path; one sender is accepted.\n");
+}
+
+// Options shared by `run` and `bench`; returns false for anything else.
+static bool parse_option(int argc, char** argv, int* i, IngestConfig* ingest_config, SystemConfig* config) {
+    if (strcmp(argv[*i], "--read") == 0) ingest_config->backend = INGEST_READ;
+    else if (strcmp(argv[*i], "--uring") == 0) ingest_config->backend = INGEST_URING;
+    else if (strcmp(argv[*i], "--buffers") == 0 && *i + 1 < argc) ingest_config->buffer_count = atoi(argv[++*i]);
+    else if (strcmp(argv[*i], "--buffer-bytes") == 0 && *i + 1 < argc) ingest_config->buffer_bytes = (size_t)atol(argv[++*i]);
+    else if (strcmp(argv[*i], "--buffer") == 0) config->reassembly_mode = REASSEMBLY_BUFFER;
+    else if (strcmp(argv[*i], "--array") == 0) config->coverage_index = COVERAGE_ARRAY;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fill_pattern_init();
+
+    SystemConfig config;
+    system_config_init(&config);
+    config.max_packets = 1 << 20;
+    config.auto_register = true;
+    IngestConfig ingest_config;
+    ingest_config_init(&ingest_config);
+
+    if (strcmp(argv[1], "generate") == 0) {
+        int packets = 100000;
+        unsigned int seed = 42;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) packets = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_generate(argv[2], packets, seed);
+    }
+
+    if (strcmp(argv[1], "run") == 0) {
+        bool listen_socket = false;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--listen") == 0) listen_socket = true;
+            else if (!parse_option(argc, argv, &i, &ingest_config, &config)) {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_ingest(argv[2], listen_socket, &ingest_config, &config);
+    }
+
+    if (strcmp(argv[1], "send") == 0 && argc == 4) {
+        return run_send(argv[2], argv[3]);
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        for (int i = 3; i < argc; i++) {
+            if (!parse_option(argc, argv, &i, &ingest_config, &config)) {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_bench(argv[2], &ingest_config, &config);
+    }
+
+    print_usage();
+    return 1;
+}
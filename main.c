@@ -6,9 +6,27 @@ void clear_input_buffer() {
     while ((c = getchar()) != '\n' && c != EOF);
 }
 
+void print_log_message(void* user, const char* message) {
+    (void)user;
+    // Packet banners (evicted, timed out, failed checksum) get a blank line
+    // before them, like the completion banner.
+    if (strncmp(message, "--- PACKET", 10) == 0) printf("\n");
+    printf("%s\n", message);
+}
+
+void print_completed_packet(void* user, int packet_id, char* data, int length) {
+    DefragmenterSystem* system = (DefragmenterSystem*)user;
+    printf("\n--- PACKET %d COMPLETE ---\n", packet_id);
+    fwrite(data, 1, length, stdout);
+    printf("\n------------------------\n");
+    system_release_packet_data(system, data, length);
+}
+
 int main() {
     DefragmenterSystem system;
     system_init(&system);
+    system_set_log_handler(&system, print_log_message, NULL);
+    system_set_completion_handler(&system, print_completed_packet, &system);
     
     setvbuf(stdout, NULL, _IONBF, 0);
     
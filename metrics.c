@@ -0,0 +1,186 @@
+#include <stddef.h>
+#include "defrag.h"
+
+static int histogram_bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+// Largest value that lands in the bucket.
+uint64_t histogram_bucket_upper(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = (uint64_t)(bucket % HISTOGRAM_SUB_BUCKETS);
+    uint64_t lower = (HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return lower + (((uint64_t)1 << shift) - 1);
+}
+
+void histogram_init(Histogram* histogram) {
+    memset(histogram, 0, sizeof(Histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(Histogram* histogram, uint64_t value) {
+    histogram->counts[histogram_bucket_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value < histogram->min) histogram->min = value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+void histogram_merge(Histogram* into, const Histogram* from) {
+    if (from->count == 0) {
+        return;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->min < into->min) into->min = from->min;
+    if (from->max > into->max) into->max = from->max;
+}
+
+// Reports the upper edge of the bucket holding the quantile, so the answer
+// never understates a latency; it is clamped to the largest value seen.
+uint64_t histogram_quantile(const Histogram* histogram, double quantile) {
+    if (histogram->count == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * (double)histogram->count);
+    if (rank >= histogram->count) {
+        rank = histogram->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen > rank) {
+            uint64_t upper = histogram_bucket_upper(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void metrics_snapshot_merge(MetricsSnapshot* into, const MetricsSnapshot* from) {
+    system_stats_accumulate(&into->stats, &from->stats);
+    into->packets_in_flight += from->packets_in_flight;
+    into->fragments_in_flight += from->fragments_in_flight;
+    into->table_used += from->table_used;
+    into->table_capacity += from->table_capacity;
+    into->systems += from->systems;
+    histogram_merge(&into->metrics.insert_latency_ns, &from->metrics.insert_latency_ns);
+    histogram_merge(&into->metrics.merges_per_insert, &from->metrics.merges_per_insert);
+    histogram_merge(&into->metrics.completion_time_ns, &from->metrics.completion_time_ns);
+    histogram_merge(&into->metrics.fragments_per_packet, &from->metrics.fragments_per_packet);
+}
+
+// One table drives both exporters so a new counter only needs adding here.
+typedef struct {
+    const char* name;
+    size_t offset;
+} CounterField;
+
+static const CounterField counter_fields[] = {
+    { "fragments_processed", offsetof(SystemStats, total_fragments_processed) },
+    { "fragments_added", offsetof(SystemStats, total_fragments_added) },
+    { "packets_completed", offsetof(SystemStats, packets_completed) },
+    { "duplicates_discarded", offsetof(SystemStats, total_duplicates_discarded) },
+    { "invalid_fragments", offsetof(SystemStats, total_invalid_fragments) },
+    { "packets_timed_out", offsetof(SystemStats, total_packets_timed_out) },
+    { "packets_evicted", offsetof(SystemStats, total_packets_evicted) },
+    { "bytes_copied", offsetof(SystemStats, total_bytes_copied) },
+    { "bytes_trimmed", offsetof(SystemStats, total_bytes_trimmed) },
+    { "bytes_overwritten", offsetof(SystemStats, total_bytes_overwritten) },
+    { "bytes_streamed", offsetof(SystemStats, total_bytes_streamed) },
+    { "checksum_failures", offsetof(SystemStats, total_checksum_failures) },
+};
+
+typedef struct {
+    const char* name;
+    size_t offset;
+} HistogramField;
+
+static const HistogramField histogram_fields[] = {
+    { "insert_latency_ns", offsetof(SystemMetrics, insert_latency_ns) },
+    { "merges_per_insert", offsetof(SystemMetrics, merges_per_insert) },
+    { "completion_time_ns", offsetof(SystemMetrics, completion_time_ns) },
+    { "fragments_per_packet", offsetof(SystemMetrics, fragments_per_packet) },
+};
+
+#define FIELD_COUNT(table) ((int)(sizeof(table) / sizeof((table)[0])))
+
+static long snapshot_counter(const MetricsSnapshot* snapshot, int index) {
+    return *(const long*)((const char*)&snapshot->stats + counter_fields[index].offset);
+}
+
+static const Histogram* snapshot_histogram(const MetricsSnapshot* snapshot, int index) {
+    return (const Histogram*)((const char*)&snapshot->metrics + histogram_fields[index].offset);
+}
+
+static double snapshot_table_load(const MetricsSnapshot* snapshot) {
+    return snapshot->table_capacity > 0 ? (double)snapshot->table_used / snapshot->table_capacity : 0.0;
+}
+
+void metrics_write_json(const MetricsSnapshot* snapshot, FILE* out) {
+    fprintf(out, "{\n  \"counters\": {");
+    for (int i = 0; i < FIELD_COUNT(counter_fields); i++) {
+        fprintf(out, "%s\n    \"%s\": %ld", i ? "," : "", counter_fields[i].name, snapshot_counter(snapshot, i));
+    }
+    fprintf(out, "\n  },\n  \"gauges\": {\n");
+    fprintf(out, "    \"packets_in_flight\": %d,\n", snapshot->packets_in_flight);
+    fprintf(out, "    \"fragments_in_flight\": %d,\n", snapshot->fragments_in_flight);
+    fprintf(out, "    \"buffered_bytes\": %ld,\n", snapshot->stats.current_buffered_bytes);
+    fprintf(out, "    \"table_load\": %.4f,\n", snapshot_table_load(snapshot));
+    fprintf(out, "    \"systems\": %d\n  },\n  \"histograms\": {", snapshot->systems);
+    for (int i = 0; i < FIELD_COUNT(histogram_fields); i++) {
+        const Histogram* h = snapshot_histogram(snapshot, i);
+        fprintf(out, "%s\n    \"%s\": { \"count\": %llu, \"sum\": %llu, \"min\": %llu, \"max\": %llu, "
+                "\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu }",
+                i ? "," : "", histogram_fields[i].name,
+                (unsigned long long)h->count, (unsigned long long)h->sum,
+                (unsigned long long)(h->count ? h->min : 0), (unsigned long long)h->max,
+                (unsigned long long)histogram_quantile(h, 0.50), (unsigned long long)histogram_quantile(h, 0.90),
+                (unsigned long long)histogram_quantile(h, 0.99), (unsigned long long)histogram_quantile(h, 0.999));
+    }
+    fprintf(out, "\n  }\n}\n");
+}
+
+void metrics_write_prometheus(const MetricsSnapshot* snapshot, FILE* out) {
+    for (int i = 0; i < FIELD_COUNT(counter_fields); i++) {
+        fprintf(out, "# TYPE defrag_%s_total counter\n", counter_fields[i].name);
+        fprintf(out, "defrag_%s_total %ld\n", counter_fields[i].name, snapshot_counter(snapshot, i));
+    }
+
+    fprintf(out, "# TYPE defrag_packets_in_flight gauge\ndefrag_packets_in_flight %d\n", snapshot->packets_in_flight);
+    fprintf(out, "# TYPE defrag_fragments_in_flight gauge\ndefrag_fragments_in_flight %d\n", snapshot->fragments_in_flight);
+    fprintf(out, "# TYPE defrag_buffered_bytes gauge\ndefrag_buffered_bytes %ld\n", snapshot->stats.current_buffered_bytes);
+    fprintf(out, "# TYPE defrag_table_load gauge\ndefrag_table_load %.4f\n", snapshot_table_load(snapshot));
+
+    // Only buckets that hold samples are written; cumulative counts keep the
+    // series valid for histogram_quantile() on the Prometheus side.
+    for (int i = 0; i < FIELD_COUNT(histogram_fields); i++) {
+        const Histogram* h = snapshot_histogram(snapshot, i);
+        const char* name = histogram_fields[i].name;
+        fprintf(out, "# TYPE defrag_%s histogram\n", name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+            if (h->counts[b] == 0) {
+                continue;
+            }
+            cumulative += h->counts[b];
+            fprintf(out, "defrag_%s_bucket{le=\"%llu\"} %llu\n", name,
+                    (unsigned long long)histogram_bucket_upper(b), (unsigned long long)cumulative);
+        }
+        fprintf(out, "defrag_%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)h->count);
+        fprintf(out, "defrag_%s_sum %llu\n", name, (unsigned long long)h->sum);
+        fprintf(out, "defrag_%s_count %llu\n", name, (unsigned long long)h->count);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+
+// Log-linear buckets: values below HISTOGRAM_SUB_BUCKETS are exact, and each
+// power of two above is split into HISTOGRAM_SUB_BUCKETS equal buckets, so a
+// recorded value is off by at most 1/8 of itself.
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} Histogram;
+
+void histogram_init(Histogram* histogram);
+void histogram_record(Histogram* histogram, uint64_t value);
+void histogram_merge(Histogram* into, const Histogram* from);
+uint64_t histogram_quantile(const Histogram* histogram, double quantile);
+uint64_t histogram_bucket_upper(int bucket);
+
+#endif
@@ -0,0 +1,553 @@
+#define _POSIX_C_SOURCE 200809L
+#include "defrag.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PCAP_MAGIC_USEC 0xa1b2c3d4u
+#define PCAP_MAGIC_NSEC 0xa1b23c4du
+#define PCAP_GLOBAL_HEADER_BYTES 24
+#define PCAP_RECORD_HEADER_BYTES 16
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+#define ETHERTYPE_IPV4 0x0800
+#define ETHERTYPE_VLAN 0x8100
+#define IP_FLAG_MF 0x2000
+#define IP_OFFSET_MASK 0x1fff
+#define PRUNE_INTERVAL 1024
+
+
+typedef struct {
+    FlowKey flow;
+    int offset;
+    bool more_fragments;
+    const uint8_t* payload;
+    int length;
+    uint32_t pseudo_sum;
+    uint64_t timestamp_ns;
+} FragmentRecord;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+    bool swapped;
+    bool nanoseconds;
+    int linktype;
+} PcapFile;
+
+typedef struct {
+    int packets;
+    int max_packet_size;
+    int mtu;
+    int window;
+    double reorder_rate;
+    double duplicate_rate;
+    double overlap_rate;
+    double loss_rate;
+    unsigned int seed;
+} GeneratorOptions;
+
+
+static uint16_t read_be16(const uint8_t* p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t read_be32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t read_pcap32(const PcapFile* pcap, const uint8_t* p) {
+    uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    if (pcap->swapped) {
+        v = (v >> 24) | ((v >> 8) & 0xff00u) | ((v << 8) & 0xff0000u) | (v << 24);
+    }
+    return v;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int pcap_open(const char* path, PcapFile* pcap) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("ERROR: Cannot open %s.\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < PCAP_GLOBAL_HEADER_BYTES) {
+        printf("ERROR: %s is not a pcap file.\n", path);
+        close(fd);
+        return -1;
+    }
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("ERROR: Cannot map %s.\n", path);
+        return -1;
+    }
+
+    pcap->data = (const uint8_t*)map;
+    pcap->size = st.st_size;
+    pcap->swapped = false;
+    uint32_t magic = read_pcap32(pcap, pcap->data);
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        pcap->swapped = true;
+        magic = read_pcap32(pcap, pcap->data);
+    }
+    if (magic != PCAP_MAGIC_USEC && magic != PCAP_MAGIC_NSEC) {
+        printf("ERROR: %s has an unknown pcap magic number.\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    pcap->nanoseconds = magic == PCAP_MAGIC_NSEC;
+    pcap->linktype = (int)read_pcap32(pcap, pcap->data + 20);
+    return 0;
+}
+
+// Returns the IPv4 header inside a captured frame, or NULL if the frame does
+// not carry IPv4.
+static const uint8_t* frame_ipv4(const PcapFile* pcap, const uint8_t* frame, uint32_t length, uint32_t* ip_length) {
+    if (pcap->linktype == LINKTYPE_RAW || pcap->linktype == LINKTYPE_IPV4) {
+        *ip_length = length;
+        return frame;
+    }
+    if (pcap->linktype != LINKTYPE_ETHERNET || length < 14) return NULL;
+
+    uint32_t header = 14;
+    uint16_t ethertype = read_be16(frame + 12);
+    while (ethertype == ETHERTYPE_VLAN && length >= header + 4) {
+        ethertype = read_be16(frame + header + 2);
+        header += 4;
+    }
+    if (ethertype != ETHERTYPE_IPV4) return NULL;
+    *ip_length = length - header;
+    return frame + header;
+}
+
+// Source, destination and protocol of the transport pseudo-header; the
+// transport length is only known once the last fragment is seen.
+static uint32_t pseudo_header_sum(const uint8_t* addresses, uint8_t protocol) {
+    uint32_t sum = protocol;
+    for (int i = 0; i < 8; i += 2) sum += read_be16(addresses + i);
+    return sum;
+}
+
+static bool parse_fragment(const uint8_t* ip, uint32_t ip_length, FragmentRecord* record) {
+    if (ip_length < 20 || (ip[0] >> 4) != 4) return false;
+    int header_length = (ip[0] & 0x0f) * 4;
+    int total_length = read_be16(ip + 2);
+    if (header_length < 20 || total_length < header_length || (uint32_t)total_length > ip_length) return false;
+
+    uint16_t flags_offset = read_be16(ip + 6);
+    bool more = (flags_offset & IP_FLAG_MF) != 0;
+    int offset = (flags_offset & IP_OFFSET_MASK) * 8;
+    if (!more && offset == 0) return false;
+
+    flow_key_init(&record->flow, read_be32(ip + 12), read_be32(ip + 16), ip[9], read_be16(ip + 4));
+    record->pseudo_sum = pseudo_header_sum(ip + 12, ip[9]);
+    record->offset = offset;
+    record->more_fragments = more;
+    record->payload = ip + header_length;
+    record->length = total_length - header_length;
+    return true;
+}
+
+static int extract_fragments(const PcapFile* pcap, FragmentRecord** out, long* frames) {
+    int capacity = 1024;
+    int count = 0;
+    FragmentRecord* records = (FragmentRecord*)malloc(capacity * sizeof(FragmentRecord));
+    if (records == NULL) return -1;
+
+    *frames = 0;
+    size_t pos = PCAP_GLOBAL_HEADER_BYTES;
+    while (pos + PCAP_RECORD_HEADER_BYTES <= pcap->size) {
+        uint64_t seconds = read_pcap32(pcap, pcap->data + pos);
+        uint64_t fraction = read_pcap32(pcap, pcap->data + pos + 4);
+        uint32_t captured = read_pcap32(pcap, pcap->data + pos + 8);
+        pos += PCAP_RECORD_HEADER_BYTES;
+        if (captured > pcap->size - pos) break;
+
+        const uint8_t* frame = pcap->data + pos;
+        pos += captured;
+        (*frames)++;
+
+        uint32_t ip_length;
+        const uint8_t* ip = frame_ipv4(pcap, frame, captured, &ip_length);
+        if (ip == NULL) continue;
+
+        if (count == capacity) {
+            capacity *= 2;
+            FragmentRecord* grown = (FragmentRecord*)realloc(records, capacity * sizeof(FragmentRecord));
+            if (grown == NULL) {
+                free(records);
+                return -1;
+            }
+            records = grown;
+        }
+        if (parse_fragment(ip, ip_length, &records[count])) {
+            records[count].timestamp_ns = seconds * 1000000000u + (pcap->nanoseconds ? fraction : fraction * 1000u);
+            count++;
+        }
+    }
+    *out = records;
+    return count;
+}
+
+typedef enum {
+    METRICS_NONE,
+    METRICS_JSON,
+    METRICS_PROMETHEUS
+} MetricsFormat;
+
+static void dump_metrics(DefragmenterSystem* system, MetricsFormat format) {
+    MetricsSnapshot* snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+    if (snapshot == NULL) return;
+    system_metrics_snapshot(system, snapshot);
+    if (format == METRICS_JSON) metrics_write_json(snapshot, stdout);
+    else metrics_write_prometheus(snapshot, stdout);
+    free(snapshot);
+}
+
+static int run_replay(const char* path, const SystemConfig* config, MetricsFormat metrics) {
+    PcapFile pcap;
+    if (pcap_open(path, &pcap) != 0) return 1;
+
+    FragmentRecord* records = NULL;
+    long frames = 0;
+    int count = extract_fragments(&pcap, &records, &frames);
+    if (count < 0) {
+        printf("ERROR: Out of memory while reading %s.\n", path);
+        munmap((void*)pcap.data, pcap.size);
+        return 1;
+    }
+
+    DefragmenterSystem system;
+    system_init_with_config(&system, config);
+
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) {
+        const FragmentRecord* r = &records[i];
+        unsigned int flags = r->more_fragments ? 0 : FRAGMENT_FLAG_LAST;
+        // The seed has to be in place before the fragment that completes the
+        // packet; a last fragment that arrives first creates the packet.
+        bool seed_after = false;
+        uint16_t seed = 0;
+        if (config->clock_source == CLOCK_SOURCE_EXTERNAL) system_clock_set(&system, r->timestamp_ns);
+        if (config->verify_checksum && !r->more_fragments) {
+            seed = checksum_fold(r->pseudo_sum + (uint32_t)(r->offset + r->length));
+            seed_after = system_set_flow_checksum_seed(&system, &r->flow, seed) != 0;
+        }
+        system_add_flow_fragment(&system, &r->flow, r->offset, r->payload, r->length, flags);
+        if (seed_after) system_set_flow_checksum_seed(&system, &r->flow, seed);
+        if (i % PRUNE_INTERVAL == 0) system_prune_timeouts(&system);
+    }
+    double elapsed = now_seconds() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("--- REPLAY %s ---\n", path);
+    printf("Frames Read: %ld\n", frames);
+    printf("IPv4 Fragments: %d\n", count);
+    printf("Fragments/sec: %.0f\n", elapsed > 0 ? count / elapsed : 0.0);
+    printf("Packets Completed: %ld\n", system.stats.packets_completed);
+    printf("Packets Timed Out: %ld\n", system.stats.total_packets_timed_out);
+    printf("Packets Evicted: %ld\n", system.stats.total_packets_evicted);
+    printf("Packets Still In Reassembly: %d\n", system_get_packet_count(&system));
+    printf("Fragments Discarded (Duplicate/Overlap): %ld\n", system.stats.total_duplicates_discarded);
+    printf("Fragments Discarded (Invalid/Bounds): %ld\n", system.stats.total_invalid_fragments);
+    printf("Overlap Bytes Trimmed / Overwritten: %ld / %ld\n",
+           system.stats.total_bytes_trimmed, system.stats.total_bytes_overwritten);
+    if (config->verify_checksum) {
+        printf("Packets Failing Checksum: %ld (%s kernel)\n", system.stats.total_checksum_failures,
+               checksum_kernel_name(checksum_active_kernel()));
+    }
+    printf("Payload Pool High-Water: %ld bytes\n", system.pools.payload_bytes_high_water);
+    printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+    if (metrics != METRICS_NONE) dump_metrics(&system, metrics);
+
+    system_cleanup(&system);
+    free(records);
+    munmap((void*)pcap.data, pcap.size);
+    return 0;
+}
+
+
+static unsigned int next_random(unsigned int* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static bool chance(unsigned int* seed, double rate) {
+    return rate > 0 && (next_random(seed) % 1000000u) < rate * 1000000.0;
+}
+
+static void write_le32(FILE* out, uint32_t v) {
+    uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    fwrite(b, 1, 4, out);
+}
+
+static void write_le16(FILE* out, uint16_t v) {
+    uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) };
+    fwrite(b, 1, 2, out);
+}
+
+static void write_fragment_frame(FILE* out, uint32_t timestamp_us, uint16_t ip_id, uint32_t src,
+                                 const uint8_t* payload, int offset, int length, bool more) {
+    uint8_t frame[14 + 20];
+    memset(frame, 0, sizeof(frame));
+    frame[12] = ETHERTYPE_IPV4 >> 8;
+    frame[13] = ETHERTYPE_IPV4 & 0xff;
+
+    uint8_t* ip = frame + 14;
+    int total_length = 20 + length;
+    uint16_t flags_offset = (uint16_t)((more ? IP_FLAG_MF : 0) | (offset / 8));
+    ip[0] = 0x45;
+    ip[2] = (uint8_t)(total_length >> 8);
+    ip[3] = (uint8_t)total_length;
+    ip[4] = (uint8_t)(ip_id >> 8);
+    ip[5] = (uint8_t)ip_id;
+    ip[6] = (uint8_t)(flags_offset >> 8);
+    ip[7] = (uint8_t)flags_offset;
+    ip[8] = 64;
+    ip[9] = 17;
+    ip[12] = (uint8_t)(src >> 24);
+    ip[13] = (uint8_t)(src >> 16);
+    ip[14] = (uint8_t)(src >> 8);
+    ip[15] = (uint8_t)src;
+    ip[16] = 10;
+    ip[19] = 1;
+    uint32_t sum = 0;
+    for (int i = 0; i < 20; i += 2) sum += read_be16(ip + i);
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    ip[10] = (uint8_t)(~sum >> 8);
+    ip[11] = (uint8_t)~sum;
+
+    write_le32(out, timestamp_us / 1000000u);
+    write_le32(out, timestamp_us % 1000000u);
+    write_le32(out, sizeof(frame) + length);
+    write_le32(out, sizeof(frame) + length);
+    fwrite(frame, 1, sizeof(frame), out);
+    fwrite(payload + offset, 1, length, out);
+}
+
+// Gives the packet a UDP header with a valid checksum, so that replays with
+// --checksum can verify every packet they complete.
+static void write_udp_header(uint8_t* payload, int size, uint32_t src, uint32_t dst) {
+    uint8_t addresses[8];
+    for (int i = 0; i < 4; i++) {
+        addresses[i] = (uint8_t)(src >> (24 - 8 * i));
+        addresses[4 + i] = (uint8_t)(dst >> (24 - 8 * i));
+    }
+    payload[4] = (uint8_t)(size >> 8);
+    payload[5] = (uint8_t)size;
+    payload[6] = 0;
+    payload[7] = 0;
+    uint32_t sum = pseudo_header_sum(addresses, 17) + (uint32_t)size;
+    for (int i = 0; i + 1 < size; i += 2) sum += read_be16(payload + i);
+    if (size & 1) sum += (uint32_t)payload[size - 1] << 8;
+    uint16_t checksum = (uint16_t)~checksum_fold(sum);
+    if (checksum == 0) checksum = 0xffff;
+    payload[6] = (uint8_t)(checksum >> 8);
+    payload[7] = (uint8_t)checksum;
+}
+
+typedef struct {
+    int offset;
+    int length;
+    bool more;
+    int packet;
+} PlannedFragment;
+
+static int run_generate(const char* path, const GeneratorOptions* options) {
+    FILE* out = fopen(path, "wb");
+    if (out == NULL) {
+        printf("ERROR: Cannot create %s.\n", path);
+        return 1;
+    }
+    static char out_buffer[1 << 16];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    write_le32(out, PCAP_MAGIC_USEC);
+    write_le16(out, 2);
+    write_le16(out, 4);
+    write_le32(out, 0);
+    write_le32(out, 0);
+    write_le32(out, 65535);
+    write_le32(out, LINKTYPE_ETHERNET);
+
+    int step = (options->mtu - 20) / 8 * 8;
+    int max_frags = options->max_packet_size / step + 2;
+    int plan_capacity = options->window * max_frags * 3;
+    PlannedFragment* plan = (PlannedFragment*)malloc(plan_capacity * sizeof(PlannedFragment));
+    uint8_t* payloads = (uint8_t*)malloc((size_t)options->window * options->max_packet_size);
+    if (plan == NULL || payloads == NULL || step <= 0) {
+        free(plan);
+        free(payloads);
+        fclose(out);
+        printf("ERROR: Invalid generator options or out of memory.\n");
+        return 1;
+    }
+
+    unsigned int seed = options->seed != 0 ? options->seed : 1;
+    uint32_t timestamp = 0;
+    long written = 0;
+
+    // Packets are generated in windows whose fragments are interleaved, so
+    // reassembly always has `window` packets in flight.
+    for (int base = 0; base < options->packets; base += options->window) {
+        int in_window = options->packets - base < options->window ? options->packets - base : options->window;
+        int planned = 0;
+        for (int p = 0; p < in_window; p++) {
+            int size = 8 + (int)(next_random(&seed) % (unsigned int)(options->max_packet_size - 7));
+            uint8_t* payload = payloads + (size_t)p * options->max_packet_size;
+            for (int i = 0; i < size; i++) payload[i] = (uint8_t)next_random(&seed);
+            write_udp_header(payload, size, 0x0a000000u | (uint32_t)((base + p) >> 16), 0x0a000001u);
+
+            for (int offset = 0; offset < size; offset += step) {
+                int length = size - offset < step ? size - offset : step;
+                bool more = offset + length < size;
+                if (chance(&seed, options->loss_rate)) continue;
+                plan[planned++] = (PlannedFragment){ offset, length, more, p };
+                if (chance(&seed, options->duplicate_rate)) {
+                    plan[planned++] = (PlannedFragment){ offset, length, more, p };
+                }
+                if (offset >= 8 && length > 8 && chance(&seed, options->overlap_rate)) {
+                    plan[planned++] = (PlannedFragment){ offset - 8, 16, true, p };
+                }
+            }
+        }
+
+        for (int i = 0; i < planned; i++) {
+            if (chance(&seed, options->reorder_rate)) {
+                int j = (int)(next_random(&seed) % (unsigned int)planned);
+                PlannedFragment tmp = plan[i];
+                plan[i] = plan[j];
+                plan[j] = tmp;
+            }
+        }
+        for (int i = 0; i < planned; i++) {
+            const PlannedFragment* f = &plan[i];
+            int packet = base + f->packet;
+            write_fragment_frame(out, timestamp++, (uint16_t)packet, 0x0a000000u | (uint32_t)(packet >> 16),
+                                 payloads + (size_t)f->packet * options->max_packet_size,
+                                 f->offset, f->length, f->more);
+            written++;
+        }
+    }
+
+    fclose(out);
+    free(plan);
+    free(payloads);
+    printf("Wrote %ld fragments for %d packets to %s.\n", written, options->packets, path);
+    return 0;
+}
+
+static bool parse_overlap_policy(const char* name, OverlapPolicy* policy) {
+    static const char* names[] = { "reject", "first", "last", "bsd", "linux" };
+    for (int i = 0; i < 5; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *policy = (OverlapPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parse_eviction_policy(const char* name, EvictionPolicy* policy) {
+    static const char* names[] = { "oldest", "largest", "least" };
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *policy = (EvictionPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_usage(void) {
+    printf("Usage:\n");
+    printf("  pcap_replay replay FILE [--buffer | --gather] [--tree | --array] [--max-packets N] [--overlap reject|first|last|bsd|linux]\n");
+    printf("                          [--budget BYTES] [--evict oldest|largest|least] [--metrics json|prometheus] [--checksum]\n");
+    printf("                          [--timeout SECONDS] [--wall-clock]\n");
+    printf("  pcap_replay generate FILE [--packets N] [--size BYTES] [--mtu BYTES] [--window N]\n");
+    printf("                            [--reorder R] [--duplicate R] [--overlap R] [--loss R] [--seed N]\n");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+
+    if (strcmp(argv[1], "replay") == 0) {
+        SystemConfig config;
+        system_config_init(&config);
+        config.max_packets = 1 << 20;
+        config.auto_register = true;
+        // Timeouts run on the capture's own timestamps, so a replay expires
+        // the same packets however fast it runs.
+        config.clock_source = CLOCK_SOURCE_EXTERNAL;
+        MetricsFormat metrics = METRICS_NONE;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--buffer") == 0) config.reassembly_mode = REASSEMBLY_BUFFER;
+            else if (strcmp(argv[i], "--gather") == 0) config.reassembly_mode = REASSEMBLY_GATHER;
+            else if (strcmp(argv[i], "--tree") == 0) config.coverage_index = COVERAGE_TREE;
+            else if (strcmp(argv[i], "--array") == 0) config.coverage_index = COVERAGE_ARRAY;
+            else if (strcmp(argv[i], "--checksum") == 0) config.verify_checksum = true;
+            else if (strcmp(argv[i], "--max-packets") == 0 && i + 1 < argc) config.max_packets = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc) config.byte_budget = atol(argv[++i]);
+            else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) config.packet_timeout_seconds = atof(argv[++i]);
+            else if (strcmp(argv[i], "--wall-clock") == 0) config.clock_source = CLOCK_SOURCE_MONOTONIC;
+            else if (strcmp(argv[i], "--evict") == 0 && i + 1 < argc && parse_eviction_policy(argv[i + 1], &config.eviction_policy)) i++;
+            else if (strcmp(argv[i], "--overlap") == 0 && i + 1 < argc && parse_overlap_policy(argv[i + 1], &config.overlap_policy)) i++;
+            else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc && strcmp(argv[i + 1], "json") == 0) metrics = METRICS_JSON, i++;
+            else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc && strcmp(argv[i + 1], "prometheus") == 0) metrics = METRICS_PROMETHEUS, i++;
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+        // Latency histograms need two clock reads per fragment, so they are
+        // only switched on when the metrics are going to be printed.
+        config.metrics_timing = metrics != METRICS_NONE;
+        return run_replay(argv[2], &config, metrics);
+    }
+
+    if (strcmp(argv[1], "generate") == 0) {
+        GeneratorOptions options = { 10000, 4000, 1500, 64, 0.0, 0.0, 0.0, 0.0, 1 };
+        for (int i = 3; i + 1 < argc; i += 2) {
+            const char* value = argv[i + 1];
+            if (strcmp(argv[i], "--packets") == 0) options.packets = atoi(value);
+            else if (strcmp(argv[i], "--size") == 0) options.max_packet_size = atoi(value);
+            else if (strcmp(argv[i], "--mtu") == 0) options.mtu = atoi(value);
+            else if (strcmp(argv[i], "--window") == 0) options.window = atoi(value);
+            else if (strcmp(argv[i], "--reorder") == 0) options.reorder_rate = atof(value);
+            else if (strcmp(argv[i], "--duplicate") == 0) options.duplicate_rate = atof(value);
+            else if (strcmp(argv[i], "--overlap") == 0) options.overlap_rate = atof(value);
+            else if (strcmp(argv[i], "--loss") == 0) options.loss_rate = atof(value);
+            else if (strcmp(argv[i], "--seed") == 0) options.seed = (unsigned int)strtoul(value, NULL, 10);
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+        if (options.packets <= 0 || options.window <= 0 || options.max_packet_size < 16 ||
+            options.max_packet_size > MAX_PACKET_SIZE_BYTES - 20 || options.mtu < 28) {
+            printf("ERROR: Generator options out of range.\n");
+            return 1;
+        }
+        return run_generate(argv[2], &options);
+    }
+
+    print_usage();
+    return 1;
+}
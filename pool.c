@@ -0,0 +1,181 @@
+#include "pool.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_HEADER_SIZE 16
+
+static void object_pool_init(ObjectPool* pool, size_t object_size) {
+    if (object_size < sizeof(void*)) object_size = sizeof(void*);
+    object_size = (object_size + 7) & ~(size_t)7;
+    // Objects of a cache line or more start on a line boundary, so a packet's
+    // hot fields never straddle two lines.
+    if (object_size >= POOL_CACHE_LINE) {
+        object_size = (object_size + POOL_CACHE_LINE - 1) & ~(size_t)(POOL_CACHE_LINE - 1);
+    }
+
+    pool->object_size = object_size;
+    pool->objects_per_slab = (int)(POOL_SLAB_BYTES / object_size);
+    if (pool->objects_per_slab < POOL_MIN_SLAB_OBJECTS) {
+        pool->objects_per_slab = POOL_MIN_SLAB_OBJECTS;
+    }
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->in_use = 0;
+    pool->high_water = 0;
+}
+
+static void object_pool_destroy(ObjectPool* pool) {
+    PoolSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab* to_free = slab;
+        slab = slab->next;
+        free(to_free);
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+}
+
+static int object_pool_refill(MemoryPools* pools, ObjectPool* pool) {
+    bool aligned = pool->object_size % POOL_CACHE_LINE == 0;
+    size_t padding = aligned ? POOL_CACHE_LINE : 0;
+    PoolSlab* slab = (PoolSlab*)malloc(SLAB_HEADER_SIZE + padding + pool->objects_per_slab * pool->object_size);
+    if (slab == NULL) return -1;
+    pools->heap_allocations++;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    char* objects = (char*)slab + SLAB_HEADER_SIZE;
+    if (aligned) {
+        objects = (char*)(((uintptr_t)objects + POOL_CACHE_LINE - 1) & ~(uintptr_t)(POOL_CACHE_LINE - 1));
+    }
+    for (int i = pool->objects_per_slab - 1; i >= 0; i--) {
+        void** object = (void**)(objects + i * pool->object_size);
+        *object = pool->free_list;
+        pool->free_list = object;
+    }
+    return 0;
+}
+
+static void* object_pool_alloc(MemoryPools* pools, ObjectPool* pool) {
+    void* object;
+    if (pools->enabled) {
+        if (pool->free_list == NULL && object_pool_refill(pools, pool) != 0) return NULL;
+        object = pool->free_list;
+        pool->free_list = *(void**)object;
+    } else {
+        object = malloc(pool->object_size);
+        if (object == NULL) return NULL;
+        pools->heap_allocations++;
+    }
+
+    pool->in_use++;
+    if (pool->in_use > pool->high_water) pool->high_water = pool->in_use;
+    return object;
+}
+
+static void object_pool_free(MemoryPools* pools, ObjectPool* pool, void* object) {
+    pool->in_use--;
+    if (pools->enabled) {
+        *(void**)object = pool->free_list;
+        pool->free_list = object;
+    } else {
+        free(object);
+    }
+}
+
+static int payload_class(int size) {
+    int shift = PAYLOAD_MIN_CLASS_SHIFT;
+    while ((1 << shift) < size) shift++;
+    return shift - PAYLOAD_MIN_CLASS_SHIFT;
+}
+
+void pools_init(MemoryPools* pools, bool enabled, const size_t object_sizes[POOL_KIND_COUNT]) {
+    pools->enabled = enabled;
+    for (int kind = 0; kind < POOL_KIND_COUNT; kind++) {
+        object_pool_init(&pools->objects[kind], object_sizes[kind]);
+    }
+    for (int c = 0; c < PAYLOAD_CLASS_COUNT; c++) {
+        object_pool_init(&pools->payloads[c], (size_t)1 << (c + PAYLOAD_MIN_CLASS_SHIFT));
+    }
+    pools->payload_bytes_in_use = 0;
+    pools->payload_bytes_high_water = 0;
+    pools->heap_allocations = 0;
+}
+
+void pools_destroy(MemoryPools* pools) {
+    for (int kind = 0; kind < POOL_KIND_COUNT; kind++) {
+        object_pool_destroy(&pools->objects[kind]);
+    }
+    for (int c = 0; c < PAYLOAD_CLASS_COUNT; c++) {
+        object_pool_destroy(&pools->payloads[c]);
+    }
+    pools->payload_bytes_in_use = 0;
+}
+
+void* pools_alloc(MemoryPools* pools, PoolKind kind) {
+    return object_pool_alloc(pools, &pools->objects[kind]);
+}
+
+void pools_free(MemoryPools* pools, PoolKind kind, void* object) {
+    if (object == NULL) return;
+    object_pool_free(pools, &pools->objects[kind], object);
+}
+
+char* pools_alloc_payload(MemoryPools* pools, int size) {
+    if (pools == NULL) return (char*)malloc(size);
+
+    int c = payload_class(size);
+    char* data;
+    if (c < PAYLOAD_CLASS_COUNT) {
+        data = (char*)object_pool_alloc(pools, &pools->payloads[c]);
+    } else {
+        data = (char*)malloc(size);
+        if (data != NULL) pools->heap_allocations++;
+    }
+    if (data == NULL) return NULL;
+
+    pools->payload_bytes_in_use += size;
+    if (pools->payload_bytes_in_use > pools->payload_bytes_high_water) {
+        pools->payload_bytes_high_water = pools->payload_bytes_in_use;
+    }
+    return data;
+}
+
+void pools_free_payload(MemoryPools* pools, char* data, int size) {
+    if (data == NULL) return;
+    if (pools == NULL) {
+        free(data);
+        return;
+    }
+
+    int c = payload_class(size);
+    if (c < PAYLOAD_CLASS_COUNT) {
+        object_pool_free(pools, &pools->payloads[c], data);
+    } else {
+        free(data);
+    }
+    pools->payload_bytes_in_use -= size;
+}
+
+char* pools_resize_payload(MemoryPools* pools, char* data, int old_size, int new_size) {
+    if (pools == NULL) return (char*)realloc(data, new_size);
+
+    int old_class = payload_class(old_size);
+    if (pools->enabled && old_class < PAYLOAD_CLASS_COUNT && old_class == payload_class(new_size)) {
+        // Still fits the slot it already occupies.
+        pools->payload_bytes_in_use += new_size - old_size;
+        if (pools->payload_bytes_in_use > pools->payload_bytes_high_water) {
+            pools->payload_bytes_high_water = pools->payload_bytes_in_use;
+        }
+        return data;
+    }
+
+    char* new_data = pools_alloc_payload(pools, new_size);
+    if (new_data == NULL) return NULL;
+    memcpy(new_data, data, old_size < new_size ? old_size : new_size);
+    pools_free_payload(pools, data, old_size);
+    return new_data;
+}
@@ -0,0 +1,53 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+
+#define POOL_SLAB_BYTES 65536
+#define POOL_CACHE_LINE 64
+#define POOL_MIN_SLAB_OBJECTS 4
+#define PAYLOAD_MIN_CLASS_SHIFT 4
+#define PAYLOAD_CLASS_COUNT 13
+
+
+typedef enum {
+    POOL_FRAGMENT,
+    POOL_PACKET,
+    POOL_KIND_COUNT
+} PoolKind;
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+    size_t object_size;
+    int objects_per_slab;
+    void* free_list;
+    PoolSlab* slabs;
+    long in_use;
+    long high_water;
+} ObjectPool;
+
+typedef struct {
+    bool enabled;
+    ObjectPool objects[POOL_KIND_COUNT];
+    ObjectPool payloads[PAYLOAD_CLASS_COUNT];
+    long payload_bytes_in_use;
+    long payload_bytes_high_water;
+    long heap_allocations;
+} MemoryPools;
+
+void pools_init(MemoryPools* pools, bool enabled, const size_t object_sizes[POOL_KIND_COUNT]);
+void pools_destroy(MemoryPools* pools);
+
+void* pools_alloc(MemoryPools* pools, PoolKind kind);
+void pools_free(MemoryPools* pools, PoolKind kind, void* object);
+
+char* pools_alloc_payload(MemoryPools* pools, int size);
+char* pools_resize_payload(MemoryPools* pools, char* data, int old_size, int new_size);
+void pools_free_payload(MemoryPools* pools, char* data, int size);
+
+#endif
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L
+#include "shard.h"
+
+// Returns -1 if shard_count is outside 1..MAX_SHARDS or memory runs out. No
+// log handler can be installed before the shards exist, so reporting the
+// failure is left to the caller.
+int sharded_init(ShardedDefragmenter* engine, int shard_count, const SystemConfig* config) {
+    if (shard_count <= 0 || shard_count > MAX_SHARDS) {
+        return -1;
+    }
+
+    // Each shard starts on its own cache line so neighbouring locks and
+    // counters are never falsely shared.
+    void* memory = NULL;
+    if (posix_memalign(&memory, SHARD_CACHE_LINE, sizeof(DefragShard) * shard_count) != 0) {
+        return -1;
+    }
+
+    // The byte budget is for the whole engine, so each shard gets an equal share.
+    SystemConfig shard_config = *config;
+    if (shard_config.byte_budget > 0) {
+        shard_config.byte_budget = shard_config.byte_budget / shard_count > 0 ? shard_config.byte_budget / shard_count : 1;
+    }
+
+    engine->shards = (DefragShard*)memory;
+    engine->shard_count = shard_count;
+    for (int i = 0; i < shard_count; i++) {
+        pthread_mutex_init(&engine->shards[i].lock, NULL);
+        system_init_with_config(&engine->shards[i].system, &shard_config);
+        engine->shards[i].on_complete = NULL;
+        engine->shards[i].on_complete_user = NULL;
+        engine->shards[i].on_complete_flow = NULL;
+        engine->shards[i].on_complete_flow_user = NULL;
+    }
+    return 0;
+}
+
+void sharded_cleanup(ShardedDefragmenter* engine) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        system_cleanup(&engine->shards[i].system);
+        pthread_mutex_destroy(&engine->shards[i].lock);
+    }
+    free(engine->shards);
+    engine->shards = NULL;
+    engine->shard_count = 0;
+}
+
+// Packets are routed by their flow hash, so a plain ID and the flow key with
+// no addresses name the same shard, as they name the same packet. The shard
+// comes from the high bits of a multiplicative remix; each shard's packet
+// table indexes with the low bits of the flow hash itself, so the keys that
+// land in one shard still spread across its table.
+static int shard_index(const ShardedDefragmenter* engine, unsigned int flow_hash) {
+    uint32_t h = (uint32_t)flow_hash * 0x9e3779b1u;
+    return (int)(((uint64_t)h * (uint32_t)engine->shard_count) >> 32);
+}
+
+DefragShard* sharded_shard_for_flow(ShardedDefragmenter* engine, const FlowKey* flow) {
+    return &engine->shards[shard_index(engine, flow_key_hash(flow))];
+}
+
+DefragShard* sharded_shard_for(ShardedDefragmenter* engine, int packet_id) {
+    FlowKey flow;
+    flow_key_init(&flow, 0, 0, 0, (uint32_t)packet_id);
+    return sharded_shard_for_flow(engine, &flow);
+}
+
+int sharded_register_packet(ShardedDefragmenter* engine, int id, int packet_size_in_bytes) {
+    DefragShard* shard = sharded_shard_for(engine, id);
+    pthread_mutex_lock(&shard->lock);
+    int result = system_register_packet(&shard->system, id, packet_size_in_bytes);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int sharded_register_stream(ShardedDefragmenter* engine, int id) {
+    DefragShard* shard = sharded_shard_for(engine, id);
+    pthread_mutex_lock(&shard->lock);
+    int result = system_register_stream(&shard->system, id);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int sharded_add_fragment(ShardedDefragmenter* engine, int id, int offset, const char* data, bool is_last_fragment) {
+    return sharded_add_fragment_ex(engine, id, offset, (const uint8_t*)data, strlen(data),
+                                   is_last_fragment ? FRAGMENT_FLAG_LAST : 0);
+}
+
+int sharded_add_fragment_ex(ShardedDefragmenter* engine, int id, int offset, const uint8_t* data, size_t len, unsigned int flags) {
+    DefragShard* shard = sharded_shard_for(engine, id);
+    pthread_mutex_lock(&shard->lock);
+    int result = system_add_fragment_ex(&shard->system, id, offset, data, len, flags);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int sharded_register_flow(ShardedDefragmenter* engine, const FlowKey* flow, int packet_size_in_bytes) {
+    DefragShard* shard = sharded_shard_for_flow(engine, flow);
+    pthread_mutex_lock(&shard->lock);
+    int result = system_register_flow(&shard->system, flow, packet_size_in_bytes);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int sharded_add_flow_fragment(ShardedDefragmenter* engine, const FlowKey* flow, int offset, const uint8_t* data, size_t len, unsigned int flags) {
+    DefragShard* shard = sharded_shard_for_flow(engine, flow);
+    pthread_mutex_lock(&shard->lock);
+    int result = system_add_flow_fragment(&shard->system, flow, offset, data, len, flags);
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+// Splits each window of SHARD_BATCH_WINDOW descriptors by shard, keeping
+// their order within a shard, and hands every shard its share as one batch
+// under a single lock. `results` and `completed_ids` mean what they do for
+// system_add_fragments_batch; completed IDs are listed shard by shard.
+size_t sharded_add_fragments_batch(ShardedDefragmenter* engine, const FragmentDescriptor* fragments, size_t count,
+                                   int* results, int* completed_ids) {
+    FragmentDescriptor grouped[SHARD_BATCH_WINDOW];
+    int grouped_results[SHARD_BATCH_WINDOW];
+    int origin[SHARD_BATCH_WINDOW];
+    int shard_of[SHARD_BATCH_WINDOW];
+    int start[MAX_SHARDS + 1];
+    int fill[MAX_SHARDS];
+    size_t completed_count = 0;
+
+    for (size_t base = 0; base < count; base += SHARD_BATCH_WINDOW) {
+        int n = count - base < SHARD_BATCH_WINDOW ? (int)(count - base) : SHARD_BATCH_WINDOW;
+        const FragmentDescriptor* window = fragments + base;
+        memset(start, 0, sizeof(int) * (engine->shard_count + 1));
+        for (int i = 0; i < n; i++) {
+            FlowKey flow;
+            if (window[i].flow == NULL) flow_key_init(&flow, 0, 0, 0, (uint32_t)window[i].packet_id);
+            shard_of[i] = shard_index(engine, flow_key_hash(window[i].flow != NULL ? window[i].flow : &flow));
+            start[shard_of[i] + 1]++;
+        }
+        for (int k = 0; k < engine->shard_count; k++) {
+            start[k + 1] += start[k];
+            fill[k] = start[k];
+        }
+        for (int i = 0; i < n; i++) {
+            int pos = fill[shard_of[i]]++;
+            grouped[pos] = window[i];
+            origin[pos] = i;
+        }
+
+        for (int k = 0; k < engine->shard_count; k++) {
+            if (start[k] == start[k + 1]) continue;
+            DefragShard* shard = &engine->shards[k];
+            pthread_mutex_lock(&shard->lock);
+            completed_count += system_add_fragments_batch(&shard->system, grouped + start[k], (size_t)(start[k + 1] - start[k]),
+                                                          results != NULL ? grouped_results + start[k] : NULL,
+                                                          completed_ids != NULL ? completed_ids + completed_count : NULL);
+            pthread_mutex_unlock(&shard->lock);
+        }
+        if (results != NULL) {
+            for (int pos = 0; pos < n; pos++) results[base + origin[pos]] = grouped_results[pos];
+        }
+    }
+    return completed_count;
+}
+
+void sharded_prune_timeouts(ShardedDefragmenter* engine) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_prune_timeouts(&engine->shards[i].system);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+// Each shard keeps its own clock; a ticker thread or a replay moves them all.
+void sharded_clock_tick(ShardedDefragmenter* engine) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_clock_tick(&engine->shards[i].system);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+void sharded_clock_set(ShardedDefragmenter* engine, uint64_t now_ns) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_clock_set(&engine->shards[i].system, now_ns);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+static void shard_deliver_completion(void* user, int packet_id, char* data, int length) {
+    DefragShard* shard = (DefragShard*)user;
+    shard->on_complete(shard->on_complete_user, &shard->system, packet_id, data, length);
+}
+
+void sharded_set_completion_handler(ShardedDefragmenter* engine, ShardCompletionHandler handler, void* user) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        DefragShard* shard = &engine->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->on_complete = handler;
+        shard->on_complete_user = user;
+        system_set_completion_handler(&shard->system, handler != NULL ? shard_deliver_completion : NULL, shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void shard_deliver_flow_completion(void* user, const FlowKey* flow, char* data, int length) {
+    DefragShard* shard = (DefragShard*)user;
+    shard->on_complete_flow(shard->on_complete_flow_user, &shard->system, flow, data, length);
+}
+
+// Replaces the completion handler for consumers that need the whole key.
+void sharded_set_flow_completion_handler(ShardedDefragmenter* engine, ShardFlowCompletionHandler handler, void* user) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        DefragShard* shard = &engine->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->on_complete_flow = handler;
+        shard->on_complete_flow_user = user;
+        system_set_flow_completion_handler(&shard->system, handler != NULL ? shard_deliver_flow_completion : NULL, shard);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// Stream handlers run under the shard lock, like completion handlers.
+void sharded_set_stream_handler(ShardedDefragmenter* engine, StreamHandler handler, void* user) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_set_stream_handler(&engine->shards[i].system, handler, user);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+void sharded_set_log_handler(ShardedDefragmenter* engine, LogHandler handler, void* user) {
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_set_log_handler(&engine->shards[i].system, handler, user);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+// For a consumer that keeps a packet past its completion handler. It takes the
+// shard lock, so it must not be called from inside a handler; a handler
+// releases through the system it was given instead.
+void sharded_release_packet_data(ShardedDefragmenter* engine, int packet_id, char* data, int length) {
+    DefragShard* shard = sharded_shard_for(engine, packet_id);
+    pthread_mutex_lock(&shard->lock);
+    system_release_packet_data(&shard->system, data, length);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void sharded_get_stats(ShardedDefragmenter* engine, SystemStats* stats) {
+    memset(stats, 0, sizeof(SystemStats));
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_stats_accumulate(stats, &engine->shards[i].system.stats);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+}
+
+// Every shard counts into its own cache-line-aligned system, so recording
+// never contends; the shards are only combined when a snapshot is taken.
+int sharded_metrics_snapshot(ShardedDefragmenter* engine, MetricsSnapshot* snapshot) {
+    MetricsSnapshot* shard_snapshot = (MetricsSnapshot*)malloc(sizeof(MetricsSnapshot));
+    if (!shard_snapshot) {
+        return -1;
+    }
+
+    memset(snapshot, 0, sizeof(MetricsSnapshot));
+    histogram_init(&snapshot->metrics.insert_latency_ns);
+    histogram_init(&snapshot->metrics.merges_per_insert);
+    histogram_init(&snapshot->metrics.completion_time_ns);
+    histogram_init(&snapshot->metrics.fragments_per_packet);
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        system_metrics_snapshot(&engine->shards[i].system, shard_snapshot);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+        metrics_snapshot_merge(snapshot, shard_snapshot);
+    }
+    free(shard_snapshot);
+    return 0;
+}
+
+int sharded_get_packet_count(ShardedDefragmenter* engine) {
+    int total = 0;
+    for (int i = 0; i < engine->shard_count; i++) {
+        pthread_mutex_lock(&engine->shards[i].lock);
+        total += system_get_packet_count(&engine->shards[i].system);
+        pthread_mutex_unlock(&engine->shards[i].lock);
+    }
+    return total;
+}
@@ -0,0 +1,65 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <pthread.h>
+#include "defrag.h"
+
+
+#define SHARD_CACHE_LINE 64
+#define MAX_SHARDS 256
+#define SHARD_BATCH_WINDOW 256
+
+#if defined(__GNUC__)
+#define SHARD_ALIGNED __attribute__((aligned(SHARD_CACHE_LINE)))
+#else
+#define SHARD_ALIGNED
+#endif
+
+// Completion handlers run under the shard lock, so they are handed the shard's
+// own system: releasing through it with system_release_packet_data needs no
+// further locking.
+typedef void (*ShardCompletionHandler)(void* user, DefragmenterSystem* system, int packet_id, char* data, int length);
+typedef void (*ShardFlowCompletionHandler)(void* user, DefragmenterSystem* system, const FlowKey* flow, char* data, int length);
+
+typedef struct SHARD_ALIGNED {
+    pthread_mutex_t lock;
+    DefragmenterSystem system;
+    ShardCompletionHandler on_complete;
+    void* on_complete_user;
+    ShardFlowCompletionHandler on_complete_flow;
+    void* on_complete_flow_user;
+} DefragShard;
+
+typedef struct {
+    int shard_count;
+    DefragShard* shards;
+} ShardedDefragmenter;
+
+int sharded_init(ShardedDefragmenter* engine, int shard_count, const SystemConfig* config);
+void sharded_cleanup(ShardedDefragmenter* engine);
+DefragShard* sharded_shard_for(ShardedDefragmenter* engine, int packet_id);
+DefragShard* sharded_shard_for_flow(ShardedDefragmenter* engine, const FlowKey* flow);
+
+int sharded_register_packet(ShardedDefragmenter* engine, int id, int packet_size_in_bytes);
+int sharded_register_stream(ShardedDefragmenter* engine, int id);
+int sharded_add_fragment(ShardedDefragmenter* engine, int id, int offset, const char* data, bool is_last_fragment);
+int sharded_add_fragment_ex(ShardedDefragmenter* engine, int id, int offset, const uint8_t* data, size_t len, unsigned int flags);
+int sharded_register_flow(ShardedDefragmenter* engine, const FlowKey* flow, int packet_size_in_bytes);
+int sharded_add_flow_fragment(ShardedDefragmenter* engine, const FlowKey* flow, int offset, const uint8_t* data, size_t len, unsigned int flags);
+size_t sharded_add_fragments_batch(ShardedDefragmenter* engine, const FragmentDescriptor* fragments, size_t count,
+                                   int* results, int* completed_ids);
+void sharded_prune_timeouts(ShardedDefragmenter* engine);
+void sharded_clock_tick(ShardedDefragmenter* engine);
+void sharded_clock_set(ShardedDefragmenter* engine, uint64_t now_ns);
+
+void sharded_set_completion_handler(ShardedDefragmenter* engine, ShardCompletionHandler handler, void* user);
+void sharded_set_flow_completion_handler(ShardedDefragmenter* engine, ShardFlowCompletionHandler handler, void* user);
+void sharded_set_stream_handler(ShardedDefragmenter* engine, StreamHandler handler, void* user);
+void sharded_set_log_handler(ShardedDefragmenter* engine, LogHandler handler, void* user);
+void sharded_release_packet_data(ShardedDefragmenter* engine, int packet_id, char* data, int length);
+
+void sharded_get_stats(ShardedDefragmenter* engine, SystemStats* stats);
+int sharded_metrics_snapshot(ShardedDefragmenter* engine, MetricsSnapshot* snapshot);
+int sharded_get_packet_count(ShardedDefragmenter* engine);
+
+#endif
@@ -0,0 +1,580 @@
+#define _POSIX_C_SOURCE 200809L
+#include "defrag.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC "DFRGTRC1"
+#define TRACE_RECORD_BYTES 16
+#define TRACE_IO_BUFFER (1 << 20)
+#define TRACE_PATTERN_SPREAD 4096
+
+
+// One trace command. Text traces use one line per command:
+//   r ID SIZE                 register a packet
+//   a ID OFFSET LAST DATA     add a fragment whose payload is the rest of the line
+//   f ID OFFSET LENGTH LAST   add LENGTH generated bytes (see fill_data)
+//   s                         print statistics
+//   p                         prune timed-out packets
+//   ? ID                      print a packet's status
+// Binary traces start with TRACE_MAGIC, then hold one 16-byte little-endian
+// record per command (op, last, 2 spare bytes, id, offset, length/size),
+// with `length` payload bytes after each 'a' record.
+typedef struct {
+    char op;
+    bool last;
+    int id;
+    int offset;
+    int length;
+    const char* data;
+} TraceCommand;
+
+typedef struct {
+    DefragmenterSystem system;
+    long commands;
+    long fragments;
+    double elapsed;
+} TraceRun;
+
+typedef enum {
+    ORDER_FORWARD,
+    ORDER_REVERSE,
+    ORDER_SHUFFLED
+} FragmentOrder;
+
+// Fragments of `window` packets are interleaved, so that many are in flight.
+typedef struct {
+    const char* name;
+    int packets;
+    int packet_bytes;
+    int fragment_bytes;
+    FragmentOrder order;
+    int window;
+    int duplicate_percent;
+    unsigned int seed;
+} Workload;
+
+static const Workload workloads[] = {
+    { "in-order", 100000, 1500, 128, ORDER_FORWARD, 1, 0, 11 },
+    { "reversed", 100000, 1500, 128, ORDER_REVERSE, 1, 0, 12 },
+    { "random", 100000, 1500, 128, ORDER_SHUFFLED, 64, 0, 13 },
+    { "high-duplicate", 100000, 1500, 128, ORDER_SHUFFLED, 64, 50, 14 },
+    { "small-packets", 1000000, 64, 32, ORDER_SHUFFLED, 256, 0, 15 },
+};
+
+#define WORKLOAD_COUNT ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+typedef struct {
+    const Workload* workload;
+    unsigned int seed;
+    int next_packet;
+    TraceCommand* plan;
+} WorkloadGenerator;
+
+
+static char fill_pattern[MAX_PACKET_SIZE_BYTES + TRACE_PATTERN_SPREAD];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_random(unsigned int* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void fill_pattern_init(void) {
+    unsigned int seed = 0x5eed;
+    for (size_t i = 0; i < sizeof(fill_pattern); i++) fill_pattern[i] = (char)next_random(&seed);
+}
+
+// Generated payloads are windows of one pattern: byte i of packet `id` is the
+// same whichever fragment carries it, so overlaps and duplicates agree.
+static const char* fill_data(int id, int offset) {
+    return fill_pattern + (unsigned int)id % TRACE_PATTERN_SPREAD + offset;
+}
+
+static uint32_t read_le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void write_le32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void print_log_message(void* user, const char* message) {
+    (void)user;
+    printf("%s\n", message);
+}
+
+static void release_completed_packet(void* user, int packet_id, char* data, int length) {
+    (void)packet_id;
+    system_release_packet_data((DefragmenterSystem*)user, data, length);
+}
+
+static void trace_run_init(TraceRun* run, const SystemConfig* config, bool log) {
+    system_init_with_config(&run->system, config);
+    system_set_completion_handler(&run->system, release_completed_packet, &run->system);
+    if (log) system_set_log_handler(&run->system, print_log_message, NULL);
+    run->commands = 0;
+    run->fragments = 0;
+    run->elapsed = 0;
+}
+
+static void trace_execute(TraceRun* run, const TraceCommand* command) {
+    DefragmenterSystem* system = &run->system;
+    run->commands++;
+    switch (command->op) {
+        case 'r':
+            system_register_packet(system, command->id, command->length);
+            break;
+        case 'a':
+        case 'f': {
+            const char* data = command->op == 'a' ? command->data : fill_data(command->id, command->offset);
+            if (command->op == 'f' && (command->offset < 0 || command->length < 0 ||
+                                       command->offset > MAX_PACKET_SIZE_BYTES - command->length)) {
+                data = NULL;
+            }
+            system_add_fragment_ex(system, command->id, command->offset, (const uint8_t*)data,
+                                   (size_t)command->length, command->last ? FRAGMENT_FLAG_LAST : 0);
+            run->fragments++;
+            break;
+        }
+        case 's':
+            system_show_stats(system);
+            break;
+        case 'p':
+            system_prune_timeouts(system);
+            break;
+        case '?':
+            system_print_packet_status(system, command->id);
+            break;
+    }
+}
+
+static void trace_run_report(TraceRun* run, const char* name) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("--- TRACE %s ---\n", name);
+    printf("Commands: %ld\n", run->commands);
+    printf("Fragments: %ld\n", run->fragments);
+    printf("ns/fragment (with parsing): %.1f\n", run->fragments > 0 ? run->elapsed * 1e9 / run->fragments : 0.0);
+    printf("Packets Completed: %ld\n", run->system.stats.packets_completed);
+    printf("Packets Still In Reassembly: %d\n", system_get_packet_count(&run->system));
+    printf("Fragments Discarded (Duplicate/Overlap): %ld\n", run->system.stats.total_duplicates_discarded);
+    printf("Fragments Discarded (Invalid/Bounds): %ld\n", run->system.stats.total_invalid_fragments);
+    printf("Heap Allocations: %ld\n", run->system.pools.heap_allocations);
+    printf("Peak RSS: %ld KB\n", usage.ru_maxrss);
+}
+
+
+// Parses "ID OFFSET ..." style fields; returns the position after the last
+// one, or NULL if a field is missing.
+static char* parse_ints(char* p, int* values, int count) {
+    for (int i = 0; i < count; i++) {
+        char* end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < INT_MIN || v > INT_MAX) return NULL;
+        values[i] = (int)v;
+        p = end;
+    }
+    return p;
+}
+
+static bool parse_text_command(char* line, TraceCommand* command) {
+    int v[4];
+    char* p = line;
+    while (*p == ' ' || *p == '\t') p++;
+    memset(command, 0, sizeof(*command));
+    command->op = *p++;
+    switch (command->op) {
+        case 'r':
+            if (parse_ints(p, v, 2) == NULL) return false;
+            command->id = v[0];
+            command->length = v[1];
+            return true;
+        case 'a':
+            p = parse_ints(p, v, 3);
+            if (p == NULL || *p != ' ') return false;
+            p++;
+            command->id = v[0];
+            command->offset = v[1];
+            command->last = v[2] != 0;
+            command->data = p;
+            command->length = (int)strcspn(p, "\r\n");
+            return true;
+        case 'f':
+            if (parse_ints(p, v, 4) == NULL) return false;
+            command->id = v[0];
+            command->offset = v[1];
+            command->length = v[2];
+            command->last = v[3] != 0;
+            return true;
+        case '?':
+            if (parse_ints(p, v, 1) == NULL) return false;
+            command->id = v[0];
+            return true;
+        case 's':
+        case 'p':
+            return true;
+    }
+    return false;
+}
+
+static int run_text_trace(FILE* in, TraceRun* run) {
+    char* line = NULL;
+    size_t capacity = 0;
+    ssize_t read;
+    long line_number = 0;
+    TraceCommand command;
+    while ((read = getline(&line, &capacity, in)) != -1) {
+        line_number++;
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+        if (!parse_text_command(line, &command)) {
+            printf("ERROR: Line %ld is not a trace command.\n", line_number);
+            free(line);
+            return -1;
+        }
+        trace_execute(run, &command);
+    }
+    free(line);
+    return 0;
+}
+
+static int run_binary_trace(FILE* in, TraceRun* run) {
+    uint8_t record[TRACE_RECORD_BYTES];
+    char* payload = NULL;
+    int payload_capacity = 0;
+    TraceCommand command;
+    int result = 0;
+    size_t got;
+    while ((got = fread(record, 1, sizeof(record), in)) == sizeof(record)) {
+        command.op = (char)record[0];
+        command.last = record[1] != 0;
+        command.id = (int)read_le32(record + 4);
+        command.offset = (int)read_le32(record + 8);
+        command.length = (int)read_le32(record + 12);
+        command.data = NULL;
+        if (command.op == 'a') {
+            if (command.length < 0) {
+                result = -1;
+                break;
+            }
+            if (command.length > payload_capacity) {
+                char* grown = (char*)realloc(payload, command.length);
+                if (grown == NULL) {
+                    result = -1;
+                    break;
+                }
+                payload = grown;
+                payload_capacity = command.length;
+            }
+            if (fread(payload, 1, command.length, in) != (size_t)command.length) {
+                result = -1;
+                break;
+            }
+            command.data = payload;
+        }
+        trace_execute(run, &command);
+    }
+    free(payload);
+    if (got != 0 && got != sizeof(record)) result = -1;
+    if (result != 0) printf("ERROR: Truncated or damaged binary trace.\n");
+    return result;
+}
+
+static int run_trace(const char* path, const SystemConfig* config, bool log) {
+    FILE* in = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (in == NULL) {
+        printf("ERROR: Cannot open %s.\n", path);
+        return 1;
+    }
+    setvbuf(in, NULL, _IOFBF, TRACE_IO_BUFFER);
+
+    TraceRun run;
+    trace_run_init(&run, config, log);
+    // No text command starts with the first byte of the magic.
+    int first = getc(in);
+    ungetc(first, in);
+    int result;
+    double start = now_seconds();
+    if (first == TRACE_MAGIC[0]) {
+        char magic[sizeof(TRACE_MAGIC) - 1];
+        if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+            printf("ERROR: %s is not a trace.\n", path);
+            result = -1;
+        } else {
+            result = run_binary_trace(in, &run);
+        }
+    } else {
+        result = run_text_trace(in, &run);
+    }
+    run.elapsed = now_seconds() - start;
+    if (in != stdin) fclose(in);
+
+    if (result == 0) trace_run_report(&run, path);
+    system_cleanup(&run.system);
+    return result == 0 ? 0 : 1;
+}
+
+
+static const Workload* find_workload(const char* name) {
+    for (int i = 0; i < WORKLOAD_COUNT; i++) {
+        if (strcmp(workloads[i].name, name) == 0) return &workloads[i];
+    }
+    return NULL;
+}
+
+static int workload_fragments(const Workload* workload) {
+    return (workload->packet_bytes + workload->fragment_bytes - 1) / workload->fragment_bytes;
+}
+
+static int workload_generator_init(WorkloadGenerator* generator, const Workload* workload, unsigned int seed) {
+    int per_window = workload->window * (1 + 2 * workload_fragments(workload));
+    generator->workload = workload;
+    generator->seed = seed != 0 ? seed : workload->seed;
+    generator->next_packet = 0;
+    generator->plan = (TraceCommand*)malloc(per_window * sizeof(TraceCommand));
+    return generator->plan != NULL ? 0 : -1;
+}
+
+// Plans the next window: its registrations, then its fragments in the
+// workload's order. Returns the number of commands, or 0 when done.
+static int workload_next_window(WorkloadGenerator* generator) {
+    const Workload* w = generator->workload;
+    int first = generator->next_packet;
+    int in_window = w->packets - first < w->window ? w->packets - first : w->window;
+    if (in_window <= 0) return 0;
+    generator->next_packet += in_window;
+
+    TraceCommand* plan = generator->plan;
+    int count = 0;
+    for (int p = 0; p < in_window; p++) {
+        plan[count++] = (TraceCommand){ 'r', false, first + p, 0, w->packet_bytes, NULL };
+    }
+    int fragments_start = count;
+    int fragments = workload_fragments(w);
+    for (int p = 0; p < in_window; p++) {
+        for (int f = 0; f < fragments; f++) {
+            int index = w->order == ORDER_REVERSE ? fragments - 1 - f : f;
+            int offset = index * w->fragment_bytes;
+            int length = w->packet_bytes - offset < w->fragment_bytes ? w->packet_bytes - offset : w->fragment_bytes;
+            TraceCommand command = { 'f', index == fragments - 1, first + p, offset, length, NULL };
+            plan[count++] = command;
+            if (w->duplicate_percent > 0 && (int)(next_random(&generator->seed) % 100) < w->duplicate_percent) {
+                plan[count++] = command;
+            }
+        }
+    }
+    if (w->order == ORDER_SHUFFLED) {
+        int n = count - fragments_start;
+        for (int i = n - 1; i > 0; i--) {
+            int j = (int)(next_random(&generator->seed) % (unsigned int)(i + 1));
+            TraceCommand tmp = plan[fragments_start + i];
+            plan[fragments_start + i] = plan[fragments_start + j];
+            plan[fragments_start + j] = tmp;
+        }
+    }
+    return count;
+}
+
+static int run_generate(const char* workload_name, const char* path, bool binary, int packets, unsigned int seed) {
+    const Workload* found = find_workload(workload_name);
+    if (found == NULL) {
+        printf("ERROR: Unknown workload %s.\n", workload_name);
+        return 1;
+    }
+    Workload workload = *found;
+    if (packets > 0) workload.packets = packets;
+
+    FILE* out = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (out == NULL) {
+        printf("ERROR: Cannot create %s.\n", path);
+        return 1;
+    }
+    setvbuf(out, NULL, _IOFBF, TRACE_IO_BUFFER);
+
+    WorkloadGenerator generator;
+    if (workload_generator_init(&generator, &workload, seed) != 0) {
+        printf("ERROR: Out of memory.\n");
+        if (out != stdout) fclose(out);
+        return 1;
+    }
+    if (binary) fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC) - 1, out);
+    else fprintf(out, "# %s: %d packets, seed %u\n", workload.name, workload.packets, generator.seed);
+
+    int count;
+    while ((count = workload_next_window(&generator)) > 0) {
+        for (int i = 0; i < count; i++) {
+            const TraceCommand* c = &generator.plan[i];
+            if (binary) {
+                uint8_t record[TRACE_RECORD_BYTES] = { (uint8_t)c->op, c->last };
+                write_le32(record + 4, (uint32_t)c->id);
+                write_le32(record + 8, (uint32_t)c->offset);
+                write_le32(record + 12, (uint32_t)c->length);
+                fwrite(record, 1, sizeof(record), out);
+            } else if (c->op == 'r') {
+                fprintf(out, "r %d %d\n", c->id, c->length);
+            } else {
+                fprintf(out, "f %d %d %d %d\n", c->id, c->offset, c->length, c->last);
+            }
+        }
+    }
+    free(generator.plan);
+    bool failed = ferror(out) != 0;
+    if (out != stdout && fclose(out) != 0) failed = true;
+    if (failed) {
+        printf("ERROR: Could not write %s.\n", path);
+        return 1;
+    }
+    return 0;
+}
+
+// Runs in a child process of its own, so peak RSS belongs to this workload
+// alone. Only executing the commands is timed, not planning them.
+static int bench_workload(const Workload* workload, const SystemConfig* config, unsigned int seed) {
+    SystemConfig bench_config = *config;
+    if (bench_config.max_packets < workload->window) bench_config.max_packets = workload->window;
+    TraceRun* run = (TraceRun*)malloc(sizeof(TraceRun));
+    WorkloadGenerator generator;
+    if (run == NULL || workload_generator_init(&generator, workload, seed) != 0) {
+        free(run);
+        return 1;
+    }
+    trace_run_init(run, &bench_config, false);
+
+    int count;
+    while ((count = workload_next_window(&generator)) > 0) {
+        double start = now_seconds();
+        for (int i = 0; i < count; i++) trace_execute(run, &generator.plan[i]);
+        run->elapsed += now_seconds() - start;
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%-16s %10ld %12.1f %10ld %12ld %12ld\n", workload->name, run->fragments,
+           run->elapsed * 1e9 / run->fragments, run->system.stats.packets_completed,
+           run->system.pools.heap_allocations, usage.ru_maxrss);
+    bool complete = run->system.stats.packets_completed == workload->packets;
+    system_cleanup(&run->system);
+    free(run);
+    free(generator.plan);
+    return complete ? 0 : 1;
+}
+
+static int run_bench(const char** names, int name_count, const SystemConfig* config, unsigned int seed) {
+    printf("%-16s %10s %12s %10s %12s %12s\n", "workload", "fragments", "ns/fragment", "completed", "heap allocs", "peak RSS KB");
+    int failures = 0;
+    for (int i = 0; i < WORKLOAD_COUNT; i++) {
+        bool selected = name_count == 0;
+        for (int n = 0; n < name_count; n++) {
+            if (strcmp(names[n], workloads[i].name) == 0) selected = true;
+        }
+        if (!selected) continue;
+
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            int status = bench_workload(&workloads[i], config, seed);
+            fflush(stdout);
+            _exit(status);
+        }
+        int status;
+        if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("%-16s did not complete every packet\n", workloads[i].name);
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+
+static void print_usage(void) {
+    printf("Usage:\n");
+    printf("  trace_driver run FILE|- [--buffer | --gather] [--tree | --array] [--max-packets N] [--log]\n");
+    printf("  trace_driver generate WORKLOAD FILE|- [--binary] [--packets N] [--seed N]\n");
+    printf("  trace_driver bench [WORKLOAD...] [--buffer | --gather] [--tree | --array] [--seed N]\n");
+    printf("Workloads:");
+    for (int i = 0; i < WORKLOAD_COUNT; i++) printf(" %s", workloads[i].name);
+    printf("\n");
+}
+
+// Engine options shared by `run` and `bench`; returns false for anything else.
+static bool parse_config_option(int argc, char** argv, int* i, SystemConfig* config) {
+    if (strcmp(argv[*i], "--buffer") == 0) config->reassembly_mode = REASSEMBLY_BUFFER;
+    else if (strcmp(argv[*i], "--gather") == 0) config->reassembly_mode = REASSEMBLY_GATHER;
+    else if (strcmp(argv[*i], "--tree") == 0) config->coverage_index = COVERAGE_TREE;
+    else if (strcmp(argv[*i], "--array") == 0) config->coverage_index = COVERAGE_ARRAY;
+    else if (strcmp(argv[*i], "--max-packets") == 0 && *i + 1 < argc) config->max_packets = atoi(argv[++*i]);
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+    static char out_buffer[TRACE_IO_BUFFER];
+    setvbuf(stdout, out_buffer, _IOFBF, sizeof(out_buffer));
+    fill_pattern_init();
+
+    SystemConfig config;
+    system_config_init(&config);
+    config.max_packets = 1 << 20;
+    unsigned int seed = 0;
+
+    if (strcmp(argv[1], "run") == 0 && argc >= 3) {
+        bool log = false;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--log") == 0) log = true;
+            else if (!parse_config_option(argc, argv, &i, &config)) {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_trace(argv[2], &config, log);
+    }
+
+    if (strcmp(argv[1], "generate") == 0 && argc >= 4) {
+        bool binary = false;
+        int packets = 0;
+        for (int i = 4; i < argc; i++) {
+            if (strcmp(argv[i], "--binary") == 0) binary = true;
+            else if (strcmp(argv[i], "--packets") == 0 && i + 1 < argc) packets = atoi(argv[++i]);
+            else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_generate(argv[2], argv[3], binary, packets, seed);
+    }
+
+    if (strcmp(argv[1], "bench") == 0) {
+        const char* names[WORKLOAD_COUNT];
+        int name_count = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+            else if (parse_config_option(argc, argv, &i, &config)) continue;
+            else if (find_workload(argv[i]) != NULL && name_count < WORKLOAD_COUNT) names[name_count++] = argv[i];
+            else {
+                print_usage();
+                return 1;
+            }
+        }
+        return run_bench(names, name_count, &config, seed);
+    }
+
+    print_usage();
+    return 1;
+}